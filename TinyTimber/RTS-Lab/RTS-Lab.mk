@@ -63,7 +63,7 @@ AS       := /Applications/ArmGNUToolchain/14.2.rel1/arm-none-eabi/bin/arm-none-e
 ##
 CodeLiteDir:=/private/var/folders/ry/f8n7m07n1nz6529xh6hnfp6w0000gn/T/AppTranslocation/D3E348A0-E25F-4802-9772-7F187FB39547/d/codelite.app/Contents/SharedSupport/
 Objects0=$(IntermediateDirectory)/driver_src_stm32f4xx_syscfg.c$(ObjectSuffix) $(IntermediateDirectory)/driver_src_stm32f4xx_exti.c$(ObjectSuffix) $(IntermediateDirectory)/driver_src_stm32f4xx_can.c$(ObjectSuffix) $(IntermediateDirectory)/driver_src_stm32f4xx_usart.c$(ObjectSuffix) $(IntermediateDirectory)/driver_src_stm32f4xx_rcc.c$(ObjectSuffix) $(IntermediateDirectory)/driver_src_stm32f4xx_gpio.c$(ObjectSuffix) $(IntermediateDirectory)/startup.c$(ObjectSuffix) $(IntermediateDirectory)/driver_src_stm32f4xx_tim.c$(ObjectSuffix) $(IntermediateDirectory)/driver_src_stm32f4xx_dac.c$(ObjectSuffix) $(IntermediateDirectory)/sciTinyTimber.c$(ObjectSuffix) \
-	$(IntermediateDirectory)/TinyTimber.c$(ObjectSuffix) $(IntermediateDirectory)/dispatch.s$(ObjectSuffix) $(IntermediateDirectory)/application.c$(ObjectSuffix) $(IntermediateDirectory)/canTinyTimber.c$(ObjectSuffix) 
+	$(IntermediateDirectory)/TinyTimber.c$(ObjectSuffix) $(IntermediateDirectory)/dispatch.s$(ObjectSuffix) $(IntermediateDirectory)/application.c$(ObjectSuffix) $(IntermediateDirectory)/canTinyTimber.c$(ObjectSuffix) $(IntermediateDirectory)/dacTinyTimber.c$(ObjectSuffix) $(IntermediateDirectory)/synthTinyTimber.c$(ObjectSuffix) $(IntermediateDirectory)/pwmTinyTimber.c$(ObjectSuffix) 
 
 
 
@@ -183,6 +183,24 @@ $(IntermediateDirectory)/canTinyTimber.c$(ObjectSuffix): canTinyTimber.c
 $(IntermediateDirectory)/canTinyTimber.c$(PreprocessSuffix): canTinyTimber.c
 	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/canTinyTimber.c$(PreprocessSuffix) canTinyTimber.c
 
+$(IntermediateDirectory)/dacTinyTimber.c$(ObjectSuffix): dacTinyTimber.c
+	@$(CC) $(CFLAGS) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/dacTinyTimber.c$(ObjectSuffix) -MF$(IntermediateDirectory)/dacTinyTimber.c$(DependSuffix) -MM dacTinyTimber.c
+	$(CC) $(SourceSwitch) "/Users/lingzhixiang/Documents/GitHub/Real-Tiime/TinyTimber/RTS-Lab/dacTinyTimber.c" $(CFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/dacTinyTimber.c$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/dacTinyTimber.c$(PreprocessSuffix): dacTinyTimber.c
+	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/dacTinyTimber.c$(PreprocessSuffix) dacTinyTimber.c
+
+$(IntermediateDirectory)/synthTinyTimber.c$(ObjectSuffix): synthTinyTimber.c
+	@$(CC) $(CFLAGS) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/synthTinyTimber.c$(ObjectSuffix) -MF$(IntermediateDirectory)/synthTinyTimber.c$(DependSuffix) -MM synthTinyTimber.c
+	$(CC) $(SourceSwitch) "/Users/lingzhixiang/Documents/GitHub/Real-Tiime/TinyTimber/RTS-Lab/synthTinyTimber.c" $(CFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/synthTinyTimber.c$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/synthTinyTimber.c$(PreprocessSuffix): synthTinyTimber.c
+	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/synthTinyTimber.c$(PreprocessSuffix) synthTinyTimber.c
+
+$(IntermediateDirectory)/pwmTinyTimber.c$(ObjectSuffix): pwmTinyTimber.c
+	@$(CC) $(CFLAGS) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/pwmTinyTimber.c$(ObjectSuffix) -MF$(IntermediateDirectory)/pwmTinyTimber.c$(DependSuffix) -MM pwmTinyTimber.c
+	$(CC) $(SourceSwitch) "/Users/lingzhixiang/Documents/GitHub/Real-Tiime/TinyTimber/RTS-Lab/pwmTinyTimber.c" $(CFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/pwmTinyTimber.c$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/pwmTinyTimber.c$(PreprocessSuffix): pwmTinyTimber.c
+	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/pwmTinyTimber.c$(PreprocessSuffix) pwmTinyTimber.c
+
 
 -include $(IntermediateDirectory)/*$(DependSuffix)
 ##
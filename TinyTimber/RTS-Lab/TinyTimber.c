@@ -37,12 +37,26 @@
  *
  */
 
+#if defined(__TT_HOST)
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+#if defined(__TT_SIM)
+#include "stm32sim.h"
+#endif
 #include "TinyTimber.h"
+#if !defined(__TT_HOST_IO)
 #include "stm32f4xx.h"
 #include "stm32f4xx_gpio.h"
 #include "stm32f4xx_usart.h"
 #include "stm32f4xx_tim.h"
 #include "stm32f4xx_rcc.h"
+#endif
+#include <string.h>
 
 void DUMPC(char);
 
@@ -87,6 +101,99 @@ void DUMPD(int val) {
 
 }
 
+#if defined(__TT_HOST)
+
+// Host (POSIX) dependencies
+//
+// Signals stand in for interrupts: SIGALRM for the TIM5 compare and SIGIO
+// for USART1 input. Blocking them stands in for BASEPRI, and each thread
+// keeps its own signal mask in its ucontext, as it keeps BASEPRI on target.
+//
+// Under __TT_SIM the devices are the register models of host/stm32sim.c
+// instead, and the simulator calls the vectors installed at 0x2001C000
+// whenever interrupts are unmasked.
+
+#undef __USE_SAFE_TIMER
+
+#if defined(__TT_SIM)
+
+#define PROTECTED()     (simMasked)
+#define ENABLED()       (!PROTECTED())
+#define DISABLE()       { simMasked = 1; }
+#define ENABLE(s)       { if (s) simUnmask(); }
+#define SLEEP()         { simSleep(); }
+
+#else
+
+sigset_t irqSignals;            // all simulated interrupt sources
+
+static int PROTECTED(void) {
+    sigset_t s;
+    sigprocmask(SIG_BLOCK, NULL, &s);
+    return sigismember(&s, SIGALRM);
+}
+
+#define ENABLED()       (!PROTECTED())
+#define DISABLE()       { sigprocmask(SIG_BLOCK, &irqSignals, NULL); }
+#define ENABLE(s)       { if (s) sigprocmask(SIG_UNBLOCK, &irqSignals, NULL); }
+#define SLEEP()         { pause(); }
+
+#endif
+
+#define RED_ALERT()     { DUMP("RED ALERT\n\r"); }
+
+#define PANIC(s)        { DUMP("PANIC!!! "); DUMP(s); abort(); }
+
+#undef __CLZ
+#undef __RBIT
+#undef __DMB
+#define __CLZ(x)        ((x) ? __builtin_clz(x) : 32)
+#define __RBIT(x)       hostRbit(x)
+#define __DMB()         __sync_synchronize()
+#define CAS(p,old,new)  __sync_bool_compare_and_swap(p, old, new)
+
+static inline uint32_t hostRbit(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+    return __builtin_bswap32(x);
+}
+
+#if !defined(__TT_SIM)
+
+// Back the peripheral and core register ranges with plain memory, so that
+// applications addressing registers directly run unmodified.
+static void hostMap(uintptr_t base, size_t size) {
+    void *p = mmap((void *)base, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (p != (void *)base) {
+        DUMP("TinyTimber: cannot map register space\n\r");
+        exit(1);
+    }
+}
+
+__attribute__((constructor))
+static void hostInit(void) {
+    sigemptyset(&irqSignals);
+    sigaddset(&irqSignals, SIGALRM);
+    sigaddset(&irqSignals, SIGIO);
+    hostMap(PERIPH_BASE, 0x80000);          // APB1, APB2, AHB1
+    hostMap(0xE0000000, 0x100000);          // DWT, SCB, CoreDebug
+}
+
+void hostHandle(int sig, void (*handler)(int)) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sa.sa_mask = irqSignals;                // one interrupt level, as __IRQ_PRIORITY
+    sa.sa_flags = SA_RESTART;
+    sigaction(sig, &sa, NULL);
+}
+
+#endif
+
+#else
+
 // Cortex m4 dependencies
 
 #define __CURRENT_PRIORITY ((__get_BASEPRI() >> (8 - __NVIC_PRIO_BITS)))
@@ -135,8 +242,41 @@ void *_sbrk (int incr)
 }
 #endif
 
-#define NMSGS           30
+#define CAS(p,old,new)  (__LDREXW(p) == (old) ? !__STREXW(new, p) : (__CLREX(), 0))
+
+#endif
+
+#ifndef NMSGS
+#define NMSGS           30              // host/readyq.c sets more
+#endif
 #define NTHREADS        4
+#define NPROFILES       16              // methods profiled, power of 2
+#define NMISSES         8               // object/method pairs with deadline misses
+#define NTRACE          256             // trace events buffered, power of 2
+
+#if defined(__TT_HOST)
+
+#define CONTEXT_T       ucontext_t
+
+#define STACKSIZE       16384           // libc needs more than the target code
+
+#define STACK_T long long
+
+struct stack;
+
+#define SETCONTEXT(c)   getcontext(&(c))
+
+void SETSTACK(CONTEXT_T *cp, struct stack *sp) {
+    cp->uc_stack.ss_sp = sp;
+    cp->uc_stack.ss_size = STACKSIZE*sizeof(STACK_T);
+    cp->uc_link = NULL;
+}
+
+void SETPC(CONTEXT_T *cp, void (*fp)(void)) {
+    makecontext(cp, fp, 0);
+}
+
+#else
 
 #define CONTEXTSIZE		(2+16+8+16+10)
 
@@ -200,6 +340,80 @@ PendSV_Exception;
 
 SVCall_Exception;
 
+#endif
+
+#if defined(__TT_HOST_IO)
+
+#define TIMER_COMPARE_INTERRUPT void vect_TIM5( void ) 
+
+TIMER_COMPARE_INTERRUPT;
+
+void vect_USART1( void );
+
+static void onAlarm(int sig)    { vect_TIM5(); }
+static void onInput(int sig)    { vect_USART1(); }
+
+timer_t hostTimer;
+struct timespec hostEpoch;      // Time 0
+
+void TIMER_INIT() {
+    struct sigevent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_SIGNAL;
+    ev.sigev_signo = SIGALRM;
+    clock_gettime(CLOCK_MONOTONIC, &hostEpoch);
+    hostHandle(SIGALRM, onAlarm);
+    if (timer_create(CLOCK_MONOTONIC, &ev, &hostTimer))
+        PANIC("timer_create failed\n\r");
+}
+
+#define TIMER_CCLR()
+
+static Time TIMER_READ(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec -= hostEpoch.tv_sec;
+    ts.tv_nsec -= hostEpoch.tv_nsec;
+    if (ts.tv_nsec < 0) {
+        ts.tv_sec--;
+        ts.tv_nsec += 1000000000;
+    }
+    return (Time)ts.tv_sec * __TIMER_HZ + (Time)ts.tv_nsec * __TIMER_HZ / 1000000000;
+}
+
+#define TIMERGET(x)		(x = TIMER_READ())
+
+// Arm the compare for Time t, rounding up so that it never fires early;
+// an absolute time already passed fires at once.
+static void TIMER_ARM(Time t) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = hostEpoch.tv_sec + t / __TIMER_HZ;
+    its.it_value.tv_nsec = hostEpoch.tv_nsec + (t % __TIMER_HZ * 1000000000 + __TIMER_HZ - 1) / __TIMER_HZ;
+    if (its.it_value.tv_nsec >= 1000000000) {
+        its.it_value.tv_sec++;
+        its.it_value.tv_nsec -= 1000000000;
+    }
+    timer_settime(hostTimer, TIMER_ABSTIME, &its, NULL);
+}
+
+#define TIMERSET(t)		TIMER_ARM(t)
+
+#define CYCLES_INIT()
+
+static uint32_t CYCLES(void) {  // nanoseconds stand in for CPU cycles
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+void DUMPC(char c) {
+    if (write(2, &c, 1) < 0)
+        return;
+}
+
+#else
+
 #define	TIM5_IRQ_VECTOR			(0x2001C000+0x108)
 #define TIMER_COMPARE_INTERRUPT void vect_TIM5( void ) 
 
@@ -222,6 +436,7 @@ void TIMER_INIT() {
 	TIM_TimeBaseInitStructure.TIM_Prescaler = __TIMER_PRESCALE;
 	TIM_TimeBaseInit(TIM5, &TIM_TimeBaseInitStructure);
 
+#if !defined(__TT_HOST)
 	*((void (**)(void) ) PendSV_IRQ_VECTOR ) = vect_PendSV;
 
 	NVIC_SetPriority(PendSV_IRQn, __IRQ_PRIORITY); // same priority as timer and USART1
@@ -229,6 +444,7 @@ void TIMER_INIT() {
 	*((void (**)(void) ) SVCall_IRQ_VECTOR ) = vect_SVCall;
 
 	NVIC_SetPriority(SVCall_IRQn, 0x00); // highest priority
+#endif
 
 	*((void (**)(void) ) TIM5_IRQ_VECTOR ) = vect_TIM5;
 
@@ -236,44 +452,104 @@ void TIMER_INIT() {
 	NVIC_EnableIRQ( TIM5_IRQn);
 
 	TIM_SetCounter(TIM5, 0);	
+	TIM_ClearITPendingBit(TIM5, TIM_IT_Update);  // left pending by the prescaler reload
 	TIM_Cmd( TIM5, ENABLE);
 
-	TIM_ITConfig( TIM5, TIM_IT_CC1, ENABLE);	
+	TIM_ITConfig( TIM5, TIM_IT_CC1 | TIM_IT_Update, ENABLE);	
 }
 
 #define TIMER_CCLR()    { TIM_ClearITPendingBit(TIM5, TIM_IT_CC1); }  // Timer compare interrupt clear
 
-#define TIMERGET(x)		(x = TIM_GetCounter(TIM5))
+unsigned int overflows = 0;     // upper 32 bits of Time, counted by TIM5 update interrupts
+
+// Extend the 32 bit TIM5 counter to a 64 bit Time. Must run with the TIM5
+// interrupt masked; an overflow that is pending but not yet counted is
+// accounted for if the counter was read after the wrap.
+static Time TIMER_READ(void) {
+	unsigned int hi = overflows;
+	uint32_t lo = TIM_GetCounter(TIM5);
+	if ((TIM5->SR & TIM_SR_UIF) && lo < 0x80000000)
+		hi++;
+	return ((Time)hi << 32) | lo;
+}
 
-#define TIMERSET(x)		(TIM_SetCompare1(TIM5, x->baseline))
+#define TIMERGET(x)		(x = TIMER_READ())
+
+// Program the compare for Time t; it matches the low 32 bits, early matches
+// are ignored. An event passed before the write took effect (a few ticks
+// at 84 MHz) is pended by hand rather than waiting for the next wrap.
+static void TIMER_ARM(Time t) {
+	Time now;
+	TIM_SetCompare1(TIM5, (uint32_t)t);
+	TIMERGET(now);
+	if (t - now <= 0)
+		TIM_GenerateEvent(TIM5, TIM_EventSource_CC1);
+}
+
+#define TIMERSET(t)		TIMER_ARM(t)
+
+#define CYCLES_INIT()   { CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; DWT->CYCCNT = 0; DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk; }
 
-#define INFINITY        0x7fffffffL
+#define CYCLES()        (DWT->CYCCNT)
 
 void DUMPC(char c) {
    USART_SendData(USART1, c );
    while (USART_GetFlagStatus(USART1, USART_FLAG_TXE) == RESET);    
 }
 
+#endif
+
+#define INFINITY        ((Time)1 << 62)     // relative deadline of "no deadline", leaves headroom for comparisons
+
 // End of target dependencies
 
 typedef struct thread_block *Thread;
 
+typedef struct msg_block *Message;
+
 #define INSTALLED_TAG (Thread)1
 
+enum MsgState { MSG_FREE, MSG_TIMER, MSG_READY, MSG_RUNNING };
+
+#ifndef MSG_INDEX_BITS
+#define MSG_INDEX_BITS  8       // Msg handle = generation << 8 | slot index
+#endif
+#define MSG_INDEX_MASK  ((1 << MSG_INDEX_BITS) - 1)
+
+#if NMSGS > (1 << MSG_INDEX_BITS)
+#error "NMSGS does not fit in the Msg handle index"
+#endif
+
 struct msg_block {
-    Msg next;                // for use in linked lists
+    Message next;            // for use in linked lists
+    Message prev;            // back link in queues (pairing heap: left sibling or parent)
     Time baseline;           // event time reference point
     Time deadline;           // absolute deadline (=priority)
     Object *to;              // receiving object
     Method method;           // code to run
     int arg;                 // argument to the above
+    Time period;             // re-arm interval, 0 for one-shot messages
+    Msg handle;              // current handle, generation changes on reuse
+    char state;              // enum MsgState, tells which queue holds the message
+    Thread thread;           // executing thread when state == MSG_RUNNING
+#if defined(__USE_BINARY_HEAP_READYQ)
+    int heapIndex;           // position in readyHeap
+    unsigned int seqno;      // arrival order, keeps equal deadlines FIFO
+#elif defined(__USE_PAIRING_HEAP_READYQ)
+    Message child;           // leftmost child in pairing heap
+    Message sibling;         // right sibling in pairing heap
+    unsigned int seqno;      // arrival order, keeps equal deadlines FIFO
+#endif
+#if defined(__USE_TIMING_WHEEL)
+    int wheelSlot;           // slot in timer wheel
+#endif
 };
 
 struct thread_block {
 	CONTEXT_T context;     	 // machine state */
 	int thread_no;
     Thread next;             // for use in linked lists
-    Msg msg;                 // message under execution
+    Message msg;             // message under execution
     Object *waitsFor;        // deadlock detection link
 };
 
@@ -287,13 +563,56 @@ struct stack        stacks[NTHREADS];
 
 struct thread_block thread0;
 
-Msg msgPool         = messages;
-Msg msgQ            = NULL;
-Msg timerQ          = NULL;
+Message msgPool     = messages;
+#if defined(__USE_BINARY_HEAP_READYQ)
+Message readyHeap[NMSGS];
+int readyCount      = 0;
+unsigned int readySeq = 0;
+#elif defined(__USE_PAIRING_HEAP_READYQ)
+Message msgQ        = NULL;  // root of pairing heap
+unsigned int readySeq = 0;
+#else
+Message msgQ        = NULL;
+#endif
+#if defined(__USE_TIMING_WHEEL)
+#define WHEEL_BITS      5
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    13                  // 13*5 bits covers a 64 bit Time
+
+typedef uint64_t WheelKey;                  // Time as unsigned, for bit fields
+
+Message timerQ[WHEEL_LEVELS*WHEEL_SLOTS];   // circular lists, entry points at tail
+uint32_t wheelMap[WHEEL_LEVELS];            // non-empty slots per level
+uint32_t wheelLevels = 0;                   // non-empty levels
+Time wheelTime      = 0;                    // reference point for slot placement
+Time wheelNext      = 0;                    // earliest pending baseline
+int wheelCount      = 0;
+#else
+Message timerQ      = NULL;
+#endif
 int runAsHardware	= 0;
 int doIRQSchedule	= 0;
 Time timestamp      = 0;
-int overflows       = 0;
+
+#if defined(__USE_PROFILER)
+Profile profiles[NPROFILES];
+uint32_t profileExec = 0;               // cycles spent in completed messages
+unsigned int profileMisses = 0;         // completions not recorded, table full
+#endif
+#if defined(__USE_DEADLINE_CHECK)
+DeadlineMiss misses[NMISSES];
+unsigned int missOverflows = 0;         // misses not recorded, table full
+Object *missObj     = NULL;             // DEADLINE_HOOK receiver
+Method missMeth     = NULL;
+Msg missMsg         = 0;                // pending hook invocation
+#endif
+#if defined(__USE_TRACE)
+TraceEvent traceBuf[NTRACE];
+volatile uint32_t traceHead = 0;        // next slot to reserve
+volatile uint32_t traceTail = 0;        // next slot to read
+unsigned int traceDrops = 0;            // events lost to a full buffer
+#endif
 
 Thread threadPool   = threads;
 Thread activeStack  = &thread0;
@@ -306,71 +625,116 @@ Object *otable[N_VECTORS];
 static void dispatch( Thread);
 static void schedule( void);
 
+#if defined(__USE_TRACE)
+// Append an event; safe from any context without locking. A slot is
+// reserved by advancing traceHead atomically, and published by writing its
+// type last.
+static void trace(int type, Message m, uint32_t arg) {
+    uint32_t i;
+    TraceEvent *e;
+    do {
+        i = traceHead;
+        if (i - traceTail >= NTRACE) {
+            traceDrops++;
+            return;
+        }
+    } while (!CAS(&traceHead, i, i + 1));
+    e = &traceBuf[i & (NTRACE - 1)];
+    e->time = CYCLES();
+    e->thread = current->thread_no;
+    e->msg = m ? m->handle : 0;
+    e->arg = arg;
+    __DMB();
+    e->type = type;
+}
+
+#define TRACE(type,m,arg)   trace(type, m, (uint32_t)(uintptr_t)(arg))
+#else
+#define TRACE(type,m,arg)
+#endif
+
+#if !defined(__TT_HOST_IO)
+
 // Cortex m4 dependencies
 
 #define	    USART1_IRQ_VECTOR		(0x2001C000+0xD4)
 #define	    CAN1_IRQ_VECTOR			(0x2001C000+0x90)
 #define	    EXTI9_5_IRQ_VECTOR		(0x2001C000+0x9C)
+#define	    DMA2_STREAM5_IRQ_VECTOR	(0x2001C000+0x150)
+#define	    DMA2_STREAM7_IRQ_VECTOR	(0x2001C000+0x158)
+#define	    CAN1_TX_IRQ_VECTOR		(0x2001C000+0x8C)
+#define	    CAN2_TX_IRQ_VECTOR		(0x2001C000+0x13C)
+#define	    CAN1_RX1_IRQ_VECTOR		(0x2001C000+0x94)
+#define	    DMA1_STREAM6_IRQ_VECTOR	(0x2001C000+0x84)
+
+#endif
 
-#ifdef	__TRACE_SCHEDULE
-#define IRQ(n,v) void v (void) { \
-        DISABLE(); TIMERGET(timestamp); runAsHardware = 1; doIRQSchedule = 0; \
-        if (mtable[n]) mtable[n](otable[n],n); \
-		DUMP("schedule() in IRQ()"); DUMP("\n\r"); \
-        runAsHardware = 0; if (doIRQSchedule) schedule(); doIRQSchedule = 0; ENABLE(1); \
-}
-#else
 #define IRQ(n,v) void v (void) { \
+        TRACE(TRACE_IRQ_ENTER, NULL, n); \
         TIMERGET(timestamp); runAsHardware = 1; doIRQSchedule = 0; \
         if (mtable[n]) mtable[n](otable[n],n); \
+        TRACE(TRACE_IRQ_EXIT, NULL, n); \
 		runAsHardware = 0; if (doIRQSchedule) schedule(); doIRQSchedule = 0; \
 }
-#endif
 
 IRQ(IRQ_USART1,		vect_USART1);
 IRQ(IRQ_CAN1,		vect_CAN1);
 IRQ(IRQ_EXTI9_5,	vect_EXTI9_5);
+IRQ(IRQ_DMA2_STREAM5,	vect_DMA2_Stream5);
+IRQ(IRQ_DMA2_STREAM7,	vect_DMA2_Stream7);
+IRQ(IRQ_CAN1_TX,	vect_CAN1_TX);
+IRQ(IRQ_CAN2_TX,	vect_CAN2_TX);
+IRQ(IRQ_CAN1_RX1,	vect_CAN1_RX1);
+IRQ(IRQ_DMA1_STREAM6,	vect_DMA1_Stream6);
 
 // End of target dependencies
 
 /* queue manager */
-void enqueueByDeadline(Msg p, Msg *queue) {
-    Msg prev = NULL, q = *queue;
+void enqueueByDeadline(Message p, Message *queue) {
+    Message prev = NULL, q = *queue;
     while (q && (q->deadline <= p->deadline)) {
         prev = q;
         q = q->next;
     }
     p->next = q;
+    p->prev = prev;
+    if (q)
+        q->prev = p;
     if (prev == NULL)
         *queue = p;
     else
         prev->next = p;
 }
 
-void enqueueByBaseline(Msg p, Msg *queue) {
-    Msg prev = NULL, q = *queue;
+void enqueueByBaseline(Message p, Message *queue) {
+    Message prev = NULL, q = *queue;
     while (q && (q->baseline <= p->baseline )) {
         prev = q;
         q = q->next;
     }
     p->next = q;
+    p->prev = prev;
+    if (q)
+        q->prev = p;
     if (prev == NULL)
         *queue = p;
     else
         prev->next = p;
 }
 
-Msg dequeue(Msg *queue) {
-    Msg m = *queue;
-    if (m)
+Message dequeue(Message *queue) {
+    Message m = *queue;
+    if (m) {
         *queue = m->next;
-    else
+        if (m->next)
+            m->next->prev = NULL;
+    } else
         PANIC("Empty queue");  // Empty queue, kernel panic!!!
     return m;
 }
 
-Msg dequeue_pool(Msg *queue) {
-    Msg m = *queue;
+Message dequeue_pool(Message *queue) {
+    Message m = *queue;
     if (m)
         *queue = m->next;
     else
@@ -378,7 +742,7 @@ Msg dequeue_pool(Msg *queue) {
     return m;
 }
 
-void insert(Msg m, Msg *queue) {
+void insert(Message m, Message *queue) {
     m->next = *queue;
     *queue = m;
 }
@@ -394,65 +758,480 @@ Thread pop(Thread *stack) {
     return t;
 }
 
-static int remove(Msg m, Msg *queue) {
-    Msg prev = NULL, q = *queue;
-    while (q && (q != m)) {
-        prev = q;
+#if !(defined(__USE_BINARY_HEAP_READYQ) || defined(__USE_PAIRING_HEAP_READYQ)) || !defined(__USE_TIMING_WHEEL)
+static void remove(Message m, Message *queue) {     // for the list queues only
+    if (m->prev)
+        m->prev->next = m->next;
+    else
+        *queue = m->next;
+    if (m->next)
+        m->next->prev = m->prev;
+}
+#endif
+
+static Message messageOf(Msg h) {    // NULL for stale or bogus handles
+    unsigned int i = h & MSG_INDEX_MASK;
+    if (i < NMSGS && messages[i].handle == h && messages[i].state != MSG_FREE)
+        return &messages[i];
+    return NULL;
+}
+
+static void release(Message m) {    // back to msgPool under a fresh handle
+    m->handle += 1 << MSG_INDEX_BITS;
+    if ((m->handle >> MSG_INDEX_BITS) == 0)
+        m->handle += 1 << MSG_INDEX_BITS;   // generation 0 is reserved, keeps handles non-zero
+    m->state = MSG_FREE;
+    insert(m, &msgPool);
+}
+
+static void rearm(Message m);
+
+/* ready queue (msgQ) */
+#if defined(__USE_BINARY_HEAP_READYQ) || defined(__USE_PAIRING_HEAP_READYQ)
+static int readyBefore(Message a, Message b) {
+    Time d = a->deadline - b->deadline;
+    return (d < 0) || (d == 0 && (int)(a->seqno - b->seqno) < 0);
+}
+#endif
+
+#if defined(__USE_BINARY_HEAP_READYQ)
+
+static void heapPlace(Message m, int i) {
+    readyHeap[i] = m;
+    m->heapIndex = i;
+}
+
+static void siftUp(int i) {
+    Message m = readyHeap[i];
+    while (i > 0) {
+        int parent = (i - 1) >> 1;
+        if (!readyBefore(m, readyHeap[parent]))
+            break;
+        heapPlace(readyHeap[parent], i);
+        i = parent;
+    }
+    heapPlace(m, i);
+}
+
+static void siftDown(int i) {
+    Message m = readyHeap[i];
+    while (1) {
+        int child = 2*i + 1;
+        if (child >= readyCount)
+            break;
+        if (child + 1 < readyCount && readyBefore(readyHeap[child+1], readyHeap[child]))
+            child++;
+        if (!readyBefore(readyHeap[child], m))
+            break;
+        heapPlace(readyHeap[child], i);
+        i = child;
+    }
+    heapPlace(m, i);
+}
+
+#define peekReady()     (readyCount ? readyHeap[0] : NULL)
+
+void enqueueReady(Message p) {
+    p->seqno = readySeq++;
+    readyHeap[readyCount] = p;
+    siftUp(readyCount++);
+}
+
+static void removeAt(int i) {
+    Message last = readyHeap[--readyCount];
+    if (i < readyCount) {
+        heapPlace(last, i);
+        siftUp(i);
+        siftDown(last->heapIndex);
+    }
+}
+
+Message dequeueReady(void) {
+    Message m = peekReady();
+    if (m)
+        removeAt(0);
+    else
+        PANIC("Empty queue");  // Empty queue, kernel panic!!!
+    return m;
+}
+
+static void removeReady(Message m) {
+    removeAt(m->heapIndex);
+}
+
+#elif defined(__USE_PAIRING_HEAP_READYQ)
+
+static Message meld(Message a, Message b) {
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (readyBefore(b, a)) {
+        Message t = a; a = b; b = t;
+    }
+    b->prev = a;                    // b becomes leftmost child of a
+    b->sibling = a->child;
+    if (a->child)
+        a->child->prev = b;
+    a->child = b;
+    a->sibling = a->prev = NULL;
+    return a;
+}
+
+static Message mergePairs(Message first) {
+    Message pairs = NULL, a, b;
+    while (first) {                 // left to right: meld pairs, stack them up
+        a = first;
+        b = a->sibling;
+        first = b ? b->sibling : NULL;
+        a->sibling = a->prev = NULL;
+        if (b)
+            b->sibling = b->prev = NULL;
+        a = meld(a, b);
+        a->sibling = pairs;
+        pairs = a;
+    }
+    first = NULL;
+    while (pairs) {                 // right to left: meld into one heap
+        a = pairs;
+        pairs = a->sibling;
+        a->sibling = NULL;
+        first = meld(first, a);
+    }
+    return first;
+}
+
+#define peekReady()     (msgQ)
+
+void enqueueReady(Message p) {
+    p->seqno = readySeq++;
+    p->child = p->sibling = p->prev = NULL;
+    msgQ = meld(msgQ, p);
+}
+
+Message dequeueReady(void) {
+    Message m = msgQ;
+    if (m) {
+        msgQ = mergePairs(m->child);
+        m->child = NULL;
+    } else
+        PANIC("Empty queue");  // Empty queue, kernel panic!!!
+    return m;
+}
+
+static void removeReady(Message m) {
+    if (m == msgQ) {
+        dequeueReady();
+        return;
+    }
+    if (m->prev->child == m)
+        m->prev->child = m->sibling;
+    else
+        m->prev->sibling = m->sibling;
+    if (m->sibling)
+        m->sibling->prev = m->prev;
+    m->sibling = m->prev = NULL;
+    msgQ = meld(msgQ, mergePairs(m->child));
+    m->child = NULL;
+}
+
+#else
+
+#define peekReady()     (msgQ)
+#define enqueueReady(p) enqueueByDeadline(p, &msgQ)
+#define dequeueReady()  dequeue(&msgQ)
+#define removeReady(m)  remove(m, &msgQ)
+
+#endif
+
+/* timer queue (timerQ) */
+#if defined(__USE_TIMING_WHEEL)
+
+/*
+ * Hierarchical timing wheel: level L holds messages whose baseline first
+ * differs from wheelTime in bits [5L, 5L+5), filed by those bits. Every
+ * message on level L is thus due before any message on level L+1, and
+ * wheelTime only ever advances to the start of the earliest non-empty
+ * slot, where that slot is cascaded one or more levels down. Time is 64
+ * bits wide, so baselines never wrap around the top level.
+ */
+
+static int wheelLevel(Time t) {     // level on which t differs from wheelTime
+    WheelKey x = (WheelKey)(t ^ wheelTime);
+    uint32_t hi = (uint32_t)(x >> 32);
+    int msb = hi ? 63 - __CLZ(hi) : 31 - __CLZ((uint32_t)x);
+    return msb < 0 ? 0 : msb / WHEEL_BITS;
+}
+
+static void wheelPlace(Message p) {
+    int level = wheelLevel(p->baseline);
+    int i = level*WHEEL_SLOTS + (int)(((WheelKey)p->baseline >> (level*WHEEL_BITS)) & WHEEL_MASK);
+    Message tail = timerQ[i];
+    if (tail) {                     // append, keeps equal baselines FIFO
+        p->next = tail->next;
+        p->prev = tail;
+        tail->next->prev = p;
+        tail->next = p;
+    } else {
+        p->next = p->prev = p;
+        wheelMap[level] |= 1u << (i & WHEEL_MASK);
+        wheelLevels |= 1u << level;
+    }
+    timerQ[i] = p;
+    p->wheelSlot = i;
+}
+
+static int wheelFirst(void) {       // earliest non-empty slot, or -1
+    int level, cur;
+    uint32_t map;
+    if (!wheelLevels)
+        return -1;
+    level = __CLZ(__RBIT(wheelLevels));
+    map = wheelMap[level];
+    cur = (int)(((WheelKey)wheelTime >> (level*WHEEL_BITS)) & WHEEL_MASK);
+    map = (map >> cur) | (map << ((WHEEL_SLOTS - cur) & WHEEL_MASK));
+    return level*WHEEL_SLOTS + ((cur + __CLZ(__RBIT(map))) & WHEEL_MASK);
+}
+
+static Time wheelSlotTime(int i) {  // start of slot i relative to wheelTime
+    int shift = (i / WHEEL_SLOTS) * WHEEL_BITS;
+    WheelKey cur = ((WheelKey)wheelTime >> shift) & WHEEL_MASK;
+    WheelKey base = (WheelKey)wheelTime & ~(((WheelKey)1 << shift) - 1);
+    return (Time)(base + ((((WheelKey)i - cur) & WHEEL_MASK) << shift));
+}
+
+static void wheelClear(int i) {     // mark slot i empty
+    int level = i / WHEEL_SLOTS;
+    timerQ[i] = NULL;
+    wheelMap[level] &= ~(1u << (i & WHEEL_MASK));
+    if (!wheelMap[level])
+        wheelLevels &= ~(1u << level);
+}
+
+static Time wheelEarliest(int i) {  // earliest baseline in slot i
+    Message tail = timerQ[i], q = tail->next;
+    Time t = q->baseline;
+    if (i < WHEEL_SLOTS)
+        return t;                   // level 0 slots hold a single baseline
+    while (q != tail) {
         q = q->next;
+        if (q->baseline - t < 0)
+            t = q->baseline;
     }
-    if (q) {
-        if (prev)
-            prev->next = q->next;
-        else
-            *queue = q->next;
-        return 1;
+    return t;
+}
+
+void enqueueTimer(Message p, Time now) {
+    if (wheelCount++ == 0) {
+        wheelTime = now;            // resynchronize an idle wheel
+        wheelNext = p->baseline;
+    } else if (p->baseline - wheelNext < 0)
+        wheelNext = p->baseline;
+    wheelPlace(p);
+}
+
+void expireTimers(Time now) {
+    int i;
+    while ((i = wheelFirst()) >= 0) {
+        Time t = wheelSlotTime(i);
+        Message tail = timerQ[i], q;
+        if (t - now > 0)
+            break;
+        wheelClear(i);
+        wheelTime = t;
+        q = tail->next;
+        tail->next = NULL;
+        while (q) {
+            Message m = q;
+            q = q->next;
+            if (m->baseline == t) {
+                wheelCount--;
+                m->state = MSG_READY;
+                enqueueReady(m);
+            } else
+                wheelPlace(m);      // cascade
+        }
     }
-    return 0;
+    if (i >= 0)
+        wheelNext = wheelEarliest(i);
+}
+
+static void removeTimer(Message m) {
+    int i = m->wheelSlot;
+    if (m->next == m)               // m was alone in its slot
+        wheelClear(i);
+    else {
+        m->prev->next = m->next;
+        m->next->prev = m->prev;
+        if (timerQ[i] == m)
+            timerQ[i] = m->prev;
+    }
+    if (--wheelCount > 0 && m->baseline == wheelNext)
+        wheelNext = wheelEarliest(wheelFirst());
 }
 
+#define pendingTimers()     (wheelCount > 0)
+#define nextTimer()         (wheelNext)
+
+#else
+
+#define pendingTimers()     (timerQ != NULL)
+#define nextTimer()         (timerQ->baseline)
+#define enqueueTimer(p,now) enqueueByBaseline(p, &timerQ)
+#define removeTimer(m)      remove(m, &timerQ)
+
+void expireTimers(Time now) {
+    while (timerQ && (timerQ->baseline - now <= 0)) {
+        Message m = dequeue(&timerQ);
+        m->state = MSG_READY;
+        enqueueReady(m);
+    }
+}
+
+#endif
+
 TIMER_COMPARE_INTERRUPT {
     Time now;
  
+#if !defined(__TT_HOST_IO)
+	if (TIM_GetITStatus(TIM5, TIM_IT_Update) != RESET) {
+		TIM_ClearITPendingBit(TIM5, TIM_IT_Update);
+		overflows++;
+		if (TIM_GetITStatus(TIM5, TIM_IT_CC1) == RESET)
+			return;
+	}
+#endif
  	TIMER_CCLR();
 #ifdef	__USE_SAFE_TIMER
 	TIM_Cmd( TIM5, DISABLE);
 #endif
     TIMERGET(now);
-	
-#ifdef	__TRACE_TIMER1
-	DUMP("In TIMER_COMPARE_INTERRUPT()!");
- 	DUMP(" Counter = ");
-    DUMPD(TIM_GetCounter(TIM5));
-    DUMP(", Exception = ");
-    DUMPD(__CURRENT_EXCEPTION);
-    DUMP(", timerQ = ");
-    DUMPH((unsigned int) timerQ);
-	DUMP("\n\r");
-#endif
-
-    while (timerQ && (timerQ->baseline - now <= 0))
-        enqueueByDeadline( dequeue(&timerQ), &msgQ );
-    if (timerQ) {
-#ifdef	__USE_FUTURE_CHECK_TIMER
-		Time timcount = TIM_GetCounter(TIM5);
-		if (timerQ->baseline < timcount)
+    TRACE(TRACE_IRQ_ENTER, NULL, N_VECTORS);
+
+    expireTimers(now);
+    if (pendingTimers()) {
+#if defined(__USE_FUTURE_CHECK_TIMER) && !defined(__USE_HIRES_TIMER)   // expiry takes many ticks at 84 MHz
+		Time timcount;
+		TIMERGET(timcount);
+		if (nextTimer() - timcount < 0)
 			RED_ALERT();    // Next event is in the past!
 #endif
-		TIMERSET(timerQ);		
+		TIMERSET(nextTimer());		
 	}
-#ifdef	__TRACE_SCHEDULE
-	DUMP("schedule() in TIMER_COMPARE_INTERRUPT()");
-	DUMP("\n\r");
-#endif
 #ifdef	__USE_SAFE_TIMER
 	TIM_Cmd( TIM5, ENABLE);
 #endif
+    TRACE(TRACE_IRQ_EXIT, NULL, N_VECTORS);
 	
     schedule();
 }
 
+#if defined(__USE_PROFILER)
+/* profiling */
+
+// Record a completed message m that took elapsed cycles since dispatch, of
+// which nested were spent in messages that preempted it.
+static void profile(Message m, uint32_t elapsed, uint32_t nested) {
+    uint32_t exec = elapsed - nested;
+    int i = ((uintptr_t)m->method >> 1) & (NPROFILES - 1);
+    int n;
+    Profile *p;
+    Time now, resp;
+    
+    profileExec += exec;
+    for (n = 0; n < NPROFILES; n++, i = (i + 1) & (NPROFILES - 1))
+        if (profiles[i].method == m->method || profiles[i].method == NULL)
+            break;
+    if (n == NPROFILES) {
+        profileMisses++;
+        return;
+    }
+    p = &profiles[i];
+    TIMERGET(now);
+    resp = now - m->baseline;
+    if (p->method == NULL) {
+        p->method = m->method;
+        p->execMin = exec;
+        p->respMin = resp;
+    }
+    p->count++;
+    if (exec < p->execMin)
+        p->execMin = exec;
+    if (exec > p->execMax)
+        p->execMax = exec;
+    p->execSum += exec;
+    if (resp < p->respMin)
+        p->respMin = resp;
+    if (resp > p->respMax)
+        p->respMax = resp;
+    p->respSum += resp;
+}
+#endif
+
+#if defined(__USE_DEADLINE_CHECK)
+/* deadline checking */
+
+// Check a completed message m, started at time started, against its
+// deadline. Messages meeting it cost a timer read and one comparison.
+static void deadlineCheck(Message m, Time started) {
+    Time now, late;
+    DeadlineMiss *d = NULL;
+    int i;
+    
+    TIMERGET(now);
+    late = now - m->deadline;
+    if (late <= 0)
+        return;
+#ifdef	__USE_DEADLINE_ALERT
+    RED_ALERT();
+#endif
+    for (i = 0; i < NMISSES; i++) {
+        d = &misses[i];
+        if ((d->obj == m->to && d->method == m->method) || d->obj == NULL)
+            break;
+    }
+    if (i == NMISSES) {
+        missOverflows++;
+        return;
+    }
+    if (d->obj == NULL) {
+        d->obj = m->to;
+        d->method = m->method;
+    }
+    if (started - m->deadline > 0)
+        d->lateStarts++;
+    d->lateEnds++;
+    if (late > d->worst)
+        d->worst = late;
+    
+    if (missObj && msgPool && !messageOf(missMsg)) {
+        Message hook = dequeue_pool(&msgPool);
+        hook->to = missObj;
+        hook->method = missMeth;
+        hook->arg = i;
+        hook->period = 0;
+        hook->baseline = now;
+        hook->deadline = now + INFINITY;
+        hook->state = MSG_READY;
+        enqueueReady(hook);         // run() dispatches it as it sees fit
+        missMsg = hook->handle;
+    }
+}
+#endif
+
 /* context switching */
 
+#if defined(__TT_HOST)
+void dispatch( Thread next ) {
+    Thread prev = current;
+    TRACE(TRACE_DISPATCH, next->msg, next->thread_no);
+
+    current = next;             // immediately, also from a signal handler
+    swapcontext(&prev->context, &next->context);
+
+	ENABLE(1);
+}
+#else
 __attribute__((naked)) 
 void __svc_dispatch( Thread next ) {
 	upcoming = next;
@@ -472,14 +1251,7 @@ void __pendSV_dispatch( Thread next ) {
 }
 
 void dispatch( Thread next ) {
-#ifdef	__TRACE_DISPATCH
-		DUMP("Entered dispatch(): ");
-		DUMP("thread #");
-		DUMPD(next->thread_no);
-		DUMP(", mode = ");
-		DUMPD(__CURRENT_EXCEPTION);
-		DUMP("\n\r");
-#endif
+    TRACE(TRACE_DISPATCH, next->msg, next->thread_no);
 	
 	if (THREADMODE()) {
 		__svc_dispatch( next);	
@@ -490,57 +1262,63 @@ void dispatch( Thread next ) {
 
 	ENABLE(1);
 }
+#endif
 
 static void run(void) {
     while (1) {
-#ifdef	__TRACE_RUN
-		DUMP("Entered run(): ");
-		DUMP("thread #");
-		DUMPD(current->thread_no);
-		DUMP(", Exception = ");
-		DUMPD(__CURRENT_EXCEPTION);
-		DUMP("\n\r");
-#endif
-
-        Msg this = current->msg = dequeue(&msgQ); // Get first pending message
-        Msg oldMsg;
-        
-#ifdef	__TRACE_RUN
-		DUMP("Dequeue in run() done:");
-		DUMP("thread #");
-		DUMPD(current->thread_no);
-		DUMP(", method = ");
-		DUMPH((unsigned int) this->method);
-		DUMP("\n\r");
-#endif
+        Message this, oldMsg, next;
 
-        ENABLE(1);
-        SYNC(this->to, this->method, this->arg);
+        // Decide before taking a message whether this thread should run it.
+        // Checking here rather than after release() also covers a thread
+        // that was dispatched but interrupted before it got this far: the
+        // handler may have preempted it with a newer thread that took the
+        // message it was dispatched for.
         DISABLE();
-
-        insert(this, &msgPool);
-       
         oldMsg = activeStack->next->msg;
-        if (!msgQ || (oldMsg && (msgQ->deadline - oldMsg->deadline > 0))) {
+        next = peekReady();
+        if (!next || (oldMsg && (next->deadline - oldMsg->deadline > 0))) {
             Thread t;
             push(pop(&activeStack), &threadPool);
             t = activeStack;  // can't be NULL, may be &thread0
             while (t->waitsFor) 
 	            t = t->waitsFor->ownedBy;
-#ifdef	__TRACE_DISPATCH
-			DUMP("dispatch() in run()");
-			DUMP("\n\r");
-#endif
             dispatch(t);
+            continue;
         }
+
+        this = current->msg = dequeueReady(); // Get first pending message
+        this->state = MSG_RUNNING;
+        this->thread = current;
+        
+        TRACE(TRACE_RUN, this, this->method);
+
+#if defined(__USE_PROFILER)
+        uint32_t start = CYCLES(), nested = profileExec;
+#endif
+#if defined(__USE_DEADLINE_CHECK)
+        Time started;
+        TIMERGET(started);
+#endif
+        ENABLE(1);
+        SYNC(this->to, this->method, this->arg);
+        DISABLE();
+#if defined(__USE_PROFILER)
+        profile(this, CYCLES() - start, profileExec - nested);
+#endif
+#if defined(__USE_DEADLINE_CHECK)
+        if (current->msg)               // not aborted
+            deadlineCheck(this, started);
+#endif
+        TRACE(TRACE_RELEASE, this, this->method);
+
+        if (this->period && current->msg)  // periodic and not aborted
+            rearm(this);
+        else
+            release(this);
 	}
 }
 
 static void idle(void) {
-#ifdef	__TRACE_SCHEDULE
-	DUMP("schedule() in idle()");
-	DUMP("\n\r");
-#endif
     schedule();
     while (1) {
 		ENABLE(1);
@@ -549,31 +1327,19 @@ static void idle(void) {
 }
 
 static void schedule(void) {
-    Msg topMsg = activeStack->msg;
-
-#ifdef	__TRACE_SCHEDULE
-		DUMP("Entered schedule(): ");
-		DUMP("msgQ = ");
-		DUMPH((unsigned int) msgQ);
-		DUMP(", topMsg = ");
-		DUMPH((unsigned int) topMsg);
-		DUMP("\n\r");
-#endif
+    Message topMsg = activeStack->msg;
+    Message first = peekReady();
  
-    if (msgQ && threadPool && ((!topMsg) || (msgQ->deadline - topMsg->deadline < 0))) {
+    if (first && threadPool && ((!topMsg) || (first->deadline - topMsg->deadline < 0))) {
         push(pop(&threadPool), &activeStack);
-
-#ifdef	__TRACE_DISPATCH
-		DUMP("dispatch() in schedule()");
-		DUMP("\n\r");
-#endif
+        TRACE(TRACE_PREEMPT, first, first->method);
         dispatch(activeStack);
     }
 }
 
 /* communication primitives */
-Msg async(Time bl, Time dl, Object *to, Method meth, int arg) {
-    Msg m;
+static Msg post(Time bl, Time dl, Time period, Object *to, Method meth, int arg) {
+    Message m;
     Time now;
     char wasEnabled = ENABLED();
     DISABLE();
@@ -581,6 +1347,7 @@ Msg async(Time bl, Time dl, Object *to, Method meth, int arg) {
     m->to = to; 
     m->method = meth; 
     m->arg = arg;
+    m->period = period;
 	m->baseline = (runAsHardware ? timestamp : current->msg->baseline) + bl;
     m->deadline = m->baseline + (dl > 0 ? dl : INFINITY);
     
@@ -602,42 +1369,68 @@ Msg async(Time bl, Time dl, Object *to, Method meth, int arg) {
 	DUMPD(runAsHardware);
 	DUMP("\n\r"); */
 
+    TRACE(TRACE_POST, m, meth);
     if (m->baseline - now > 0) {        // baseline has not yet passed
-#ifdef	__TRACE_ASYNC1
-		DUMP("enqueueByBaseline() in async()");
-		DUMP("\n\r");
-#endif
-        enqueueByBaseline(m, &timerQ);
+        m->state = MSG_TIMER;
+        enqueueTimer(m, now);
 #ifdef	__USE_FUTURE_CHECK_TIMER
-		if (timerQ->baseline < now)
+		if (nextTimer() - now < 0)
 			RED_ALERT();    // Next event is in the past!
 #endif			
-        TIMERSET(timerQ);
+        TIMERSET(nextTimer());
 
 #ifdef	__USE_SAFE_TIMER
 		TIM_Cmd( TIM5, ENABLE);
 #endif
     } else {                            // m is immediately schedulable
-#ifdef	__TRACE_ASYNC1
- 		DUMP("enqueueByDeadline() in async()");
-		DUMP("\n\r");
-#endif
 #ifdef	__USE_SAFE_TIMER
 		TIM_Cmd( TIM5, ENABLE);
 #endif
-        enqueueByDeadline(m, &msgQ);
-        if (wasEnabled && threadPool && (msgQ->deadline - activeStack->msg->deadline < 0)) {
+        m->state = MSG_READY;
+        enqueueReady(m);
+        if (wasEnabled && threadPool && (peekReady()->deadline - activeStack->msg->deadline < 0)) {
             push(pop(&threadPool), &activeStack);
-#ifdef	__TRACE_DISPATCH
-			DUMP("dispatch() in async()");
-			DUMP("\n\r");
-#endif
+            TRACE(TRACE_PREEMPT, peekReady(), peekReady()->method);
             dispatch(activeStack);
         }
     }
     
     ENABLE(wasEnabled);
-    return m;
+    return m->handle;
+}
+
+Msg async(Time bl, Time dl, Object *to, Method meth, int arg) {
+    return post(bl, dl, 0, to, meth, arg);
+}
+
+Msg periodic(Time period, Time dl, Object *to, Method meth, int arg) {
+    return post(period, dl, period, to, meth, arg);
+}
+
+/* re-post periodic message m in place, one period after its last baseline */
+static void rearm(Message m) {
+    Time now;
+    m->baseline += m->period;
+    m->deadline += m->period;
+#ifdef	__USE_SAFE_TIMER
+	TIM_Cmd( TIM5, DISABLE);
+#endif
+    TIMERGET(now);
+    if (m->baseline - now > 0) {
+        m->state = MSG_TIMER;
+        enqueueTimer(m, now);
+#ifdef	__USE_FUTURE_CHECK_TIMER
+		if (nextTimer() - now < 0)
+			RED_ALERT();    // Next event is in the past!
+#endif			
+        TIMERSET(nextTimer());
+    } else {                            // overrun, next instance already due
+        m->state = MSG_READY;
+        enqueueReady(m);
+    }
+#ifdef	__USE_SAFE_TIMER
+	TIM_Cmd( TIM5, ENABLE);
+#endif
 }
 
 int sync(Object *to, Method meth, int arg) {
@@ -662,10 +1455,6 @@ int sync(Object *to, Method meth, int arg) {
             to->wantedBy->waitsFor = NULL;
         to->wantedBy = current;
         current->waitsFor = to;
-#ifdef	__TRACE_DISPATCH
-		DUMP("dispatch() in sync() - already locked");
-		DUMP("\n\r");
-#endif
         dispatch(t);
         if (current->msg == NULL) {     // message was aborted (when called from run)
             ENABLE(wasEnabled);
@@ -681,31 +1470,38 @@ int sync(Object *to, Method meth, int arg) {
     if (t && (t != INSTALLED_TAG)) {      // we have run on someone's behalf
         to->wantedBy = NULL; 
         t->waitsFor = NULL;
-#ifdef	__TRACE_DISPATCH
-		DUMP("dispatch() in sync() - run on someone's behalf");
-		DUMP("\n\r");
-#endif
         dispatch(t);
     }
     ENABLE(wasEnabled);
     return result;
 }
 
-void ABORT(Msg m) {
+void ABORT(Msg h) {
+    Message m;
+    Thread t;
     char wasEnabled = ENABLED();
     DISABLE();
 
-    if (remove(m, &timerQ) || remove(m, &msgQ))
-        insert(m, &msgPool);
-    else {
-        Thread t = activeStack;
-        while (t) {
-            if ((t != current) && (t->msg == m) && (t->waitsFor == m->to)) {
-	            t->msg = NULL;
-	            insert(m, &msgPool);
-	            break;
-            }
-            t = t->next;
+    m = messageOf(h);
+    if (m) {
+        TRACE(TRACE_ABORT, m, m->state);
+        switch (m->state) {
+          case MSG_TIMER:
+            removeTimer(m);
+            release(m);
+            break;
+
+          case MSG_READY:
+            removeReady(m);
+            release(m);
+            break;
+
+          case MSG_RUNNING:             // only if still blocked on its receiver
+            m->period = 0;              // but never re-arm it
+            t = m->thread;
+            if ((t != current) && (t->msg == m) && (t->waitsFor == m->to))
+                t->msg = NULL;          // run() releases m when sync() returns
+            break;
         }
     }
     ENABLE(wasEnabled);
@@ -728,6 +1524,99 @@ Time CURRENT_OFFSET(void) {
 	return now - (wasEnabled ? current->msg->baseline : timestamp);
 }
 
+int PROFILE_READ(int i, Profile *p) {
+#if defined(__USE_PROFILER)
+    char wasEnabled = ENABLED();
+    if (i < 0 || i >= NPROFILES)
+        return 0;
+    DISABLE();
+    *p = profiles[i];
+    ENABLE(wasEnabled);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void PROFILE_RESET(void) {
+#if defined(__USE_PROFILER)
+    char wasEnabled = ENABLED();
+    DISABLE();
+    memset(profiles, 0, sizeof(profiles));
+    profileMisses = 0;
+    ENABLE(wasEnabled);
+#endif
+}
+
+int DEADLINE_READ(int i, DeadlineMiss *d) {
+#if defined(__USE_DEADLINE_CHECK)
+    char wasEnabled = ENABLED();
+    if (i < 0 || i >= NMISSES)
+        return 0;
+    DISABLE();
+    *d = misses[i];
+    ENABLE(wasEnabled);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void DEADLINE_RESET(void) {
+#if defined(__USE_DEADLINE_CHECK)
+    char wasEnabled = ENABLED();
+    DISABLE();
+    memset(misses, 0, sizeof(misses));
+    missOverflows = 0;
+    ENABLE(wasEnabled);
+#endif
+}
+
+void QUEUE_READ(QueueDepths *q) {
+    char wasEnabled = ENABLED();
+    Thread t;
+    int i;
+    memset(q, 0, sizeof(*q));
+    DISABLE();
+    for (i = 0; i < NMSGS; i++) {
+        switch (messages[i].state) {
+          case MSG_FREE:    q->free++;      break;
+          case MSG_TIMER:   q->timers++;    break;
+          case MSG_READY:   q->ready++;     break;
+          case MSG_RUNNING: q->running++;   break;
+        }
+    }
+    for (t = threadPool; t; t = t->next)
+        q->threads++;
+    ENABLE(wasEnabled);
+}
+
+int TRACE_READ(TraceEvent *buf, int max) {
+    int n = 0;
+#if defined(__USE_TRACE)
+    while (n < max && traceTail != traceHead) {
+        TraceEvent *e = &traceBuf[traceTail & (NTRACE - 1)];
+        if (e->type == TRACE_NONE)      // reserved, not yet written
+            break;
+        buf[n++] = *e;
+        e->type = TRACE_NONE;
+        __DMB();
+        traceTail++;
+    }
+#endif
+    return n;
+}
+
+void deadlineHook(Object *obj, Method m) {
+#if defined(__USE_DEADLINE_CHECK)
+    char wasEnabled = ENABLED();
+    DISABLE();
+    missObj = obj;
+    missMeth = m;
+    ENABLE(wasEnabled);
+#endif
+}
+
 /* initialization */
 static void initialize(void) {
     int i;
@@ -735,6 +1624,10 @@ static void initialize(void) {
     for (i=0; i<NMSGS-1; i++)
         messages[i].next = &messages[i+1];
     messages[NMSGS-1].next = NULL;
+    for (i=0; i<NMSGS; i++) {
+        messages[i].handle = (1 << MSG_INDEX_BITS) | i;
+        messages[i].state = MSG_FREE;
+    }
     
     for (i=0; i<NTHREADS-1; i++)
         threads[i].next = &threads[i+1];
@@ -759,6 +1652,9 @@ static void initialize(void) {
     DUMP("\n\r");
     DUMP("\n\r");
  	
+#if defined(__USE_PROFILER) || defined(__USE_TRACE)
+    CYCLES_INIT();
+#endif
     TIMER_INIT();
 }
 
@@ -767,6 +1663,21 @@ void install(Object *obj, Method m, enum Vector i) {
         char wasEnabled = ENABLED();
         DISABLE();
 		switch (i) {
+#if defined(__TT_HOST_IO)
+		  case IRQ_USART1:
+			hostHandle(SIGIO, onInput);     // raised by sci_init() on stdin
+			break;
+
+		  case IRQ_CAN1:
+		  case IRQ_EXTI9_5:                 // no host source
+		  case IRQ_DMA2_STREAM5:
+		  case IRQ_DMA2_STREAM7:
+		  case IRQ_CAN1_TX:
+		  case IRQ_CAN2_TX:
+		  case IRQ_CAN1_RX1:
+		  case IRQ_DMA1_STREAM6:
+			break;
+#else
 		  case IRQ_USART1:
 			*((void (**)(void) ) USART1_IRQ_VECTOR ) = vect_USART1;
 			break;
@@ -779,6 +1690,31 @@ void install(Object *obj, Method m, enum Vector i) {
 			*((void (**)(void) ) EXTI9_5_IRQ_VECTOR ) = vect_EXTI9_5;
 			break;
 
+		  case IRQ_DMA2_STREAM5:
+			*((void (**)(void) ) DMA2_STREAM5_IRQ_VECTOR ) = vect_DMA2_Stream5;
+			break;
+
+		  case IRQ_DMA2_STREAM7:
+			*((void (**)(void) ) DMA2_STREAM7_IRQ_VECTOR ) = vect_DMA2_Stream7;
+			break;
+
+		  case IRQ_CAN1_TX:
+			*((void (**)(void) ) CAN1_TX_IRQ_VECTOR ) = vect_CAN1_TX;
+			break;
+
+		  case IRQ_CAN2_TX:
+			*((void (**)(void) ) CAN2_TX_IRQ_VECTOR ) = vect_CAN2_TX;
+			break;
+
+		  case IRQ_CAN1_RX1:
+			*((void (**)(void) ) CAN1_RX1_IRQ_VECTOR ) = vect_CAN1_RX1;
+			break;
+
+		  case IRQ_DMA1_STREAM6:
+			*((void (**)(void) ) DMA1_STREAM6_IRQ_VECTOR ) = vect_DMA1_Stream6;
+			break;
+#endif
+
 		  default:
 			PANIC("Device IRQ not supported ...");
 		}
@@ -797,10 +1733,6 @@ int tinytimber(Object *obj, Method meth, int arg) {
 		runAsHardware = 1;
         ASYNC(obj, meth, arg);
 		runAsHardware = 0;
-#ifdef	__TRACE_SCHEDULE
-		DUMP("schedule() in tinytimber()");
-		DUMP("\n\r");
-#endif
 		schedule();
 	}
     idle();
@@ -44,19 +44,35 @@
 
 #include "stm32f4xx.h"
 
+#if defined(__TT_HOST)
+//      Host port: include system headers before this one, <unistd.h>
+//      has a sync() of its own.
+#define sync tt_sync
+#if !defined(__TT_SIM)
+#define __TT_HOST_IO                // devices are host services, not simulated registers
+#endif
+#endif
+
 #define __USE_LOCAL_SBRK
 //#define __USE_SAFE_TIMER
 #define __USE_FUTURE_CHECK_TIMER
+//#define __USE_HIRES_TIMER           // TIM5 unprescaled, 84 MHz tick (undefined: 10 us tick)
+#define __USE_PROFILER              // per-method execution and response times, see PROFILE_READ()
+#define __USE_DEADLINE_CHECK        // count deadline misses per object and method, see DEADLINE_READ()
+//#define __USE_DEADLINE_ALERT        // red LED on at the first deadline miss
+
+//      Ready queue implementation (neither: deadline sorted linked list)
+#define __USE_BINARY_HEAP_READYQ      // binary heap, O(log n) post and dequeue
+//#define __USE_PAIRING_HEAP_READYQ   // pairing heap, O(1) post, amortized O(log n) dequeue
+
+//      Timer queue implementation (undefined: baseline sorted linked list)
+#define __USE_TIMING_WHEEL          // hierarchical timing wheel, O(1) post, amortized O(1) expiry
 
 #define __ENABLED_PRIORITY	3
 #define __DISABLED_PRIORITY	1
 #define __IRQ_PRIORITY		2
 
-//#define __TRACE_DISPATCH
-//#define __TRACE_RUN
-//#define __TRACE_TIMER
-//#define __TRACE_SCHEDULE
-//#define __TRACE_ASYNC
+//#define __USE_TRACE                 // binary scheduler trace in RAM, see TRACE_READ()
 
 extern int doIRQSchedule;
 
@@ -81,11 +97,11 @@ typedef struct {
 #define SYNC(obj, meth, arg) \
         sync((Object*)obj, (Method)meth, (int)arg)
 
-//      Abstract type, used in the definition of Msg
-struct msg_block;
-
-//      Type that identifies asynchronous messages
-typedef struct msg_block *Msg;
+//      Type that identifies asynchronous messages. A handle names a message
+//      slot together with the generation of that slot, so a handle whose
+//      message has completed or been aborted never refers to a later reuse
+//      of the slot. Handles are never 0.
+typedef unsigned int Msg;
 
 //      Base type for methods. Every method in a TinyTimber system should take 
 //      a first argument that is a reference to a subclass of class Object.
@@ -131,45 +147,79 @@ typedef int (*Method)(Object*, int);
 #define SEND(bl, dl, obj, meth, arg) \
         async(bl, dl, (Object*)obj, (Method)meth, (int)arg)
 
+//  Msg PERIODIC(Time period, Time dl, T *obj, int (*meth)(T*, A), A arg);
+//      Asynchronously invoke method meth on object obj with argument arg 
+//      once every period, the first time one period after the current 
+//      baseline. Instance n+1 gets baseline = baseline of instance n + period,
+//      so releases do not drift, and deadline = baseline + dl (dl > 0) or 
+//      infinity otherwise. The kernel re-arms the same message after each 
+//      instance; ABORT on the returned handle ends the series.
+#define PERIODIC(period, dl, obj, meth, arg) \
+        periodic(period, dl, (Object*)obj, (Method)meth, (int)arg)
+
 
 // Cortex m4 dependencies
 
 //      Type of time values (with platform-dependent resolution).
-typedef int32_t Time;
+//      64 bits wide: TIM5 supplies the low word, its overflow count the high.
+typedef int64_t Time;
 
+#ifdef __USE_HIRES_TIMER
+#define __TIMER_PRESCALE    0       // 11.9ns tick @ 84 MHz, TIM5 wraps every 51 s
+#define __TIMER_HZ          84000000
+#else
 #define __TIMER_PRESCALE    (840-1) // 10us tick @ 84 MHz, (See table 51 in F407 - Datasheet.pdf)
+#define __TIMER_HZ          100000
+#endif
 
 //      Construct a Time value from an argument given in microseconds.
+#ifdef __USE_HIRES_TIMER
+#define USEC(x) \
+        ((Time)(x) * (__TIMER_HZ / 1000000))
+#else
 #define USEC(x) \
-        ((Time)((x) / 10))
+        ((Time)((x) / (1000000 / __TIMER_HZ)))
+#endif
 //      Construct a Time value from an argument given in milliseconds.
 #define MSEC(x) \
-        ((Time)((x) * (Time)100))
+        ((Time)(x) * (__TIMER_HZ / 1000))
 //      Construct a Time value from an argument given in seconds.
 #define SEC(x) \
-        ((Time)((x) * (Time)100000))
+        ((Time)(x) * __TIMER_HZ)
 //      Extract the microsecond fraction of a Time value
+#ifdef __USE_HIRES_TIMER
+#define USEC_OF(t) \
+        (long)((t) % ((Time)__TIMER_HZ) / (__TIMER_HZ / 1000000))
+#else
 #define USEC_OF(t) \
-        (long)((t) % ((Time)100000) * 10)
+        (long)((t) % ((Time)__TIMER_HZ) * (1000000 / __TIMER_HZ))
+#endif
 //      Extract the millisecond fraction of a Time value
 #define MSEC_OF(t) \
-        (int)((t) % ((Time)100000) / 100)
+        (int)((t) % ((Time)__TIMER_HZ) / (__TIMER_HZ / 1000))
 //      Extract the while second basis of a Time value
 #define SEC_OF(t) \
-        (int)((t) / ((Time)100000))
+        (int)((t) / ((Time)__TIMER_HZ))
 
 enum Vector { 
         IRQ_USART1, 
         IRQ_CAN1,
         IRQ_EXTI9_5,
+        IRQ_DMA2_STREAM5,
+        IRQ_DMA2_STREAM7,
+        IRQ_CAN1_TX,
+        IRQ_CAN2_TX,
+        IRQ_CAN1_RX1,
+        IRQ_DMA1_STREAM6,
 
         N_VECTORS
 };
 
 // End of target dependencies
 
-//      Prematurely aborts pending asynchronous message m.  Does nothing if m 
-//      has already begun executing. 
+//      Prematurely aborts pending asynchronous message m in constant time.
+//      Does nothing if m has already begun executing, or if m is a stale 
+//      handle. 
 void ABORT(Msg m);
 
 // void INSTALL (T* obj, int (*meth)(T*, enum Vector), enum Vector i )
@@ -198,20 +248,103 @@ typedef struct {
 //      Reset timer t to the value of of current baseline
 void T_RESET(Timer *t);
 
-//      Return difference between current baseline and timer t
+//      Return difference between current baseline and timer t (in ticks
+//      of __TIMER_HZ, convert with USEC_OF/MSEC_OF/SEC_OF)
 Time T_SAMPLE(Timer *t);
 
-//      Return current time measured from current baseline
+//      Return current time measured from current baseline (in ticks)
 Time CURRENT_OFFSET(void);
 
+//      Execution profile of one method, collected by the kernel
+typedef struct {
+    Method method;              // NULL for an unused entry
+    unsigned int count;         // completed messages
+    uint32_t execMin;           // execution time in CPU cycles,
+    uint32_t execMax;           //   excluding preempting messages
+    uint64_t execSum;
+    Time respMin;               // response time from baseline to
+    Time respMax;               //   completion, in ticks
+    Time respSum;
+} Profile;
+
+//      Copy profile entry i to *p, return 0 if i is past the table
+int PROFILE_READ(int i, Profile *p);
+
+//      Clear all profile entries
+void PROFILE_RESET(void);
+
+//      Deadline misses of one method on one object, counted by the kernel
+typedef struct {
+    Object *obj;                // NULL for an unused entry
+    Method method;
+    unsigned int lateStarts;    // started after the deadline
+    unsigned int lateEnds;      // completed after the deadline
+    Time worst;                 // largest lateness at completion, in ticks
+} DeadlineMiss;
+
+//      Copy deadline miss entry i to *d, return 0 if i is past the table
+int DEADLINE_READ(int i, DeadlineMiss *d);
+
+//      Clear all deadline miss entries
+void DEADLINE_RESET(void);
+
+//      Number of messages in each state and of idle threads, counted by
+//      the kernel on request
+typedef struct {
+    unsigned short ready;       // waiting for a thread
+    unsigned short timers;      // waiting for their baseline
+    unsigned short running;     // started, possibly preempted
+    unsigned short free;        // left in the message pool, up to NMSGS
+    unsigned char threads;      // left in the thread pool
+} QueueDepths;
+
+//      Copy the current queue depths to *q
+void QUEUE_READ(QueueDepths *q);
+
+//      Scheduler trace event types
+enum TraceType {
+        TRACE_NONE,             // slot not yet written
+        TRACE_POST,             // message posted, arg = method
+        TRACE_RUN,              // message starts on thread, arg = method
+        TRACE_RELEASE,          // message completed, arg = method
+        TRACE_ABORT,            // message aborted, arg = its state
+        TRACE_PREEMPT,          // thread taken for an urgent message, arg = method
+        TRACE_DISPATCH,         // context switch, arg = thread number
+        TRACE_IRQ_ENTER,        // arg = enum Vector, N_VECTORS for the timer
+        TRACE_IRQ_EXIT
+};
+
+//      One scheduler trace event, 12 bytes
+typedef struct {
+    uint32_t time;              // CPU cycles (DWT CYCCNT)
+    uint8_t type;               // enum TraceType
+    int8_t thread;              // running thread, -1 for the idle thread
+    uint16_t msg;               // low half of the message handle, 0 if none
+    uint32_t arg;
+} TraceEvent;
+
+//      Move up to max recorded events to buf, oldest first, and return
+//      their number. Events that find the buffer full are dropped and
+//      counted. Must only be called from one object at a time.
+int TRACE_READ(TraceEvent *buf, int max);
+
+// void DEADLINE_HOOK (T* obj, int (*meth)(T*, int))
+//      Have meth invoked on obj, with the index of the DeadlineMiss entry
+//      as argument, after a message completes past its deadline. At most
+//      one such invocation is pending at a time; further misses are only
+//      counted. A NULL obj removes the hook.
+#define DEADLINE_HOOK(obj,meth) deadlineHook((Object*)obj, (Method)meth)
+
 
 // -------------------------------------------------------------------
 // No externally significant information below this line
 // -------------------------------------------------------------------
 
 Msg async(Time bl, Time dl, Object *to, Method m, int arg); 
+Msg periodic(Time period, Time dl, Object *to, Method m, int arg);
 int sync(Object *to, Method m, int arg);
 void install(Object *obj, Method m, enum Vector index);
+void deadlineHook(Object *obj, Method m);
 int tinytimber(Object *obj, Method startup, int arg);
 
 #endif
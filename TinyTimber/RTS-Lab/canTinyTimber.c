@@ -5,13 +5,85 @@
 
 void DUMP(char *s);
 
+#define	CAN_KEY(m)	(((m)->msgId << 4) + (m)->nodeId)	// the standard identifier
+
+#if defined(__TT_HOST_IO)
+//
+// Host port: there is no bus. Sent frames are logged on stderr and
+// nothing is ever received.
+//
+#include <stdio.h>
+
+void can_init(Can *self, int unused) {
+    self->rx[0].count = self->rx[0].head = self->rx[0].tail = 0;
+    self->rx[1].count = self->rx[1].head = self->rx[1].tail = 0;
+    self->txCount = 0;
+}
+
+void can_interrupt(Can *self, int unused) {
+}
+
+int can_filter(Can *self, CanFilter *f) {
+    return self->filters < 14 ? self->filters++ : -1;
+}
+
+void can_filter_clear(Can *self, int unused) {
+    self->filters = 0;
+}
+
+int can_send(Can *self, CANMsg *msg) {
+    uchar index;
+	if (msg->length > 8) 
+		msg->length = 8; 
+    fprintf(stderr, "[CAN tx %d/%d:", msg->msgId, msg->nodeId);
+    for (index = 0; index < msg->length; index++)
+        fprintf(stderr, " %02x", msg->buff[index]);
+    fprintf(stderr, "]\n");
+    self->txSent++;
+    return 0;
+}
+
+#else
+
+#ifdef __CAN_LOOPBACK
+#define	TX_PORT		CAN2		// CAN1 receives what CAN2 sends
+#define	TX_IRQ		IRQ_CAN2_TX
+#define	TX_IRQn		CAN2_TX_IRQn
+#else
+#define	TX_PORT		self->port
+#define	TX_IRQ		CAN_TX_IRQ0
+#define	TX_IRQn		CAN1_TX_IRQn
+#endif
+
+#define	CAN2SB		((CAN1->FMR >> 8) & 0x3F)	// first filter bank of CAN2
+
+static void can_tx_interrupt(Can *self, int unused);
+static void can_rx1_interrupt(Can *self, int unused);
+
+// Queue a frame for transmission in identifier order; 0 if the queue is full.
+static int tx_queue(Can *self, CANMsg *msg) {
+    int i = self->txCount;
+    if (i == CAN_TXSIZE) {
+        self->txDrops++;
+        return 0;
+    }
+    for (; i > 0 && CAN_KEY(&self->tx[i - 1]) <= CAN_KEY(msg); i--)
+        self->tx[i] = self->tx[i - 1];
+    self->tx[i] = *msg;
+    if (++self->txCount > self->txHighWater)
+        self->txHighWater = self->txCount;
+    return 1;
+}
+
 //
 // Initialize CAN controller
 //
 void can_init(Can *self, int unused) {
 	CAN_InitTypeDef CAN_InitStructure;
 
-    self->count = self->head = self->tail = 0;
+    self->rx[0].count = self->rx[0].head = self->rx[0].tail = 0;
+    self->rx[1].count = self->rx[1].head = self->rx[1].tail = 0;
+    self->txCount = 0;
 
 #ifdef __CAN_LOOPBACK
 	DUMP("NOTE: CAN running in loopback mode!\n\r");
@@ -32,7 +104,7 @@ void can_init(Can *self, int unused) {
 	CAN_InitStructure.CAN_NART = DISABLE;    // non-automatic retransmission mode = DISABLED (retransmit until error or ack)
 #endif
 	CAN_InitStructure.CAN_RFLM = DISABLE;   // receive FIFO locked mode = DISABLED
-	CAN_InitStructure.CAN_TXFP = DISABLE;   // transmit FIFO priority = DISABLED
+	CAN_InitStructure.CAN_TXFP = ENABLE;    // transmit FIFO priority = ENABLED (mailboxes leave in request order)
 	CAN_InitStructure.CAN_Mode = CAN_Mode_Normal; // normal CAN mode
 	//
 	// 42 MHz clock on APB1
@@ -58,105 +130,196 @@ void can_init(Can *self, int unused) {
 	NVIC_SetPriority( CAN1_RX0_IRQn, __IRQ_PRIORITY);
 	NVIC_EnableIRQ( CAN1_RX0_IRQn);
 	CAN_ITConfig(CAN1, CAN_IT_FMP0, ENABLE);
+
+	// CAN_IT_TME is enabled while frames are queued
+	INSTALL(self, can_tx_interrupt, TX_IRQ);
+	NVIC_SetPriority( TX_IRQn, __IRQ_PRIORITY);
+	NVIC_EnableIRQ( TX_IRQn);
+
+	if (self->rx[1].obj) {
+		INSTALL(self, can_rx1_interrupt, CAN_RX1_IRQ0);
+		NVIC_SetPriority( CAN1_RX1_IRQn, __IRQ_PRIORITY);
+		NVIC_EnableIRQ( CAN1_RX1_IRQn);
+		CAN_ITConfig(CAN1, CAN_IT_FMP1, ENABLE);
+	}
+}
+
+//
+// Program the next filter bank of the controller as a 32 bit identifier
+// and mask pair. CAN2 owns the banks from CAN2SB up.
+//
+int can_filter(Can *self, CanFilter *f) {
+	CAN_FilterInitTypeDef CAN_FilterInitStructure;
+	int sb = CAN2SB;
+	int first = self->port == CAN1 ? 0 : sb;
+	int last = self->port == CAN1 ? sb : 28;
+
+	if (first + self->filters >= last)
+		return -1;
+	CAN_FilterInitStructure.CAN_FilterNumber = first + self->filters;
+	CAN_FilterInitStructure.CAN_FilterMode = CAN_FilterMode_IdMask;
+	CAN_FilterInitStructure.CAN_FilterScale = CAN_FilterScale_32bit;
+	CAN_FilterInitStructure.CAN_FilterIdHigh = ((f->msgId & 0x7F) << 4 | (f->nodeId & 0x0F)) << 5;   // STID in bits 31:21
+	CAN_FilterInitStructure.CAN_FilterIdLow = 0x0000;
+	CAN_FilterInitStructure.CAN_FilterMaskIdHigh = ((f->msgIdMask & 0x7F) << 4 | (f->nodeIdMask & 0x0F)) << 5;
+	CAN_FilterInitStructure.CAN_FilterMaskIdLow = 0x0006;  // IDE and RTR clear: standard data frames only
+	CAN_FilterInitStructure.CAN_FilterFIFOAssignment = f->fifo ? CAN_Filter_FIFO1 : CAN_Filter_FIFO0;
+	CAN_FilterInitStructure.CAN_FilterActivation = ENABLE;
+	CAN_FilterInit(&CAN_FilterInitStructure);
+	return first + self->filters++;
+}
+
+void can_filter_clear(Can *self, int unused) {
+	int sb = CAN2SB;
+	uint32_t banks = self->port == CAN1 ? (1u << sb) - 1 : 0x0FFFFFFF & ~((1u << sb) - 1);
+
+	CAN1->FMR |= CAN_FMR_FINIT;
+	CAN1->FA1R &= ~banks;
+	CAN1->FMR &= ~CAN_FMR_FINIT;
+	self->filters = 0;
 }
 
 //
 // When a message is received on the can bus, store it in a software
-// buffer, notify the listener and clear the receive interrupt.
+// buffer, notify the listener and release the FIFO entry. A frame that
+// finds the buffer full is released too, or it would keep the interrupt
+// pending, and counted as dropped.
 //
-void can_interrupt(Can *self, int unused) {
+static void rx_fifo(Can *self, uint8_t fifo) {
+    CanFifo *f = &self->rx[fifo];
+    CANMsg *m = &f->iBuff[f->head];
+    CanRxMsg RxMessage;
     uchar index;
 
-    if (CAN_GetFlagStatus( self->port, CAN_FLAG_FMP0) == SET) {           // Data received in FIFO0
-//		DUMP("\n\rYay: A CAN #1 FIFO0 IRQ!\n\r");
-	}
-	else
-		DUMP("\n\rStrange: Not a CAN #1 FIFO0 IRQ!\n\r");
-	
-	if (self->count < CAN_BUFSIZE) {
-		CanRxMsg RxMessage;
+    CAN_Receive(self->port, fifo, &RxMessage);
+    if (f->count == CAN_BUFSIZE) {
+        f->drops++;
+        return;
+    }
+    m->msgId = (RxMessage.StdId >> 4) & 0x7F;
+    m->nodeId = RxMessage.StdId & 0x0F;
+    m->length = (RxMessage.DLC & 0x0F);
+    for (index = 0; index < m->length; index++) {
+        // Get received data
+        m->buff[index] = RxMessage.Data[index];
+    }
+    f->received++;
 
-		CAN_Receive(self->port, CAN_FIFO0, &RxMessage);
-		
-        self->iBuff[self->head].msgId = (RxMessage.StdId >> 4) & 0x7F;
-        self->iBuff[self->head].nodeId = RxMessage.StdId & 0x0F;
+    if (f->obj) {
+        ASYNC(f->obj, f->meth, (m->msgId<<4) + m->nodeId);
+        doIRQSchedule = 1;
+    }
+    f->head = (f->head + 1) % CAN_BUFSIZE;
+    f->count++;
+}
 
-        self->iBuff[self->head].length = (RxMessage.DLC & 0x0F);
+void can_interrupt(Can *self, int unused) {
+    if (CAN_GetFlagStatus( self->port, CAN_FLAG_FMP0) == SET)   // Data received in FIFO0
+        rx_fifo(self, CAN_FIFO0);
+    else
+        DUMP("\n\rStrange: Not a CAN #1 FIFO0 IRQ!\n\r");
+}
 
-        for (index = 0; index < self->iBuff[self->head].length; index++) {
-            // Get received data
-            self->iBuff[self->head].buff[index] = RxMessage.Data[index];
-        }
-    
-        if (self->obj) {
-			ASYNC(self->obj, self->meth, (self->iBuff[self->head].msgId<<4) + self->iBuff[self->head].nodeId);
-			doIRQSchedule = 1;
-		}
-        
-        self->head = (self->head + 1) % CAN_BUFSIZE;
-        self->count++;
-    } else {
- 		DUMP("\n\rStrange: CAN #1 FIFO0 Full!\n\r");
-		// Handle full buffers
-        // Now just discards message
-    }
+static void can_rx1_interrupt(Can *self, int unused) {
+    if (CAN_GetFlagStatus( self->port, CAN_FLAG_FMP1) == SET)   // Data received in FIFO1
+        rx_fifo(self, CAN_FIFO1);
 }
 
+#endif
+
 //
 // Copy the first message from the software buffer to the supplied
 // message data structure.
 //
-int can_receive(Can *self, CANMsg *msg){
+static int fifo_receive(CanFifo *f, CANMsg *msg){
     uchar index;
 
-    if (self->count > 0) {
-        msg->msgId = self->iBuff[self->tail].msgId;
-        msg->nodeId = self->iBuff[self->tail].nodeId;
-        msg->length = self->iBuff[self->tail].length;
+    if (f->count > 0) {
+        msg->msgId = f->iBuff[f->tail].msgId;
+        msg->nodeId = f->iBuff[f->tail].nodeId;
+        msg->length = f->iBuff[f->tail].length;
 
         // Get received data
         for (index = 0; index < msg->length; index++){
-            msg->buff[index] = self->iBuff[self->tail].buff[index];
+            msg->buff[index] = f->iBuff[f->tail].buff[index];
         }
 
-        self->tail = (self->tail + 1) % CAN_BUFSIZE;
-        self->count--;
+        f->tail = (f->tail + 1) % CAN_BUFSIZE;
+        f->count--;
         return 0;
     }
     return 1;
 }
 
+int can_receive(Can *self, CANMsg *msg){
+    return fifo_receive(&self->rx[0], msg);
+}
+
+int can_receive1(Can *self, CANMsg *msg){
+    return fifo_receive(&self->rx[1], msg);
+}
+
+int can_stats(Can *self, CanStats *stats) {
+    stats->sent = self->txSent;
+    stats->drops = self->txDrops;
+    stats->highWater = self->txHighWater;
+    stats->count = self->txCount;
+    stats->received[0] = self->rx[0].received;
+    stats->received[1] = self->rx[1].received;
+    stats->rxDrops = self->rx[0].drops + self->rx[1].drops;
+    return CAN_TXSIZE - self->txCount;
+}
+
+void can_stats_reset(Can *self, int unused) {
+    self->txSent = self->txDrops = 0;
+    self->rx[0].received = self->rx[0].drops = 0;
+    self->rx[1].received = self->rx[1].drops = 0;
+    self->txHighWater = self->txCount;
+}
+
+#if !defined(__TT_HOST_IO)
 //
-// Copy the given message to a transmit buffer and send the message
+// Copy the given message to a transmit mailbox, return the mailbox or
+// CAN_TxStatus_NoMailBox
 //
-int can_send(Can *self, CANMsg *msg){
+static uint8_t tx_mailbox(CAN_TypeDef *canport, CANMsg *msg) {
     uchar index;
-	CAN_TypeDef* canport = self->port;
 	CanTxMsg TxMessage;
-	uint8_t TransmitMailbox = 0;
 
-#ifdef __CAN_LOOPBACK
-	canport = CAN2;
-#endif
-	
 	//set the transmit ID, standard identifiers are used, combine IDs
-	TxMessage.StdId = (msg->msgId<<4) + msg->nodeId;
+	TxMessage.StdId = CAN_KEY(msg);
 	TxMessage.RTR = CAN_RTR_Data;
     TxMessage.IDE = CAN_Id_Standard;
-	if (msg->length > 8) 
-		msg->length = 8; 
     TxMessage.DLC = msg->length; // set number of bytes to send
 	
 	for (index = 0; index < msg->length; index++) {
 		TxMessage.Data[index] = msg->buff[index]; //copy data to buffer
 	}
 
-	TransmitMailbox = CAN_Transmit(canport, &TxMessage);
+	return CAN_Transmit(canport, &TxMessage);
+}
+
+//
+// Send the message if a transmit mailbox is free and nothing is queued
+// before it, otherwise queue it for can_tx_interrupt()
+//
+int can_send(Can *self, CANMsg *msg){
+	CAN_TypeDef* canport = TX_PORT;
+	uint8_t TransmitMailbox = CAN_TxStatus_NoMailBox;
+
+	if (msg->length > 8) 
+		msg->length = 8; 
+
+	if (self->txCount == 0)
+		TransmitMailbox = tx_mailbox(canport, msg);
 
 	if (TransmitMailbox == CAN_TxStatus_NoMailBox) {
-		DUMP("CAN TxBuf full!\n\r");
-		return 1;
+		if (!tx_queue(self, msg))
+			return 1;
+		CAN_ITConfig(canport, CAN_IT_TME, ENABLE);
+		return 0;
 	}
+	self->txSent++;
 	
 #ifdef __CAN_TxAck
 	while (CAN_TransmitStatus(canport, TransmitMailbox) == CAN_TxStatus_Pending) ;
@@ -169,3 +332,264 @@ int can_send(Can *self, CANMsg *msg){
 	
 	return 0;
 }
+
+//
+// A transmit mailbox has become empty: refill the mailboxes from the queue.
+// Mailboxes are completed by clearing RQCPx, which also clears TXOKx,
+// ALSTx and TERRx. With TXFP the mailboxes leave in the order they were
+// requested, not by identifier and then mailbox number, so a frame put in
+// a freed mailbox cannot overtake equal ones still waiting in the others.
+//
+static void can_tx_interrupt(Can *self, int unused) {
+	CAN_TypeDef* canport = TX_PORT;
+
+	canport->TSR = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2;
+	while (self->txCount > 0 && tx_mailbox(canport, &self->tx[self->txCount - 1]) != CAN_TxStatus_NoMailBox) {
+		self->txCount--;
+		self->txSent++;
+	}
+	if (self->txCount == 0)
+		CAN_ITConfig(canport, CAN_IT_TME, DISABLE);
+}
+
+#endif
+
+//
+// Segmented transport, see canTinyTimber.h. The sender is idle, waits for
+// a flow control frame, or sends a block of consecutive frames, one every
+// separation time. Receivers need no timer: a first frame from a node
+// restarts its buffer, so an abandoned reassembly is simply overwritten.
+//
+#define	TP_SF		0x00		// protocol control byte, high nibble
+#define	TP_FF		0x10
+#define	TP_CF		0x20
+#define	TP_FC		0x30
+#define	TP_CTS		0			// flow control status, low nibble
+#define	TP_WAIT		1
+#define	TP_OVFL		2
+
+enum { TX_IDLE, TX_WAIT, TX_SEND };
+
+static void tp_timeout(CanTp *self, int unused);
+static void tp_next(CanTp *self, int unused);
+
+static int tp_put(CanTp *self, uchar msgId, uchar *buff, int length) {
+    CANMsg m;
+    uchar index;
+
+    m.msgId = msgId;
+    m.nodeId = self->nodeId;
+    m.length = length;
+    for (index = 0; index < length; index++)
+        m.buff[index] = buff[index];
+    return CAN_SEND(self->can, &m);
+}
+
+static void tp_arm(CanTp *self, Time delay, Method meth) {
+    ABORT(self->txMsg);
+    self->txMsg = AFTER(delay, self, meth, 0);
+}
+
+static void tp_abort(CanTp *self) {
+    ABORT(self->txMsg);
+    self->txMsg = 0;
+    self->txState = TX_IDLE;
+    self->stats.aborts++;
+}
+
+// Separation time as coded in a flow control frame, 127 ms if unknown
+static Time tp_stmin(uchar st) {
+    if (st <= 0x7F)
+        return MSEC(st);
+    if (st >= 0xF1 && st <= 0xF9)
+        return USEC((st - 0xF0) * 100);
+    return MSEC(0x7F);
+}
+
+// Send the consecutive frames of a block, all at once or one per
+// separation time, then wait for flow control
+static void tp_next(CanTp *self, int unused) {
+    uchar buff[8];
+    CanStats cs;
+    int index;
+
+    if (self->txState != TX_SEND)
+        return;
+    while (self->txOffset < self->txLength) {
+        if (CAN_STATS(self->can, &cs) == 0) {
+            tp_arm(self, USEC(200), (Method)tp_next);    // transmit queue full
+            return;
+        }
+        buff[0] = TP_CF | self->txSeq;
+        for (index = 1; index < 8 && self->txOffset < self->txLength; index++)
+            buff[index] = self->txData[self->txOffset++];
+        tp_put(self, self->msgId, buff, index);
+        self->txSeq = (self->txSeq + 1) & 0x0F;
+        if (self->txOffset == self->txLength)
+            break;
+        if (self->txBlock && --self->txBlock == 0) {
+            self->txState = TX_WAIT;
+            tp_arm(self, MSEC(CAN_TP_TIMEOUT), (Method)tp_timeout);
+            return;
+        }
+        if (self->txStmin) {
+            tp_arm(self, self->txStmin, (Method)tp_next);
+            return;
+        }
+    }
+    ABORT(self->txMsg);             // the flow control timeout, when sent from tp_flow_received
+    self->txMsg = 0;
+    self->txState = TX_IDLE;
+    self->stats.sent++;
+}
+
+static void tp_timeout(CanTp *self, int unused) {
+    if (self->txState == TX_WAIT)
+        tp_abort(self);
+}
+
+int can_tp_send(CanTp *self, CanTpMsg *msg) {
+    uchar buff[8];
+    int index, n = 0;
+
+    if (self->txState != TX_IDLE || msg->length < 0 || msg->length > CAN_TP_SIZE)
+        return 1;
+    if (msg->length <= 7) {
+        buff[n++] = TP_SF | msg->length;
+        for (index = 0; index < msg->length; index++)
+            buff[n++] = msg->data[index];
+        if (tp_put(self, self->msgId, buff, n))
+            return 1;
+        self->stats.sent++;
+        return 0;
+    }
+    for (index = 0; index < msg->length; index++)
+        self->txData[index] = msg->data[index];
+    buff[n++] = TP_FF | (msg->length >> 8);
+    buff[n++] = msg->length & 0xFF;
+    for (index = 0; n < 8; index++)
+        buff[n++] = msg->data[index];
+    if (tp_put(self, self->msgId, buff, n))
+        return 1;
+    self->txLength = msg->length;
+    self->txOffset = 6;
+    self->txSeq = 1;
+    self->txState = TX_WAIT;
+    tp_arm(self, MSEC(CAN_TP_TIMEOUT), (Method)tp_timeout);
+    return 0;
+}
+
+static void tp_flow(CanTp *self, uchar status, uchar to) {
+    uchar buff[4] = { TP_FC | status, CAN_TP_BLOCK, CAN_TP_STMIN, to };
+    tp_put(self, self->msgId + 1, buff, 4);
+}
+
+// A frame for the sender: flow control meant for this node
+static void tp_flow_received(CanTp *self, CANMsg *m) {
+    if (self->txState != TX_WAIT || m->length < 4 || m->buff[3] != self->nodeId
+        || (m->buff[0] & 0xF0) != TP_FC)
+        return;
+    switch (m->buff[0] & 0x0F) {
+    case TP_CTS:
+        self->txBlock = m->buff[1];
+        self->txStmin = tp_stmin(m->buff[2]);
+        self->txState = TX_SEND;
+        tp_next(self, 0);
+        break;
+    case TP_WAIT:
+        tp_arm(self, MSEC(CAN_TP_TIMEOUT), (Method)tp_timeout);
+        break;
+    default:
+        tp_abort(self);
+        break;
+    }
+}
+
+static void tp_complete(CanTp *self, uchar nodeId) {
+    self->stats.received++;
+    if (self->obj)
+        ASYNC(self->obj, self->meth, nodeId);
+}
+
+// A frame for the receiver: reassemble in the buffer of its nodeId
+static void tp_data_received(CanTp *self, CANMsg *m) {
+    CanTpBuffer *b = &self->rx[m->nodeId];
+    uchar pci = m->buff[0] & 0xF0;
+    int length, index = 1;
+
+    if (m->length == 0)
+        return;
+    if (pci == TP_SF) {
+        length = m->buff[0] & 0x0F;
+        if (length == 0 || length > 7 || length >= m->length) {
+            self->stats.errors++;
+            return;
+        }
+        for (b->offset = 0; b->offset < length; b->offset++)
+            b->data[b->offset] = m->buff[index++];
+        b->length = length;
+        tp_complete(self, m->nodeId);
+    } else if (pci == TP_FF) {
+        length = (m->buff[0] & 0x0F) << 8 | m->buff[1];
+        b->length = 0;
+        if (m->length < 8 || length <= 7) {
+            self->stats.errors++;
+            return;
+        }
+        if (length > CAN_TP_SIZE) {
+            self->stats.errors++;
+            tp_flow(self, TP_OVFL, m->nodeId);
+            return;
+        }
+        for (b->offset = 0, index = 2; index < 8; index++)
+            b->data[b->offset++] = m->buff[index];
+        b->length = length;
+        b->seq = 1;
+        b->block = CAN_TP_BLOCK;
+        tp_flow(self, TP_CTS, m->nodeId);
+    } else if (pci == TP_CF) {
+        if (b->length == 0 || b->offset == b->length)
+            return;                     // not for a reassembly in progress
+        if ((m->buff[0] & 0x0F) != b->seq) {
+            b->length = 0;
+            self->stats.errors++;
+            return;
+        }
+        while (index < m->length && b->offset < b->length)
+            b->data[b->offset++] = m->buff[index++];
+        b->seq = (b->seq + 1) & 0x0F;
+        if (b->offset == b->length)
+            tp_complete(self, m->nodeId);
+        else if (CAN_TP_BLOCK && --b->block == 0) {
+            b->block = CAN_TP_BLOCK;
+            tp_flow(self, TP_CTS, m->nodeId);
+        }
+    }
+}
+
+int can_tp_frame(CanTp *self, CANMsg *msg) {
+    if (msg->msgId == self->msgId)
+        tp_data_received(self, msg);
+    else if (msg->msgId == self->msgId + 1)
+        tp_flow_received(self, msg);
+    else
+        return 1;
+    return 0;
+}
+
+int can_tp_receive(CanTp *self, CanTpMsg *msg) {
+    CanTpBuffer *b = &self->rx[msg->nodeId & 0x0F];
+    int index;
+
+    if (b->length == 0 || b->offset != b->length)
+        return 1;
+    for (index = 0; index < b->length; index++)
+        msg->data[index] = b->data[index];
+    msg->length = b->length;
+    b->length = 0;
+    return 0;
+}
+
+void can_tp_stats(CanTp *self, CanTpStats *stats) {
+    *stats = self->stats;
+}
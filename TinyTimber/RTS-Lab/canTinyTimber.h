@@ -14,31 +14,179 @@ typedef struct {
 } CANMsg;
 
 #define CAN_BUFSIZE 8
+#define CAN_TXSIZE  16      // frames waiting for a transmit mailbox
 
 typedef struct {
-	Object super; 
-	CAN_TypeDef* port;
+	unsigned int sent;      // frames handed to a transmit mailbox
+	unsigned int drops;     // frames lost to a full transmit queue
+	int highWater;          // most frames queued at once
+	int count;              // frames queued now
+	unsigned int received[2];   // frames taken from FIFO0, FIFO1
+	unsigned int rxDrops;   // frames lost to a full receive buffer
+} CanStats;
+
+// CAN_FILTER acceptance filter: a standard data frame passes if its msgId
+// and nodeId equal those given in the bits set in the masks (0x7F and 0x0F
+// for an exact match, 0 for any), and goes to the given receive FIFO.
+typedef struct {
+	uchar msgId;
+	uchar msgIdMask;
+	uchar nodeId;
+	uchar nodeIdMask;
+	uchar fifo;             // 0, or 1 for the FIFO1 receiver
+} CanFilter;
+
+// Frames received through one hardware FIFO, for its receiver
+typedef struct {
 	Object *obj;
-	Method meth;
+	Method meth;            // meth(obj, msgId<<4 | nodeId) per frame
 	int head;
 	int tail;
 	int count;
+	unsigned int received;
+	unsigned int drops;
 	CANMsg iBuff[CAN_BUFSIZE];
+} CanFifo;
+
+typedef struct {
+	Object super; 
+	CAN_TypeDef* port;
+	CanFifo rx[2];
+	int filters;            // filter banks given out by CAN_FILTER
+	int txCount;            // tx[txCount-1] goes first
+	unsigned int txSent;
+	unsigned int txDrops;
+	int txHighWater;
+	CANMsg tx[CAN_TXSIZE];  // by falling identifier, the oldest of equals last
 } Can;
 
-#define initCan(port, obj, meth)  { initObject(), port, (Object*)obj, (Method)meth, 0, 0, 0}
+#define initCan(port, obj, meth)  { initObject(), port, { { (Object*)obj, (Method)meth } } }
+
+// Same, with a receiver for the frames filters route to FIFO1
+#define initCanFifo1(port, obj, meth, obj1, meth1) \
+	{ initObject(), port, { { (Object*)obj, (Method)meth }, { (Object*)obj1, (Method)meth1 } } }
 
 #define CAN_PORT0   (CAN_TypeDef *)(CAN1)
 #define	CAN_IRQ0	IRQ_CAN1
+#define	CAN_TX_IRQ0	IRQ_CAN1_TX     // installed by can_init(), IRQ_CAN2_TX with __CAN_LOOPBACK
+#define	CAN_RX1_IRQ0	IRQ_CAN1_RX1    // installed by can_init() with a FIFO1 receiver
 
 void can_init(Can *obj, int unused);
 int can_receive(Can *obj, CANMsg *msg);
+int can_receive1(Can *obj, CANMsg *msg);
+int can_filter(Can *obj, CanFilter *filter);
+void can_filter_clear(Can *obj, int unused);
 int can_send(Can *obj, CANMsg *msg);
+int can_stats(Can *obj, CanStats *stats);
+void can_stats_reset(Can *obj, int unused);
 
 #define CAN_INIT(can)               SYNC(can, can_init, 0)
-#define CAN_SEND(can, msgptr)       SYNC(can, can_send, msgptr)
 #define CAN_RECEIVE(can, msgptr)    SYNC(can, can_receive, msgptr)
+#define CAN_RECEIVE1(can, msgptr)   SYNC(can, can_receive1, msgptr)
+
+// Program the next free filter bank of the controller, return its number
+// or -1 if none is left. Banks are given out from the first, so the first
+// CAN_FILTER replaces the accept-everything filter startup.c installs.
+// CAN_FILTER_CLEAR deactivates all banks: nothing is received until
+// filters are added again. Frames no filter accepts never reach the FIFOs.
+#define CAN_FILTER(can, filterptr)  SYNC(can, can_filter, filterptr)
+#define CAN_FILTER_CLEAR(can)       SYNC(can, can_filter_clear, 0)
+
+// Put the frame in a free transmit mailbox, or else queue it in software;
+// the transmit mailbox empty interrupt moves queued frames to mailboxes,
+// lowest identifier (msgId, then nodeId) first. The mailboxes leave in the
+// order they were filled, so frames with equal identifiers are sent in the
+// order given. Returns 1 if the queue is full and the frame is dropped, 0
+// otherwise.
+#define CAN_SEND(can, msgptr)       SYNC(can, can_send, msgptr)
+
+// Copy the transmit and receive counters to *stats, returns the free
+// transmit queue slots.
+#define CAN_STATS(can, statsptr)    SYNC(can, can_stats, statsptr)
+#define CAN_STATS_RESET(can)        SYNC(can, can_stats_reset, 0)
 
 void can_interrupt(Can *self, int unused);
 
+//
+// Segmented transport (ISO 15765-2 style) for payloads of up to CAN_TP_SIZE
+// bytes. Data frames carry msgId and the sending nodeId: a single frame
+// (0x0L, L <= 7 bytes), or a first frame (0x1L LL, 6 bytes) followed by
+// consecutive frames (0x2N, sequence N, 7 bytes each). After the first
+// frame and each block of consecutive frames the receivers answer with a
+// flow control frame on msgId + 1 from their own nodeId: status (0x30
+// continue, 0x31 wait, 0x32 overflow), block size, separation time and the
+// nodeId of the sender it is meant for. Every node reassembles into one
+// buffer per sending nodeId, so nodeIds must differ across the bus.
+//
+#define CAN_TP_SIZE     128     // largest payload
+#define CAN_TP_NODES    16      // reassembly buffers, one per nodeId
+#define CAN_TP_BLOCK    CAN_BUFSIZE // consecutive frames between flow controls
+#define CAN_TP_STMIN    0       // separation time asked for, 0-127 ms or 0xF1-0xF9 for 100-900 us
+#ifndef CAN_TP_TIMEOUT
+#define CAN_TP_TIMEOUT  1000    // ms a sender waits for flow control, host/cancheck.c sets less
+#endif
+
+typedef struct {
+	uchar nodeId;           // sender, of a received payload
+	int length;
+	uchar data[CAN_TP_SIZE];
+} CanTpMsg;
+
+typedef struct {
+	int length;             // of the payload being received, 0 if none
+	int offset;             // bytes received so far
+	uchar seq;              // of the next consecutive frame
+	uchar block;            // consecutive frames until the next flow control
+	uchar data[CAN_TP_SIZE];
+} CanTpBuffer;
+
+typedef struct {
+	unsigned int sent;      // payloads sent
+	unsigned int aborts;    // payloads given up: flow control overflow or timeout
+	unsigned int received;  // payloads reassembled
+	unsigned int errors;    // reassemblies dropped: out of sequence or too long
+} CanTpStats;
+
+typedef struct {
+	Object super;
+	Can *can;
+	uchar msgId;            // of data frames, flow control uses msgId + 1
+	uchar nodeId;           // of this node
+	Object *obj;
+	Method meth;            // meth(obj, nodeId) per reassembled payload
+	int txState;
+	int txLength;
+	int txOffset;
+	uchar txSeq;
+	uchar txBlock;          // consecutive frames left in this block, 0 for no limit
+	Time txStmin;
+	Msg txMsg;              // pending timeout or separation time
+	uchar txData[CAN_TP_SIZE];
+	CanTpStats stats;
+	CanTpBuffer rx[CAN_TP_NODES];
+} CanTp;
+
+#define initCanTp(can, msgId, nodeId, obj, meth) \
+	{ initObject(), can, msgId, nodeId, (Object*)obj, (Method)meth }
+
+int can_tp_send(CanTp *obj, CanTpMsg *msg);
+int can_tp_frame(CanTp *obj, CANMsg *msg);
+int can_tp_receive(CanTp *obj, CanTpMsg *msg);
+void can_tp_stats(CanTp *obj, CanTpStats *stats);
+
+// Start sending msg->length bytes of msg->data to all nodes. Returns 1 if
+// the payload is too long or a previous one is still being sent, 0
+// otherwise. One flow control frame paces each block: with several
+// receivers the first to answer does.
+#define CAN_TP_SEND(tp, msgptr)     SYNC(tp, can_tp_send, msgptr)
+
+// Hand a received frame to the transport. Returns 1 if it is neither a
+// data frame nor a flow control frame of the transport, 0 otherwise.
+#define CAN_TP_FRAME(tp, msgptr)    SYNC(tp, can_tp_frame, msgptr)
+
+// Copy the payload reassembled from msg->nodeId, returns 1 if there is none.
+#define CAN_TP_RECEIVE(tp, msgptr)  SYNC(tp, can_tp_receive, msgptr)
+
+#define CAN_TP_STATS(tp, statsptr)  SYNC(tp, can_tp_stats, statsptr)
+
 #endif
@@ -0,0 +1,133 @@
+#include "TinyTimber.h"
+#include "dacTinyTimber.h"
+#include "stm32f4xx_rcc.h"
+
+#if defined(__TT_HOST_IO)
+//
+// Host port: there is no converter. The wave is only remembered.
+//
+void dac_init(Dac *self, int unused) {
+	dac_stop(self, 0);
+}
+
+void dac_stop(Dac *self, int unused) {
+	self->samples = NULL;
+	self->length = 0;
+}
+
+void dac_wave(Dac *self, DacWave *wave) {
+	self->samples = wave->samples;
+	self->length = wave->length;
+}
+
+void dac_stream(Dac *self, DacStream *stream) {
+	self->samples = stream->samples;
+	self->length = stream->block;
+}
+
+void dac_interrupt(Dac *self, int unused) {
+}
+
+#else
+//
+// DMA1 Stream6 channel 7 serves the DAC channel 2 request. TIM6 runs with
+// the update event as trigger output (TRGO), which is trigger 0 (TSEL2 000)
+// of the DAC. startup.c has enabled channel 2 with its output buffer.
+//
+#define	STREAM		DMA1_Stream6
+#define	FLAGS		(DMA_HIFCR_CTCIF6 | DMA_HIFCR_CHTIF6 | DMA_HIFCR_CTEIF6 | DMA_HIFCR_CDMEIF6 | DMA_HIFCR_CFEIF6)
+
+void dac_init(Dac *self, int unused) {
+	RCC_APB1PeriphClockCmd( RCC_APB1Periph_TIM6, ENABLE);
+	RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_DMA1, ENABLE);
+	TIM6->CR1 = 0;
+	TIM6->CR2 = TIM_CR2_MMS_1;                                  // TRGO on update
+	dac_stop(self, 0);
+	INSTALL(self, dac_interrupt, DAC_IRQ0);
+	NVIC_SetPriority( DMA1_Stream6_IRQn, __IRQ_PRIORITY);
+	NVIC_EnableIRQ( DMA1_Stream6_IRQn);
+}
+
+void dac_stop(Dac *self, int unused) {
+	TIM6->CR1 &= ~TIM_CR1_CEN;
+	DAC->CR &= ~(DAC_CR_DMAEN2 | DAC_CR_TEN2 | DAC_CR_TSEL2);
+	STREAM->CR = 0;
+	while (STREAM->CR & DMA_SxCR_EN)
+		;
+	DMA1->HIFCR = FLAGS;
+	DAC->DHR8R2 = 0;                                            // untriggered: out at once
+	self->samples = NULL;
+	self->length = 0;
+	self->obj = NULL;
+}
+
+//
+// TIM6 counts interval clocks per sample, with the prescaler taking over
+// what ARR cannot hold. PSC and ARR are preloaded and change at an update.
+//
+static void set_interval(int interval) {
+	int psc = (interval - 1) >> 16;
+
+	TIM6->PSC = psc;
+	TIM6->ARR = interval / (psc + 1) - 1;
+}
+
+// Play items from samples to par, from the first sample on
+static void start(const void *samples, int items, volatile void *par, uint32_t cr) {
+	STREAM->PAR = (uint32_t)par;
+	STREAM->M0AR = (uint32_t)samples;
+	STREAM->NDTR = items;
+	STREAM->FCR = 0;                                            // direct mode
+	DMA1->HIFCR = FLAGS;
+	STREAM->CR = DMA_SxCR_CHSEL | DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_DIR_0 | cr | DMA_SxCR_EN;
+	DAC->CR |= DAC_CR_TEN2 | DAC_CR_DMAEN2;
+	TIM6->CR1 = TIM_CR1_ARPE | TIM_CR1_URS;
+	TIM6->EGR = TIM_EGR_UG;                                     // load PSC and ARR, first sample
+	TIM6->CR1 |= TIM_CR1_CEN;
+}
+
+void dac_wave(Dac *self, DacWave *wave) {
+	set_interval(wave->interval);
+	if (self->samples == wave->samples && self->length == wave->length)
+		return;
+
+	dac_stop(self, 0);
+	start(wave->samples, wave->length, &DAC->DHR8R2, 0);
+	self->samples = wave->samples;
+	self->length = wave->length;
+}
+
+//
+// Half word items to DHR12L2. The half transfer interrupt hands back the
+// first block, the transfer complete interrupt the second.
+//
+void dac_stream(Dac *self, DacStream *s) {
+	set_interval(s->interval);
+	self->deadline = USEC((long long)s->block * s->interval / (DAC_CLOCK / 1000000));
+	if (self->samples == s->samples && self->length == s->block)
+		return;
+
+	dac_stop(self, 0);
+	self->obj = s->obj;
+	self->meth = s->meth;
+	start(s->samples, 2 * s->block, &DAC->DHR12L2,
+	      DMA_SxCR_MSIZE_0 | DMA_SxCR_PSIZE_0 | DMA_SxCR_HTIE | DMA_SxCR_TCIE);
+	self->samples = s->samples;
+	self->length = s->block;
+}
+
+void dac_interrupt(Dac *self, int unused) {
+	uint32_t isr = DMA1->HISR;
+	const uint16_t *samples = self->samples;
+
+	DMA1->HIFCR = FLAGS;
+	if (!self->obj)
+		return;
+	if (isr & DMA_HISR_HTIF6)
+		BEFORE(self->deadline, self->obj, self->meth, (int)samples);
+	if (isr & DMA_HISR_TCIF6)
+		BEFORE(self->deadline, self->obj, self->meth, (int)(samples + self->length));
+	doIRQSchedule = 1;
+}
+
+#endif
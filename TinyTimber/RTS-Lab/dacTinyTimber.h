@@ -0,0 +1,66 @@
+#ifndef DAC_TINYT_H
+#define DAC_TINYT_H
+
+#include "stm32f4xx.h"
+
+#define DAC_CLOCK   84000000    // TIM6 clock, Hz
+#define	DAC_IRQ0	IRQ_DMA1_STREAM6    // installed by dac_init()
+
+// DAC_WAVE waveform: one period of 8 bit samples, played over and over,
+// one sample every interval TIM6 clocks.
+typedef struct {
+	const unsigned char *samples;
+	int length;             // at most 65535
+	int interval;
+} DacWave;
+
+// DAC_STREAM double buffer: 2 * block 16 bit samples, 12 bit left aligned
+// (0x8000 is the middle of the range), played over and over, one sample
+// every interval TIM6 clocks. Each time a block has been played,
+// meth(obj, block) is sent to refill it, with the time until the block is
+// played again as deadline.
+typedef struct {
+	uint16_t *samples;      // 4 byte aligned
+	int block;              // samples per block, at most 32767
+	int interval;
+	Object *obj;
+	Method meth;            // meth(obj, (int)&samples[0 or block])
+} DacStream;
+
+typedef struct {
+	Object super;
+	const void *samples;    // being played, NULL when stopped
+	int length;             // of DAC_WAVE samples, of DAC_STREAM blocks
+	Object *obj;
+	Method meth;
+	Time deadline;
+} Dac;
+
+#define initDac()   { initObject(), NULL, 0 }
+
+void dac_init(Dac *obj, int unused);
+void dac_wave(Dac *obj, DacWave *wave);
+void dac_stream(Dac *obj, DacStream *stream);
+void dac_stop(Dac *obj, int unused);
+void dac_interrupt(Dac *obj, int unused);
+
+// Installs dac_interrupt for DMA1 Stream6, which starts the refills
+#define DAC_INIT(dac)               SYNC(dac, dac_init, 0)
+
+// DAC channel 2 (PA5) plays the waveform without the CPU: each TIM6 update
+// triggers the DAC, which outputs its data register and has DMA1 Stream6
+// load the next sample from the circular buffer. The buffer is read while
+// it plays, so new values in it are heard within a period. A new interval
+// for the same buffer takes effect at the next sample, glitch free.
+#define DAC_WAVE(dac, waveptr)      SYNC(dac, dac_wave, waveptr)
+
+// Same, from the double buffer of the stream: while one block plays the
+// other is refilled. The refill method runs as an ordinary message, so a
+// block that is not ready in time shows as a deadline miss of that method.
+// Calling it again with the same buffer only changes the interval.
+#define DAC_STREAM(dac, streamptr)  SYNC(dac, dac_stream, streamptr)
+
+// Stop TIM6 and the stream and output 0
+#define DAC_STOP(dac)               SYNC(dac, dac_stop, 0)
+
+#endif
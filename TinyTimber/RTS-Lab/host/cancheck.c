@@ -0,0 +1,157 @@
+//
+// Simulator check of the CAN driver. CAN1 is put in loopback mode, so it
+// receives every frame it sends, in the order the frames left. A burst
+// of frames with equal identifiers, longer than the three transmit
+// mailboxes, must arrive in the order it was sent, and a more urgent frame
+// sent behind it must still overtake the frames queued in software.
+// Then the segmented transport sends payloads of 8 to 128 bytes to
+// itself, each started as soon as the previous one is reassembled, for
+// longer than CAN_TP_TIMEOUT: every payload must arrive intact and none
+// may be aborted. "make check" runs it, with an empty TTSIM_SCRIPT for
+// virtual time.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "TinyTimber.h"
+#include "canTinyTimber.h"
+
+#define BURST   10
+#define URGENT  0xFF            // payload of the more urgent frame
+#define TP_RUN  (CAN_TP_TIMEOUT * 3 / 2)     // ms of back to back payloads
+
+typedef struct {
+    Object super;
+    int received;
+    uchar order[BURST + 1];     // first payload byte, by arrival
+    int payloads;               // sent by the transport
+    int intact;                 // of those, reassembled unchanged
+    int running;
+} Checker;
+
+void receiver(Checker *self, int unused);
+void reassembled(Checker *self, int nodeId);
+
+Checker checker = { initObject() };
+Can can0 = initCan(CAN_PORT0, &checker, receiver);
+CanTp tp0 = initCanTp(&can0, 0x20, 3, &checker, reassembled);
+
+static int failures = 0;
+
+#define CHECK(cond) \
+        { if (!(cond)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } }
+
+// Silent loopback would do as well; the simulator acknowledges anyway
+static void loopback(CAN_TypeDef *port) {
+    port->MCR |= CAN_MCR_INRQ;
+    while (!(port->MSR & CAN_MSR_INAK))
+        ;
+    port->BTR |= CAN_BTR_LBKM;
+    port->MCR &= ~CAN_MCR_INRQ;
+    while (port->MSR & CAN_MSR_INAK)
+        ;
+}
+
+void receiver(Checker *self, int unused) {
+    CANMsg msg;
+    if (CAN_RECEIVE(&can0, &msg) == 0 && CAN_TP_FRAME(&tp0, &msg) && self->received <= BURST)
+        self->order[self->received++] = msg.buff[0];
+}
+
+// Payload n: its length varies, so the transfers do not repeat in step
+static int payloadLength(int n) {
+    return 8 + n * 37 % (CAN_TP_SIZE - 7);
+}
+
+static void sendPayload(Checker *self) {
+    CanTpMsg msg;
+    int i;
+
+    msg.length = payloadLength(self->payloads);
+    for (i = 0; i < msg.length; i++)
+        msg.data[i] = self->payloads + i;
+    if (CAN_TP_SEND(&tp0, &msg) == 0)
+        self->payloads++;
+    else
+        CHECK(!"CAN_TP_SEND failed");
+}
+
+void reassembled(Checker *self, int nodeId) {
+    CanTpMsg msg = { nodeId };
+    int i, n = self->payloads - 1, same;
+
+    if (CAN_TP_RECEIVE(&tp0, &msg))
+        return;
+    same = msg.length == payloadLength(n);
+    for (i = 0; same && i < msg.length; i++)
+        same = msg.data[i] == (uchar)(n + i);
+    self->intact += same;
+    if (self->running)
+        sendPayload(self);
+}
+
+void finishTp(Checker *self, int unused) {
+    CanTpStats ts;
+
+    CAN_TP_STATS(&tp0, &ts);
+    CHECK(self->payloads > TP_RUN / 10);
+    CHECK(ts.aborts == 0 && ts.errors == 0);
+    CHECK(ts.sent == self->payloads && ts.received == self->payloads);
+    CHECK(self->intact == self->payloads);
+    if (failures)
+        printf("cancheck: %d payloads, %d intact, %u aborted, %u reassembly errors\n",
+               self->payloads, self->intact, ts.aborts, ts.errors);
+    printf("cancheck: %s\n", failures ? "FAILED" : "ok");
+    exit(failures != 0);
+}
+
+void stopTp(Checker *self, int unused) {
+    self->running = 0;
+    AFTER(MSEC(50), self, finishTp, 0);
+}
+
+void finishBurst(Checker *self, int unused) {
+    CanStats cs;
+    int i, ordered = 1, next = 0;
+
+    CAN_STATS(&can0, &cs);
+    CHECK(self->received == BURST + 1);
+    CHECK(cs.sent == BURST + 1 && cs.drops == 0 && cs.count == 0);
+    // Three frames went straight into the mailboxes, the urgent one next
+    CHECK(self->order[3] == URGENT);
+    for (i = 0; i < self->received; i++)
+        if (self->order[i] != URGENT)
+            ordered &= self->order[i] == next++;
+    CHECK(ordered);
+    if (!ordered || self->order[3] != URGENT) {
+        printf("cancheck: arrived");
+        for (i = 0; i < self->received; i++)
+            printf(" %02x", self->order[i]);
+        printf("\n");
+    }
+    self->running = 1;
+    sendPayload(self);
+    AFTER(MSEC(TP_RUN), self, stopTp, 0);
+}
+
+void startApp(Checker *self, int unused) {
+    CANMsg msg = { 5, 1, 1 };
+    int i;
+
+    CAN_INIT(&can0);
+    loopback(CAN1);
+    for (i = 0; i < BURST; i++) {
+        msg.buff[0] = i;
+        CHECK(CAN_SEND(&can0, &msg) == 0);
+    }
+    msg.msgId = 4;
+    msg.buff[0] = URGENT;
+    CHECK(CAN_SEND(&can0, &msg) == 0);
+    AFTER(MSEC(10), self, finishBurst, 0);
+}
+
+int main() {
+    INSTALL(&can0, can_interrupt, CAN_IRQ0);
+    TINYTIMBER(&checker, startApp, 0);
+    return 0;
+}
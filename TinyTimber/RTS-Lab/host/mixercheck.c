@@ -0,0 +1,170 @@
+//
+// Host check of the synth mixer: voice allocation, retrigger, stealing
+// and saturation of the sum, the ADSR envelope and the output gain ramp.
+// The SIMD instructions run as the C helpers of the host port. "make
+// check" runs it.
+//
+
+#include <stdio.h>
+#include "TinyTimber.h"
+#include "dacTinyTimber.h"
+#include "synthTinyTimber.h"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+        { if (!(cond)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } }
+
+#define LOW(pair)   ((int16_t)(pair))
+#define HIGH(pair)  ((int16_t)((pair) >> 16))
+
+static void checkAllocation(void) {
+    Mixer m = { 0 };
+    SynthBlock b;
+    int i;
+
+    mixer_adsr(&m, 0, 0, 32767, 0);         // every change within one block
+    for (i = 0; i < SYNTH_VOICES; i++)
+        CHECK(mixer_note_on(&m, i, 2000, SYNTH_LEVEL, WAVE_SINE) == i);
+    CHECK(m.steals == 0);
+
+    mixer_render(&m, b);
+    i = m.voice[2].osc.phase;
+    CHECK(mixer_note_on(&m, 2, 1000, SYNTH_LEVEL, WAVE_SINE) == 2);     // retrigger keeps its voice
+    CHECK(m.voice[2].osc.phase == i);
+    CHECK(m.steals == 0);
+
+    CHECK(mixer_note_on(&m, 9, 1000, SYNTH_LEVEL, WAVE_SINE) == 0);     // steals the oldest, id 0
+    CHECK(m.steals == 1);
+    CHECK(mixer_note_on(&m, 10, 1000, SYNTH_LEVEL, WAVE_SINE) == 1);    // then id 1
+    CHECK(m.steals == 2);
+
+    CHECK(mixer_note_off(&m, 3) == SYNTH_VOICES - 1);
+    CHECK(mixer_render(&m, b) == SYNTH_VOICES);         // released within this block
+    CHECK(mixer_render(&m, b) == SYNTH_VOICES - 1);
+    CHECK(mixer_note_on(&m, 11, 1000, SYNTH_LEVEL, WAVE_SINE) == 3);    // the free voice
+    CHECK(m.steals == 2);
+
+    CHECK(mixer_note_off(&m, MIXER_ALL) == 0);
+    CHECK(m.notes == SYNTH_VOICES + 4);
+}
+
+static void checkSaturation(void) {
+    Mixer m = { 0 };
+    SynthBlock b;
+    int i, clipped = 1;
+
+    mixer_adsr(&m, 0, 0, 32767, 0);
+    for (i = 0; i < SYNTH_VOICES; i++)
+        mixer_note_on(&m, i, 100000, 32767, WAVE_SQUARE);  // 10 Hz, the first half block high
+    mixer_render(&m, b);                                    // attack
+    mixer_render(&m, b);
+    for (i = 0; i < SYNTH_BLOCK / 2; i++)
+        clipped &= LOW(b[i]) == 32767 && HIGH(b[i]) == 32767;
+    CHECK(clipped);                                         // four full scale voices, no wrap
+}
+
+static void checkLevel(void) {
+    Mixer m = { 0 };
+    SynthBlock b;
+    int i, peak = 0;
+
+    mixer_adsr(&m, 0, 0, 32767, 0);
+    mixer_note_on(&m, 0, 1000, SYNTH_LEVEL, WAVE_SINE);
+    mixer_render(&m, b);
+    for (i = 0; i < 10; i++) {
+        int j;
+        mixer_render(&m, b);
+        for (j = 0; j < SYNTH_BLOCK / 2; j++) {
+            if (LOW(b[j]) > peak)
+                peak = LOW(b[j]);
+            if (HIGH(b[j]) > peak)
+                peak = HIGH(b[j]);
+        }
+    }
+    CHECK(peak > SYNTH_LEVEL * 99 / 100 && peak <= SYNTH_LEVEL);
+    CHECK(synth_step(2272) == (uint32_t)(4294967296.0 * 1000000 / (SYNTH_RATE * 2272.0) + 0.5));
+}
+
+// Largest difference between neighbouring samples of b, prev the one before
+static int largestStep(const SynthBlock b, int *prev) {
+    int i, d, step = 0;
+    for (i = 0; i < SYNTH_BLOCK; i++) {
+        int s = i & 1 ? HIGH(b[i / 2]) : LOW(b[i / 2]);
+        d = s > *prev ? s - *prev : *prev - s;
+        if (d > step)
+            step = d;
+        *prev = s;
+    }
+    return step;
+}
+
+static void checkEnvelope(void) {
+    Mixer m = { 0 };
+    SynthBlock b;
+    int i, prev = 0, step = 0, blocks, env, d;
+
+    // 8 ms attack: a quarter of full scale per 2 ms block
+    mixer_adsr(&m, 8, 16, 16384, 8);
+    mixer_note_on(&m, 0, 100000, SYNTH_LEVEL, WAVE_SQUARE);     // 10 Hz, high for 50 ms
+    for (blocks = 0; m.voice[0].stage == ENV_ATTACK && blocks < 10; blocks++) {
+        env = m.voice[0].env;
+        mixer_render(&m, b);
+        CHECK(m.voice[0].env > env);
+        if ((d = largestStep(b, &prev)) > step)
+            step = d;
+    }
+    CHECK(blocks == 5 && m.voice[0].env == 32767);
+    CHECK(step <= SYNTH_LEVEL / 4 / (SYNTH_BLOCK / 2) + 1);    // ramped, not a jump to SYNTH_LEVEL
+    for (i = 0; i < 5; i++)
+        mixer_render(&m, b);
+    CHECK(m.voice[0].stage == ENV_SUSTAIN && m.voice[0].env == 16384);
+
+    // Retriggered while releasing: the attack starts where the release is
+    CHECK(mixer_note_off(&m, 0) == 0);
+    mixer_render(&m, b);
+    env = m.voice[0].env;
+    CHECK(m.voice[0].stage == ENV_RELEASE && env > 0 && env < 16384);
+    CHECK(mixer_note_on(&m, 0, 100000, SYNTH_LEVEL, WAVE_SQUARE) == 0);
+    CHECK(m.voice[0].stage == ENV_ATTACK && m.voice[0].env == env);
+
+    // Released to silence within the release time, then free
+    mixer_note_off(&m, 0);
+    prev = HIGH(b[SYNTH_BLOCK / 2 - 1]);
+    step = 0;
+    for (blocks = 0; mixer_render(&m, b) && blocks < 10; blocks++)
+        if ((d = largestStep(b, &prev)) > step)
+            step = d;
+    CHECK(m.voice[0].stage == ENV_IDLE && blocks <= 4);
+    CHECK(step <= SYNTH_LEVEL / 4 / (SYNTH_BLOCK / 2) + 1);
+    CHECK(prev == 0);
+}
+
+// synth_output ramps the gain across the block, no step at its start
+static void checkOutputRamp(void) {
+    SynthBlock b;
+    uint16_t out[SYNTH_BLOCK];
+    int i, rising = 1;
+
+    for (i = 0; i < SYNTH_BLOCK / 2; i++)
+        b[i] = 0x7FFF7FFF;
+    synth_output(out, b, 0, 16384);
+    for (i = 1; i < SYNTH_BLOCK; i++)
+        rising &= (out[i] ^ 0x8000) >= (out[i - 1] ^ 0x8000);
+    CHECK(rising);
+    CHECK((int16_t)(out[0] ^ 0x8000) < 1024);
+    CHECK((int16_t)(out[SYNTH_BLOCK - 1] ^ 0x8000) >= 16383 - 2);
+    synth_output(out, b, 16384, 16384);
+    CHECK((int16_t)(out[0] ^ 0x8000) == (int16_t)(out[SYNTH_BLOCK - 1] ^ 0x8000));
+}
+
+int main(void) {
+    synth_init();
+    checkAllocation();
+    checkSaturation();
+    checkLevel();
+    checkEnvelope();
+    checkOutputRamp();
+    printf("mixercheck: %s\n", failures ? "FAILED" : "ok");
+    return failures != 0;
+}
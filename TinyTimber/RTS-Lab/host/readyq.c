@@ -0,0 +1,99 @@
+//
+// Ready queue benchmark: the cost of posting to and dequeuing from msgQ
+// as the number of pending messages grows from 30 to 1000. The kernel is
+// compiled into this file with NMSGS raised and the ready queue chosen by
+// READYQ, so the code measured is the kernel's own:
+//
+//	READYQ=0    deadline sorted linked list
+//	READYQ=1    __USE_BINARY_HEAP_READYQ
+//	READYQ=2    __USE_PAIRING_HEAP_READYQ
+//
+// Each round dequeues the head and posts it again with a later random
+// deadline, so the queue stays at its size, as a busy system does. The
+// times are ns per operation with the clock_gettime overhead taken off.
+// "make bench" runs all three.
+//
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "TinyTimber.h"
+
+#undef __USE_BINARY_HEAP_READYQ
+#undef __USE_PAIRING_HEAP_READYQ
+#if READYQ == 1
+#define __USE_BINARY_HEAP_READYQ
+#elif READYQ == 2
+#define __USE_PAIRING_HEAP_READYQ
+#endif
+
+#define NMSGS           1000
+#define MSG_INDEX_BITS  10
+
+#define remove kernelRemove          // not the one of <stdio.h>
+#include "../TinyTimber.c"
+#undef remove
+#include <stdio.h>
+
+#define ROUNDS  200000
+
+static const char *names[] = { "list", "binary heap", "pairing heap" };
+static const int sizes[] = { 30, 100, 300, 1000 };
+
+static long ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static long overhead(void) {        // of one ns() call, the least seen
+    long least = 1000000, t0, t1;
+    int i;
+    for (i = 0; i < 10000; i++) {
+        t0 = ns();
+        t1 = ns();
+        if (t1 - t0 < least)
+            least = t1 - t0;
+    }
+    return least;
+}
+
+static Time later(Time t, int n) {
+    return t + 1 + rand() % (4*n);
+}
+
+int main(void) {
+    long clock = overhead(), posting, dequeuing, t0;
+    int s, i;
+
+    printf("%s ready queue, ns per operation\n", names[READYQ]);
+    printf("%8s %8s %8s\n", "pending", "post", "dequeue");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        Time now = 0;
+        srand(1);
+        for (i = 0; i < n; i++) {
+            messages[i].deadline = later(now, n);
+            enqueueReady(&messages[i]);
+        }
+        posting = dequeuing = 0;
+        for (i = 0; i < ROUNDS; i++) {
+            Message m;
+            t0 = ns();
+            m = dequeueReady();
+            dequeuing += ns() - t0 - clock;
+            now = m->deadline;
+            m->deadline = later(now, n);
+            t0 = ns();
+            enqueueReady(m);
+            posting += ns() - t0 - clock;
+        }
+        for (i = 0; i < n; i++)
+            dequeueReady();
+        printf("%8d %8ld %8ld\n", n, posting / ROUNDS, dequeuing / ROUNDS);
+    }
+    return 0;
+}
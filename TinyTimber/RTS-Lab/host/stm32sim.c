@@ -0,0 +1,1495 @@
+/*
+ * stm32sim.c
+ *
+ * Register level STM32F407 simulator for the RTS-Lab firmware.
+ *
+ * The vector table, peripheral and core register ranges are mapped at
+ * their hardware addresses. Pages holding a modelled peripheral are kept
+ * inaccessible: each access faults, is single stepped with the x86 trap
+ * flag, and the model then applies what the read or write does on the
+ * chip (clear on read, write 0 or 1 to clear, start a transmission, ...).
+ * The model itself works on a second, always writable mapping of the same
+ * memory.
+ *
+ * Time is virtual, in 168 MHz core cycles. It advances by a fixed cost per
+ * register access, kernel critical section and exception entry, and jumps
+ * to the next device event when the kernel sleeps; plain computation takes
+ * no time. Interrupts are taken when the kernel unmasks them, when it
+ * sleeps and after any register access made with interrupts unmasked.
+ *
+ * Modelled: TIM5 counter, compare 1 and update; TIM6 update as trigger
+ * output; TIM2 channel 1 output compare; USART1 transmit and receive at
+ * the BRR baud rate; CAN1 and CAN2 mailboxes, FIFOs and filter banks on
+ * one bus where frames are always acknowledged; DMA2 streams serving
+ * USART1 and DMA1 stream 6 serving the DAC, with their interrupts; the DAC
+ * data registers and channel 2 triggered by TIM6; NVIC enables and the DWT
+ * cycle counter. Registers outside these behave as plain memory. What the
+ * MD407 monitor and startup.c set up (168 MHz PLL, USART1 at 115200 baud,
+ * CAN filter 0 accepting all into FIFO0, DAC channel 2 on) is preset.
+ *
+ * Environment:
+ *   TTSIM_SCRIPT   stimulus file; the run is deterministic, as fast as the
+ *                  host allows, and ends at "end". Without a script the
+ *                  simulation follows real time and USART1 input is stdin.
+ *   TTSIM_LOG      event log, virtual time stamps in microseconds.
+ *
+ * Script lines, times in microseconds of virtual time, # starts a comment:
+ *   <us> uart <text>           text received on USART1, \n \r \t \\ \xHH
+ *   <us> can <id> <byte>...    frame from another node, hex, id > 7FF extended
+ *   <us> end                   stop the simulation
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#undef CR1                              // <termios.h> flags, not the registers
+#undef CR2
+#undef CR3
+#include "stm32f4xx.h"
+#include "stm32sim.h"
+
+#if !defined(__x86_64__)
+#error "stm32sim single steps register accesses with the x86-64 trap flag"
+#endif
+
+#define SIM_HZ          168000000ULL    // core clock
+#define APB1_DIV        4               // core cycles per APB1 clock (42 MHz)
+#define APB2_DIV        2               // core cycles per APB2 clock (84 MHz)
+#define TIM_DIV         2               // core cycles per APB1 timer clock (84 MHz)
+
+#define ACCESS_CYCLES   6               // per register access, roughly
+#define SECTION_CYCLES  150             // per kernel critical section, roughly
+#define ENTRY_CYCLES    12              // exception entry
+
+#define VECTORS         0x2001C000      // where the monitor relocates the table
+#define NIRQS           82
+#define PAGE            4096
+#define NEVER           UINT64_MAX
+
+volatile int simMasked = 1;             // masked out of reset, until the kernel starts
+
+static uint64_t now;                    // virtual time, core cycles
+static FILE *simLog;
+static int scripted;
+
+static void advance(void);
+static void deliver(void);
+
+/* memory */
+
+static struct {
+    uintptr_t base;
+    size_t size;
+    uint8_t *alias;                     // always writable view of the same memory
+} regions[] = {
+    { VECTORS, PAGE },
+    { PERIPH_BASE, 0x80000 },           // APB1, APB2, AHB1
+    { 0xE0000000, 0x100000 },           // DWT, NVIC, SCB
+};
+
+#define NREGIONS        (sizeof(regions) / sizeof(regions[0]))
+
+static void *alias(uintptr_t addr) {
+    unsigned int i;
+    for (i = 0; i < NREGIONS; i++)
+        if (addr - regions[i].base < regions[i].size)
+            return regions[i].alias + (addr - regions[i].base);
+    abort();
+}
+
+#define SIM(p)          ((__typeof__(p))alias((uintptr_t)(p)))
+#define WORD(a)         (*(volatile uint32_t *)alias(a))
+
+static void map(unsigned int i) {
+    void *hw = (void *)regions[i].base;
+    int fd = memfd_create("stm32sim", 0);
+
+    if (fd < 0 || ftruncate(fd, regions[i].size) ||
+        mmap(hw, regions[i].size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0) != hw ||
+        (regions[i].alias = mmap(NULL, regions[i].size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("stm32sim: cannot map register space");
+        exit(1);
+    }
+    close(fd);
+}
+
+static void logEvent(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void logEvent(const char *fmt, ...) {
+    uint64_t ns = now * 1000 / (SIM_HZ / 1000000);
+    va_list ap;
+
+    if (!simLog)
+        return;
+    fprintf(simLog, "%llu.%03llu ", (unsigned long long)(ns / 1000), (unsigned long long)(ns % 1000));
+    va_start(ap, fmt);
+    vfprintf(simLog, fmt, ap);
+    va_end(ap);
+    fputc('\n', simLog);
+}
+
+static void finish(void) {
+    logEvent("end");
+    if (simLog)
+        fflush(simLog);
+    exit(0);
+}
+
+static uint64_t max64(uint64_t a, uint64_t b) {
+    return a > b ? a : b;
+}
+
+/* NVIC */
+
+static uint32_t enabled[3], swPending[3];
+
+static void nvicAfter(uintptr_t addr, int write, uint32_t old) {
+    uint32_t off = addr - SCS_BASE, i = (off & 0x7F) >> 2, v = WORD(addr & ~3);
+
+    if (!write || off < 0x100 || off >= 0x300 || i >= 3)
+        return;
+    switch (off & ~0x7F) {
+      case 0x100: enabled[i] |= v;     break;      // ISER
+      case 0x180: enabled[i] &= ~v;    break;      // ICER
+      case 0x200: swPending[i] |= v;   break;      // ISPR
+      case 0x280: swPending[i] &= ~v;  break;      // ICPR
+    }
+    SIM(NVIC)->ISER[i] = SIM(NVIC)->ICER[i] = enabled[i];
+    SIM(NVIC)->ISPR[i] = SIM(NVIC)->ICPR[i] = swPending[i];
+}
+
+// Vector table entries are 4 bytes on target but function pointers are 8
+// on the host; keep a store from clobbering the entry that follows.
+static uint32_t vectorTable[PAGE / 4];
+
+static void vectorAfter(uintptr_t addr, int write, uint32_t old) {
+    if (write) {
+        vectorTable[(addr - VECTORS) >> 2] = WORD(addr & ~3);
+        memcpy(alias(VECTORS), vectorTable, PAGE);
+    }
+}
+
+/* DWT */
+
+static uint64_t cycBase;
+
+static void dwtBefore(uintptr_t addr) {
+    SIM(DWT)->CYCCNT = (uint32_t)(now - cycBase);
+}
+
+static void dwtAfter(uintptr_t addr, int write, uint32_t old) {
+    if (write && addr == (uintptr_t)&DWT->CYCCNT)
+        cycBase = now - SIM(DWT)->CYCCNT;
+}
+
+/* TIM5 */
+
+static struct {
+    int running;
+    uint64_t base;                      // virtual time at which the count was cnt0
+    uint64_t cnt0;
+    uint64_t done;                      // count up to which events are flagged
+    uint32_t psc;                       // prescaler in effect
+} tim;
+
+// Counts are not wrapped at ARR; the counter register is count % (ARR+1).
+
+static uint64_t timDiv(void) {
+    return (uint64_t)TIM_DIV * (tim.psc + 1);
+}
+
+static uint64_t timCount(uint64_t t) {
+    return tim.running && t > tim.base ? tim.cnt0 + (t - tim.base) / timDiv() : tim.done;
+}
+
+static uint64_t timReach(uint32_t v) {  // first count after done reading v
+    uint64_t p = (uint64_t)SIM(TIM5)->ARR + 1, k = tim.done + 1;
+    return k + (v % p + p - k % p) % p;
+}
+
+static uint64_t timAt(uint64_t k) {     // first time the count is k
+    return tim.base + (k - tim.cnt0) * timDiv();
+}
+
+static void timRebase(uint32_t cnt) {
+    tim.base = now;
+    tim.cnt0 = tim.done = cnt;
+}
+
+static uint64_t timNext(void) {
+    TIM_TypeDef *r = SIM(TIM5);
+    uint64_t t = NEVER;
+
+    if (!tim.running)
+        return NEVER;
+    if ((r->DIER & TIM_DIER_CC1IE) && !(r->SR & TIM_SR_CC1IF))
+        t = timAt(timReach(r->CCR1));
+    if ((r->DIER & TIM_DIER_UIE) && !(r->SR & TIM_SR_UIF) && timAt(timReach(0)) < t)
+        t = timAt(timReach(0));
+    return t;
+}
+
+static void timEvent(uint64_t t) {
+    TIM_TypeDef *r = SIM(TIM5);
+    uint64_t u = timCount(t);
+
+    if (u > tim.done) {
+        if (timReach(r->CCR1) <= u)
+            r->SR |= TIM_SR_CC1IF;
+        if (timReach(0) <= u)
+            r->SR |= TIM_SR_UIF;
+        tim.done = u;
+    }
+    r->CNT = u % ((uint64_t)r->ARR + 1);
+}
+
+static int timLine(void) {
+    TIM_TypeDef *r = SIM(TIM5);
+    return (r->DIER & r->SR & (TIM_DIER_CC1IE | TIM_DIER_UIE)) != 0;
+}
+
+static void tim2Before(uintptr_t addr);
+static void tim2After(uintptr_t addr, int write, uint32_t old);
+
+static void timBefore(uintptr_t addr) {
+    if (addr - TIM5_BASE < sizeof(TIM_TypeDef))
+        timEvent(now);
+    else if (addr - TIM2_BASE < sizeof(TIM_TypeDef))
+        tim2Before(addr);
+}
+
+static void timAfter(uintptr_t addr, int write, uint32_t old) {
+    TIM_TypeDef *r = SIM(TIM5);
+
+    if (addr - TIM2_BASE < sizeof(TIM_TypeDef))
+        tim2After(addr, write, old);
+    if (!write || addr - TIM5_BASE >= sizeof(TIM_TypeDef))
+        return;                         // TIM3, TIM4 are plain memory
+    switch (addr - TIM5_BASE) {
+      case 0x00:                        // CR1
+        if ((r->CR1 ^ old) & TIM_CR1_CEN) {
+            tim.running = r->CR1 & TIM_CR1_CEN;
+            timRebase(r->CNT);
+        }
+        break;
+      case 0x10:                        // SR, write 0 to clear
+        r->SR = old & r->SR;
+        break;
+      case 0x14:                        // EGR
+        if (r->EGR & TIM_EGR_UG) {
+            tim.psc = r->PSC;
+            timRebase(0);
+            r->CNT = 0;
+            if (!(r->CR1 & TIM_CR1_URS))
+                r->SR |= TIM_SR_UIF;
+        }
+        if (r->EGR & TIM_EGR_CC1G)
+            r->SR |= TIM_SR_CC1IF;
+        r->EGR = 0;
+        break;
+      case 0x24:                        // CNT
+      case 0x2C:                        // ARR
+        timRebase(r->CNT);
+        break;
+    }
+}
+
+/* TIM6 */
+
+// Basic timer whose update event is TRGO when CR2 selects it (MMS 010),
+// as the DAC trigger. PSC, and ARR with ARPE, take effect at the next
+// update as on the chip.
+
+static void dacTrigger(void);
+
+static struct {
+    uint64_t last;                      // time of the last update
+    uint64_t next;                      // of the next, NEVER when stopped
+    uint32_t psc, arr;                  // in effect
+} tim6 = { 0, NEVER };
+
+static uint64_t tim6Period(void) {
+    return (uint64_t)TIM_DIV * (tim6.psc + 1) * ((uint64_t)tim6.arr + 1);
+}
+
+static void tim6Start(void) {
+    tim6.last = now;
+    tim6.next = (SIM(TIM6)->CR1 & TIM_CR1_CEN) && tim6.arr ? now + tim6Period() : NEVER;
+}
+
+static void tim6Update(void) {
+    TIM_TypeDef *r = SIM(TIM6);
+
+    tim6.psc = r->PSC;
+    tim6.arr = r->ARR & 0xFFFF;
+    if ((r->CR2 & TIM_CR2_MMS) == TIM_CR2_MMS_1)
+        dacTrigger();
+}
+
+static uint64_t tim6Next(void) {
+    return tim6.next;
+}
+
+static void tim6Event(uint64_t t) {
+    SIM(TIM6)->SR |= TIM_SR_UIF;
+    tim6Update();
+    tim6.last = t;
+    tim6.next = tim6.arr ? t + tim6Period() : NEVER;
+}
+
+static void tim6Before(uintptr_t addr) {
+    if (tim6.next != NEVER)
+        SIM(TIM6)->CNT = (now - tim6.last) / (TIM_DIV * (tim6.psc + 1));
+}
+
+static void tim6After(uintptr_t addr, int write, uint32_t old) {
+    TIM_TypeDef *r = SIM(TIM6);
+
+    if (!write || addr - TIM6_BASE >= sizeof(TIM_TypeDef))
+        return;                         // TIM7, TIM12..TIM14 are plain memory
+    switch (addr - TIM6_BASE) {
+      case 0x00:                        // CR1
+        if ((r->CR1 ^ old) & TIM_CR1_CEN)
+            tim6Start();
+        break;
+      case 0x10:                        // SR, write 0 to clear
+        r->SR = old & r->SR;
+        break;
+      case 0x14:                        // EGR
+        if (r->EGR & TIM_EGR_UG) {
+            if (!(r->CR1 & TIM_CR1_URS))
+                r->SR |= TIM_SR_UIF;
+            tim6Update();
+            tim6Start();
+        }
+        r->EGR = 0;
+        break;
+      case 0x2C:                        // ARR
+        if (!(r->CR1 & TIM_CR1_ARPE) && tim6.next != NEVER) {
+            tim6.arr = r->ARR & 0xFFFF;
+            tim6.next = tim6.arr ? max64(now, tim6.last + tim6Period()) : NEVER;
+        }
+        break;
+    }
+}
+
+/* TIM2 */
+
+// Channel 1 output compare: PWM mode 1 or 2, toggle on match, or forced,
+// with the level of OC1 logged as "tim2ch1" at each change while CC1E is
+// set. The counter counts up; PSC, ARR with ARPE and CCR1 with OC1PE take
+// effect at the next update as on the chip.
+
+static struct {
+    uint64_t last;                      // time of the last update
+    uint64_t next;                      // of the next match or update, NEVER when stopped
+    uint32_t psc, arr, ccr;             // in effect
+    int matched;                        // since the last update
+    int level;                          // of OC1
+} tim2 = { 0, NEVER };
+
+static uint64_t tim2Tick(void) {
+    return (uint64_t)TIM_DIV * (tim2.psc + 1);
+}
+
+static void tim2Set(int level) {
+    if (!(SIM(TIM2)->CCER & TIM_CCER_CC1E))
+        level = 0;
+    if (level != tim2.level) {
+        tim2.level = level;
+        logEvent("tim2ch1 %d", level);
+    }
+}
+
+static void tim2Output(int match) {     // at an update (counter 0) or a match
+    switch ((SIM(TIM2)->CCMR1 & TIM_CCMR1_OC1M) >> 4) {
+      case 3: if (match) tim2Set(!tim2.level);      break;  // toggle
+      case 4: tim2Set(0);                           break;  // forced inactive
+      case 5: tim2Set(1);                           break;  // forced active
+      case 6: tim2Set(!match && tim2.ccr > 0);      break;  // PWM 1: active below CCR1
+      case 7: tim2Set(match || tim2.ccr == 0);      break;  // PWM 2
+    }
+}
+
+static void tim2Schedule(void) {
+    if (!(SIM(TIM2)->CR1 & TIM_CR1_CEN))
+        tim2.next = NEVER;
+    else if (!tim2.matched && tim2.ccr <= tim2.arr)
+        tim2.next = max64(now, tim2.last + tim2.ccr * tim2Tick());
+    else
+        tim2.next = max64(now, tim2.last + ((uint64_t)tim2.arr + 1) * tim2Tick());
+}
+
+static void tim2Update(void) {
+    TIM_TypeDef *r = SIM(TIM2);
+
+    tim2.psc = r->PSC & 0xFFFF;
+    tim2.arr = r->ARR;
+    tim2.ccr = r->CCR1;
+    tim2.matched = 0;
+    tim2Output(0);
+}
+
+static uint64_t tim2Next(void) {
+    return tim2.next;
+}
+
+static void tim2Event(uint64_t t) {
+    if (!tim2.matched && tim2.ccr <= tim2.arr) {
+        tim2.matched = 1;
+        SIM(TIM2)->SR |= TIM_SR_CC1IF;
+        tim2Output(1);
+    } else {
+        SIM(TIM2)->SR |= TIM_SR_UIF;
+        tim2.last = t;
+        tim2Update();
+    }
+    tim2Schedule();
+}
+
+static void tim2Before(uintptr_t addr) {
+    if (tim2.next != NEVER)
+        SIM(TIM2)->CNT = (now - tim2.last) / tim2Tick();
+}
+
+static void tim2After(uintptr_t addr, int write, uint32_t old) {
+    TIM_TypeDef *r = SIM(TIM2);
+
+    if (!write)
+        return;
+    switch (addr - TIM2_BASE) {
+      case 0x00:                        // CR1
+        if ((r->CR1 ^ old) & TIM_CR1_CEN) {
+            tim2.last = now - (uint64_t)r->CNT * tim2Tick();
+            tim2Schedule();
+        }
+        break;
+      case 0x10:                        // SR, write 0 to clear
+        r->SR = old & r->SR;
+        break;
+      case 0x14:                        // EGR
+        if (r->EGR & TIM_EGR_UG) {
+            if (!(r->CR1 & TIM_CR1_URS))
+                r->SR |= TIM_SR_UIF;
+            r->CNT = 0;
+            tim2.last = now;
+            tim2Update();
+            tim2Schedule();
+        }
+        r->EGR = 0;
+        break;
+      case 0x18:                        // CCMR1: forced levels apply at once
+      case 0x20:                        // CCER
+        if (((r->CCMR1 & TIM_CCMR1_OC1M) >> 4) == 4 || ((r->CCMR1 & TIM_CCMR1_OC1M) >> 4) == 5)
+            tim2Output(0);
+        else
+            tim2Set(tim2.level);
+        break;
+      case 0x2C:                        // ARR
+        if (!(r->CR1 & TIM_CR1_ARPE)) {
+            tim2.arr = r->ARR;
+            tim2Schedule();
+        }
+        break;
+      case 0x34:                        // CCR1
+        if (!(r->CCMR1 & TIM_CCMR1_OC1PE)) {
+            tim2.ccr = r->CCR1;
+            tim2Schedule();
+        }
+        break;
+    }
+}
+
+/* USART1 */
+
+#define RXQ             4096
+
+static void dmaService(void);
+
+static struct {
+    int txBusy, txHeld;
+    uint16_t txShift, txHold;
+    uint64_t txDone;                    // end of the frame being shifted out
+    uint8_t rx[RXQ];                    // bytes on their way in
+    uint64_t rxArrive[RXQ];
+    int rxHead, rxCount;
+    uint64_t rxDone;                    // end of the frame being received
+    uint64_t rxLast;                    // end of the last frame received
+    uint64_t idleAt;                    // IDLE due, NEVER when not armed
+    int srRead;                         // SR read; a DR access next clears errors
+} uart = { .idleAt = NEVER };
+
+#define USART_SR_W0     (USART_SR_CTS | USART_SR_LBD | USART_SR_TC | USART_SR_RXNE)
+#define USART_SR_ERR    (USART_SR_IDLE | USART_SR_ORE | USART_SR_NE | USART_SR_FE | USART_SR_PE)
+
+static uint64_t frameTime(void) {
+    USART_TypeDef *u = SIM(USART1);
+    uint64_t bit = u->BRR;              // APB2 clocks per bit at 16x oversampling
+
+    if (u->CR1 & USART_CR1_OVER8)
+        bit = (bit >> 4 << 3) | (bit & 7);
+    return (u->CR1 & USART_CR1_M ? 11 : 10) * bit * APB2_DIV;
+}
+
+static int uartOn(int dir) {
+    return (SIM(USART1)->CR1 & (USART_CR1_UE | dir)) == (USART_CR1_UE | dir);
+}
+
+static void rxPush(const uint8_t *p, int n, uint64_t t) {
+    while (n-- > 0 && uart.rxCount < RXQ) {
+        int i = (uart.rxHead + uart.rxCount++) % RXQ;
+        uart.rx[i] = *p++;
+        uart.rxArrive[i] = t;
+        if (uart.rxCount == 1) {
+            uint64_t start = max64(t, uart.rxLast);
+            if (start < uart.idleAt)
+                uart.idleAt = NEVER;
+            uart.rxDone = start + frameTime();
+        }
+    }
+}
+
+static void txWrite(uint16_t c) {
+    USART_TypeDef *u = SIM(USART1);
+
+    if (!uartOn(USART_CR1_TE))
+        return;
+    u->SR &= ~USART_SR_TC;
+    if (!uart.txBusy) {                 // straight into the shift register
+        uart.txBusy = 1;
+        uart.txShift = c;
+        uart.txDone = now + frameTime();
+    } else {                            // a second write while TXE is clear is lost
+        uart.txHeld = 1;
+        uart.txHold = c;
+        u->SR &= ~USART_SR_TXE;
+    }
+}
+
+static uint64_t usartNext(void) {
+    uint64_t t = uart.idleAt;
+    if (uart.txBusy && uart.txDone < t)
+        t = uart.txDone;
+    if (uart.rxCount && uart.rxDone < t)
+        t = uart.rxDone;
+    return t;
+}
+
+static void usartEvent(uint64_t t) {
+    USART_TypeDef *u = SIM(USART1);
+
+    if (uart.txBusy && uart.txDone <= t) {
+        char c = uart.txShift;
+        if (write(1, &c, 1) < 0)
+            ;
+        logEvent("uart tx %02x", uart.txShift & 0xFF);
+        if (uart.txHeld) {
+            uart.txHeld = 0;
+            uart.txShift = uart.txHold;
+            uart.txDone += frameTime();
+            u->SR |= USART_SR_TXE;
+        } else {
+            uart.txBusy = 0;
+            u->SR |= USART_SR_TC;
+        }
+    }
+    if (uart.rxCount && uart.rxDone <= t) {
+        uint8_t c = uart.rx[uart.rxHead];
+        uart.rxHead = (uart.rxHead + 1) % RXQ;
+        uart.rxCount--;
+        uart.rxLast = uart.rxDone;
+        uart.idleAt = uart.rxLast + frameTime();
+        if (uartOn(USART_CR1_RE)) {
+            logEvent("uart rx %02x", c);
+            if (u->SR & USART_SR_RXNE)
+                u->SR |= USART_SR_ORE;
+            else {
+                u->DR = c;
+                u->SR |= USART_SR_RXNE;
+            }
+        }
+        if (uart.rxCount) {
+            uint64_t start = max64(uart.rxArrive[uart.rxHead], uart.rxLast);
+            if (start < uart.idleAt)
+                uart.idleAt = NEVER;
+            uart.rxDone = start + frameTime();
+        }
+    }
+    if (uart.idleAt <= t) {
+        uart.idleAt = NEVER;
+        if (uartOn(USART_CR1_RE))
+            u->SR |= USART_SR_IDLE;
+    }
+    dmaService();
+}
+
+static int usartLine(void) {
+    USART_TypeDef *u = SIM(USART1);
+    uint16_t cr1 = u->CR1, sr = u->SR;
+
+    return ((cr1 & USART_CR1_TXEIE) && (sr & USART_SR_TXE))
+        || ((cr1 & USART_CR1_TCIE) && (sr & USART_SR_TC))
+        || ((cr1 & USART_CR1_RXNEIE) && (sr & (USART_SR_RXNE | USART_SR_ORE)))
+        || ((cr1 & USART_CR1_IDLEIE) && (sr & USART_SR_IDLE));
+}
+
+static void usartAfter(uintptr_t addr, int write, uint32_t old) {
+    USART_TypeDef *u = SIM(USART1);
+
+    switch (addr - USART1_BASE) {       // USART6 in the same page is plain memory
+      case 0x00:                        // SR
+        if (write)
+            u->SR = (old & ~USART_SR_W0) | (old & u->SR & USART_SR_W0);
+        else
+            uart.srRead = 1;
+        break;
+      case 0x04:                        // DR
+        if (write) {
+            uint16_t c = u->DR & 0x1FF;
+            u->DR = old;                // reads return the received byte
+            txWrite(c);
+        } else {
+            u->SR &= ~USART_SR_RXNE;
+            if (uart.srRead)
+                u->SR &= ~USART_SR_ERR;
+        }
+        uart.srRead = 0;
+        break;
+    }
+    dmaService();
+}
+
+/* DMA1, DMA2 */
+
+// Streams 0-7 are those of DMA1, 8-15 those of DMA2. Channel 4 of DMA2
+// serves the USART1 requests: TX on stream 7, RX on streams 2 and 5.
+// Channel 7 of DMA1 stream 6 serves DAC channel 2. Items are MSIZE wide,
+// PSIZE is taken to be the same (direct mode). The memory side is host memory, which 32 bit addresses reach because the
+// firmware is linked -no-pie.
+
+#define DMA2_S(n)       (8 + (n))
+
+static uint16_t dmaTotal[16];           // NDTR when the stream was enabled
+static uint16_t dmaDone[16];            // items moved since then
+
+static const int dmaShift[4] = { 0, 6, 16, 22 };   // flag position in LISR/HISR
+
+static DMA_TypeDef *dmaController(int s) {
+    return SIM(s < 8 ? DMA1 : DMA2);
+}
+
+static DMA_Stream_TypeDef *dmaStream(int s) {
+    return SIM((DMA_Stream_TypeDef *)((s < 8 ? DMA1_Stream0_BASE : DMA2_Stream0_BASE) + 0x18 * (s & 7)));
+}
+
+static volatile uint32_t *dmaIsr(int s) {
+    return (s & 7) < 4 ? &dmaController(s)->LISR : &dmaController(s)->HISR;
+}
+
+static int dmaOn(int s, int ch, uint32_t dir) {     // enabled on channel ch in direction dir
+    uint32_t cr = dmaStream(s)->CR;
+    return (cr & DMA_SxCR_EN) && (cr & DMA_SxCR_CHSEL) == (uint32_t)ch << 25 && (cr & DMA_SxCR_DIR) == dir;
+}
+
+static int dmaSize(int s) {                 // bytes per item
+    return 1 << ((dmaStream(s)->CR & DMA_SxCR_MSIZE) >> 13);
+}
+
+static uint8_t *dmaMemory(int s) {
+    DMA_Stream_TypeDef *st = dmaStream(s);
+    uint32_t a = st->M0AR;
+    if (st->CR & DMA_SxCR_MINC)
+        a += dmaDone[s] * dmaSize(s);
+    return (uint8_t *)(uintptr_t)a;
+}
+
+// Count one item moved: half and full transfer flags, reload or stop.
+static void dmaItem(int s) {
+    DMA_Stream_TypeDef *st = dmaStream(s);
+
+    dmaDone[s]++;
+    st->NDTR--;
+    if (dmaDone[s] == dmaTotal[s] / 2)
+        *dmaIsr(s) |= (uint32_t)DMA_LISR_HTIF0 << dmaShift[s & 3];
+    if (st->NDTR == 0) {
+        *dmaIsr(s) |= (uint32_t)DMA_LISR_TCIF0 << dmaShift[s & 3];
+        if (st->CR & DMA_SxCR_CIRC) {
+            st->NDTR = dmaTotal[s];
+            dmaDone[s] = 0;
+        } else
+            st->CR &= ~DMA_SxCR_EN;
+    }
+}
+
+// Serve the USART1 requests that are up: TXE with DMAT, RXNE with DMAR.
+static void dmaService(void) {
+    USART_TypeDef *u = SIM(USART1);
+    int s;
+
+    while ((u->CR3 & USART_CR3_DMAT) && (u->SR & USART_SR_TXE) && dmaOn(DMA2_S(7), 4, DMA_SxCR_DIR_0)) {
+        uint8_t c = *dmaMemory(DMA2_S(7));
+        dmaItem(DMA2_S(7));
+        txWrite(c);
+    }
+    for (s = DMA2_S(2); s <= DMA2_S(5); s += 3)
+        if ((u->CR3 & USART_CR3_DMAR) && (u->SR & USART_SR_RXNE) && dmaOn(s, 4, 0)) {
+            *dmaMemory(s) = u->DR;
+            dmaItem(s);
+            u->SR &= ~USART_SR_RXNE;
+        }
+}
+
+static int dmaLine(int s) {
+    DMA_Stream_TypeDef *st = dmaStream(s);
+    uint32_t f = *dmaIsr(s) >> dmaShift[s & 3], cr = st->CR;
+
+    return ((f & DMA_LISR_TCIF0) && (cr & DMA_SxCR_TCIE))
+        || ((f & DMA_LISR_HTIF0) && (cr & DMA_SxCR_HTIE))
+        || ((f & DMA_LISR_TEIF0) && (cr & DMA_SxCR_TEIE))
+        || ((f & DMA_LISR_DMEIF0) && (cr & DMA_SxCR_DMEIE))
+        || ((f & DMA_LISR_FEIF0) && (st->FCR & DMA_SxFCR_FEIE));
+}
+
+static void dmaAfter(uintptr_t addr, int write, uint32_t old) {
+    uintptr_t base = addr < DMA2_BASE ? DMA1_BASE : DMA2_BASE;
+    uint32_t off = addr - base;
+    int s = off < 0x10 ? 0 : (off - 0x10) / 0x18;
+    DMA_TypeDef *d = SIM((DMA_TypeDef *)base);
+
+    if (!write || off >= 0x10 + 8 * 0x18)
+        return;
+    if (base == DMA2_BASE)
+        s = DMA2_S(s);
+    switch (off) {
+      case 0x00:                        // LISR, HISR are read only
+      case 0x04:
+        WORD(addr & ~3) = old;
+        break;
+      case 0x08:                        // LIFCR, HIFCR, write 1 to clear
+        d->LISR &= ~d->LIFCR;
+        d->LIFCR = 0;
+        break;
+      case 0x0C:
+        d->HISR &= ~d->HIFCR;
+        d->HIFCR = 0;
+        break;
+      default:
+        if (off != 0x10 + 0x18 * (s & 7)) {     // NDTR, PAR, M0AR, ... locked while the stream runs
+            if (dmaStream(s)->CR & DMA_SxCR_EN)
+                WORD(addr & ~3) = old;
+        } else {                        // SxCR
+            uint32_t cr = dmaStream(s)->CR;
+            if (!(old & DMA_SxCR_EN) && (cr & DMA_SxCR_EN)) {
+                dmaTotal[s] = dmaStream(s)->NDTR;
+                dmaDone[s] = 0;
+                if (dmaTotal[s] == 0)
+                    dmaStream(s)->CR = cr & ~DMA_SxCR_EN;
+            } else if ((old & DMA_SxCR_EN) && !(cr & DMA_SxCR_EN))
+                *dmaIsr(s) |= (uint32_t)DMA_LISR_TCIF0 << dmaShift[s & 3];  // stopped early
+        }
+        break;
+    }
+    dmaService();
+}
+
+/* CAN1, CAN2 */
+
+typedef struct {
+    uint32_t ir, dtr, dlr, dhr;         // RIR layout, bit 0 clear
+} Frame;
+
+#define CAN_TSR_W1C     0x000F0F0F      // RQCPx, TXOKx, ALSTx, TERRx
+
+static struct {
+    CAN_TypeDef *regs;
+    int irq;                            // TX; RX0 and RX1 follow
+    uint32_t seq[3];                    // order of transmit requests
+    Frame fifo[2][3];
+    int count[2];
+} can[2] = { { CAN1, CAN1_TX_IRQn }, { CAN2, CAN2_TX_IRQn } };
+
+static struct {
+    int busy, ctl, box;
+    uint64_t done;                      // end of the frame on the bus
+    uint64_t free;                      // bus idle from
+} bus;
+
+static uint32_t canSeq;
+
+static int canOn(int c) {
+    return !(SIM(can[c].regs)->MSR & (CAN_MSR_INAK | CAN_MSR_SLAK));
+}
+
+static uint64_t bitTime(int c) {
+    uint32_t btr = SIM(can[c].regs)->BTR;
+    return (uint64_t)((btr & 0x3FF) + 1) * (3 + ((btr >> 16) & 0xF) + ((btr >> 20) & 0x7)) * APB1_DIV;
+}
+
+static void fifoShow(int c, int f) {
+    CAN_TypeDef *r = SIM(can[c].regs);
+    volatile uint32_t *rf = f ? &r->RF1R : &r->RF0R;
+    Frame *h = &can[c].fifo[f][0];
+
+    *rf = (*rf & ~(CAN_RF0R_FMP0 | CAN_RF0R_FULL0)) | can[c].count[f] | (can[c].count[f] == 3 ? CAN_RF0R_FULL0 : 0);
+    if (can[c].count[f]) {
+        r->sFIFOMailBox[f].RIR = h->ir;
+        r->sFIFOMailBox[f].RDTR = h->dtr;
+        r->sFIFOMailBox[f].RDLR = h->dlr;
+        r->sFIFOMailBox[f].RDHR = h->dhr;
+    }
+}
+
+static void fifoPush(int c, int f, Frame *fr, int fmi) {
+    CAN_TypeDef *r = SIM(can[c].regs);
+    int n = can[c].count[f];
+
+    fr->dtr = (fr->dtr & 0xF) | (fmi << 8) | ((uint32_t)(now / bitTime(c)) << 16);
+    if (n == 3) {
+        *(f ? &r->RF1R : &r->RF0R) |= CAN_RF0R_FOVR0;
+        if (r->MCR & CAN_MCR_RFLM)
+            return;                     // locked: the new frame is lost
+        n = 2;                          // otherwise it replaces the newest
+    } else
+        can[c].count[f]++;
+    can[c].fifo[f][n] = *fr;
+    fifoShow(c, f);
+}
+
+static void fifoRelease(int c, int f) {
+    if (can[c].count[f]) {
+        memmove(&can[c].fifo[f][0], &can[c].fifo[f][1], 2 * sizeof(Frame));
+        can[c].count[f]--;
+        fifoShow(c, f);
+    }
+}
+
+// Run a frame through the filter banks of controller c; CAN2 owns the
+// banks from CAN2SB up. Filter match indexes count per FIFO, over active
+// and inactive banks alike. The first matching bank wins.
+static void canReceive(int c, Frame fr) {
+    CAN_TypeDef *f = SIM(CAN1);
+    int b, sb = (f->FMR >> 8) & 0x3F, index[2] = { 0, 0 };
+    uint32_t id16 = (fr.ir >> 21 << 5) | ((fr.ir >> 1 & 1) << 4) | ((fr.ir >> 2 & 1) << 3) | ((fr.ir >> 18) & 7);
+
+    if (!canOn(c) || (f->FMR & CAN_FMR_FINIT))
+        return;
+    for (b = c ? sb : 0; b < (c ? 28 : sb); b++) {
+        uint32_t bit = 1u << b, r1 = f->sFilterRegister[b].FR1, r2 = f->sFilterRegister[b].FR2;
+        int fifo = (f->FFA1R & bit) != 0, list = (f->FM1R & bit) != 0, hit = -1, n;
+
+        if (f->FS1R & bit) {            // 32 bit: one mask or two identifiers
+            n = list ? 2 : 1;
+            if (!(f->FA1R & bit))
+                ;
+            else if (!list && !((fr.ir ^ r1) & r2 & ~1u))
+                hit = 0;
+            else if (list && !((fr.ir ^ r1) & ~1u))
+                hit = 0;
+            else if (list && !((fr.ir ^ r2) & ~1u))
+                hit = 1;
+        } else {                        // 16 bit: two masks or four identifiers
+            uint32_t v[4] = { r1 & 0xFFFF, r1 >> 16, r2 & 0xFFFF, r2 >> 16 };
+            int i;
+            n = list ? 4 : 2;
+            for (i = 0; i < n && hit < 0 && (f->FA1R & bit); i++)
+                if (list ? id16 == v[i] : !((id16 ^ v[2 * i]) & v[2 * i + 1]))
+                    hit = i;
+        }
+        if (hit >= 0) {
+            fifoPush(c, fifo, &fr, index[fifo] + hit);
+            return;
+        }
+        index[fifo] += n;
+    }
+}
+
+static void logFrame(const char *what, Frame *fr) {
+    char data[3 * 8 + 1] = "";
+    int i, n = fr->dtr & 0xF;
+    for (i = 0; i < n && i < 8; i++)
+        sprintf(data + 3 * i, " %02x", (unsigned int)((i < 4 ? fr->dlr >> 8 * i : fr->dhr >> 8 * (i - 4)) & 0xFF));
+    logEvent("%s %x%s", what, fr->ir & 4 ? fr->ir >> 3 : fr->ir >> 21, data);
+}
+
+static int canPick(int *pc, int *pb) {  // arbitration among pending mailboxes
+    int c, b, found = 0;
+    uint32_t best = 0;
+
+    for (c = 0; c < 2; c++) {
+        CAN_TypeDef *r = SIM(can[c].regs);
+        for (b = 0; b < 3; b++) {
+            uint32_t key = r->MCR & CAN_MCR_TXFP ? can[c].seq[b] : r->sTxMailBox[b].TIR >> 1;
+            if (!canOn(c) || !(r->sTxMailBox[b].TIR & CAN_TI0R_TXRQ) || (found && key >= best))
+                continue;
+            found = 1;
+            best = key;
+            *pc = c;
+            *pb = b;
+        }
+    }
+    return found;
+}
+
+static uint64_t canNext(void) {
+    int c, b;
+    if (bus.busy)
+        return bus.done;
+    return canPick(&c, &b) ? bus.free : NEVER;
+}
+
+static void canEvent(uint64_t t) {
+    if (bus.busy) {                     // frame on the bus acknowledged
+        CAN_TypeDef *r = SIM(can[bus.ctl].regs);
+        CAN_TxMailBox_TypeDef *m = &r->sTxMailBox[bus.box];
+        Frame fr = { m->TIR & ~CAN_TI0R_TXRQ, m->TDTR & 0xF, m->TDLR, m->TDHR };
+        int other = !bus.ctl;
+
+        bus.busy = 0;
+        bus.free = bus.done;
+        m->TIR = fr.ir;
+        r->TSR |= (CAN_TSR_RQCP0 | CAN_TSR_TXOK0) << (8 * bus.box) | CAN_TSR_TME0 << bus.box;
+        logFrame(bus.ctl ? "can2 tx" : "can1 tx", &fr);
+        if (r->BTR & CAN_BTR_LBKM)
+            canReceive(bus.ctl, fr);
+        canReceive(other, fr);
+    } else if (canPick(&bus.ctl, &bus.box)) {
+        CAN_TypeDef *r = SIM(can[bus.ctl].regs);
+        uint32_t ir = r->sTxMailBox[bus.box].TIR, n = r->sTxMailBox[bus.box].TDTR & 0xF;
+        bus.busy = 1;
+        bus.done = max64(t, bus.free) + ((ir & 4 ? 67 : 47) + 8 * (n > 8 ? 8 : n)) * bitTime(bus.ctl);
+    }
+}
+
+static int canLine(int c, int line) {
+    CAN_TypeDef *r = SIM(can[c].regs);
+    uint32_t ier = r->IER, rf = line == 2 ? r->RF1R : r->RF0R;
+
+    if (line == 0)
+        return (ier & CAN_IER_TMEIE) && (r->TSR & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2));
+    ier >>= 3 * (line - 1);             // FMPIE1.. follow FMPIE0.. at 3 bit distance
+    return ((ier & CAN_IER_FMPIE0) && (rf & CAN_RF0R_FMP0))
+        || ((ier & CAN_IER_FFIE0) && (rf & CAN_RF0R_FULL0))
+        || ((ier & CAN_IER_FOVIE0) && (rf & CAN_RF0R_FOVR0));
+}
+
+static void canAfter(uintptr_t addr, int write, uint32_t old) {
+    int c = addr >= CAN2_BASE, b;
+    CAN_TypeDef *r = SIM(can[c].regs);
+    uint32_t off = addr - (uintptr_t)can[c].regs;
+
+    if (!write || addr < CAN1_BASE || off >= sizeof(CAN_TypeDef))
+        return;
+    switch (off) {
+      case 0x00:                        // MCR, initialization and sleep acknowledged at once
+        r->MSR &= ~(CAN_MSR_INAK | CAN_MSR_SLAK);
+        if (r->MCR & CAN_MCR_INRQ)
+            r->MSR |= CAN_MSR_INAK;
+        else if (r->MCR & CAN_MCR_SLEEP)
+            r->MSR |= CAN_MSR_SLAK;
+        break;
+      case 0x04:                        // MSR, write 1 to clear ERRI, WKUI, SLAKI
+        r->MSR = old & ~(r->MSR & 0x1C);
+        break;
+      case 0x08:                        // TSR, write 1 to clear, ABRQx aborts
+        for (b = 0; b < 3; b++)
+            if ((r->TSR & CAN_TSR_ABRQ0 << (8 * b)) && !(bus.busy && bus.ctl == c && bus.box == b)
+                && (r->sTxMailBox[b].TIR & CAN_TI0R_TXRQ)) {
+                r->sTxMailBox[b].TIR &= ~CAN_TI0R_TXRQ;
+                old = (old & ~(CAN_TSR_TXOK0 << (8 * b))) | CAN_TSR_RQCP0 << (8 * b) | CAN_TSR_TME0 << b;
+            }
+        r->TSR = old & ~(r->TSR & CAN_TSR_W1C);
+        break;
+      case 0x0C:                        // RFxR, write 1 to clear FULL, FOVR, RFOM releases
+      case 0x10: {
+        volatile uint32_t *rf = off == 0x10 ? &r->RF1R : &r->RF0R;
+        uint32_t v = *rf;
+        *rf = old & ~(v & (CAN_RF0R_FULL0 | CAN_RF0R_FOVR0));
+        if (v & CAN_RF0R_RFOM0)
+            fifoRelease(c, off == 0x10);
+        break;
+      }
+      case 0x180:                       // TIxR, TXRQ requests transmission
+      case 0x190:
+      case 0x1A0:
+        b = (off - 0x180) >> 4;
+        if ((r->sTxMailBox[b].TIR & ~old & CAN_TI0R_TXRQ) && (r->TSR & CAN_TSR_TME0 << b)) {
+            r->TSR &= ~(CAN_TSR_TME0 << b | 0xFu << (8 * b));
+            can[c].seq[b] = ++canSeq;
+            if (!bus.busy)
+                bus.free = max64(bus.free, now);
+        }
+        break;
+    }
+}
+
+/* DAC */
+
+static uint32_t dhr[2];
+
+static void dacOut(int ch) {
+    volatile uint32_t *dor = ch ? &SIM(DAC)->DOR2 : &SIM(DAC)->DOR1;
+    if (*dor != dhr[ch]) {
+        *dor = dhr[ch];
+        logEvent("dac%d %u", ch + 1, (unsigned int)dhr[ch]);
+    }
+}
+
+static void dacAfter(uintptr_t addr, int write, uint32_t old) {
+    DAC_TypeDef *d = SIM(DAC);
+    uint32_t v = WORD(addr & ~3), ch1 = dhr[0], ch2 = dhr[1];
+
+    if (!write || addr < DAC_BASE)      // PWR shares the page
+        return;
+    switch (addr - DAC_BASE) {
+      case 0x04:                        // SWTRIGR
+        if (v & 1)
+            dacOut(0);
+        if (v & 2)
+            dacOut(1);
+        d->SWTRIGR = 0;
+        return;
+      case 0x08: ch1 = v & 0xFFF;                                       break;
+      case 0x0C: ch1 = v >> 4 & 0xFFF;                                  break;
+      case 0x10: ch1 = (v & 0xFF) << 4;                                 break;
+      case 0x14: ch2 = v & 0xFFF;                                       break;
+      case 0x18: ch2 = v >> 4 & 0xFFF;                                  break;
+      case 0x1C: ch2 = (v & 0xFF) << 4;                                 break;
+      case 0x20: ch1 = v & 0xFFF;            ch2 = v >> 16 & 0xFFF;     break;
+      case 0x24: ch1 = v >> 4 & 0xFFF;       ch2 = v >> 20 & 0xFFF;     break;
+      case 0x28: ch1 = (v & 0xFF) << 4;      ch2 = (v >> 8 & 0xFF) << 4; break;
+      default:
+        return;
+    }
+    dhr[0] = ch1;
+    dhr[1] = ch2;
+    if ((d->CR & (DAC_CR_EN1 | DAC_CR_TEN1)) == DAC_CR_EN1)
+        dacOut(0);
+    if ((d->CR & (DAC_CR_EN2 | DAC_CR_TEN2)) == DAC_CR_EN2)
+        dacOut(1);
+}
+
+// TIM6 TRGO with TEN2 and TSEL2 000: DHR2 goes out, then the DMA request
+// of DMAEN2 has DMA1 stream 6 channel 7 write the next sample to PAR.
+static void dacTrigger(void) {
+    DAC_TypeDef *d = SIM(DAC);
+
+    if ((d->CR & (DAC_CR_EN2 | DAC_CR_TEN2 | DAC_CR_TSEL2)) != (DAC_CR_EN2 | DAC_CR_TEN2))
+        return;
+    dacOut(1);
+    if ((d->CR & DAC_CR_DMAEN2) && dmaOn(6, 7, DMA_SxCR_DIR_0)) {
+        uintptr_t par = dmaStream(6)->PAR;
+        uint32_t old = WORD(par & ~3);
+        uint8_t *m = dmaMemory(6);
+        switch (dmaSize(6)) {
+          case 1: *(volatile uint8_t *)alias(par) = *m;                 break;
+          case 2: *(volatile uint16_t *)alias(par) = *(uint16_t *)m;    break;
+          default: *(volatile uint32_t *)alias(par) = *(uint32_t *)m;   break;
+        }
+        dmaItem(6);
+        dacAfter(par, 1, old);
+    }
+}
+
+/* stimulus */
+
+typedef struct {
+    uint64_t at;
+    enum { STIM_UART, STIM_CAN, STIM_END } kind;
+    uint32_t id;
+    int len;
+    uint8_t *data;
+} Stim;
+
+static Stim *stims;
+static int nstims, nextStim;
+
+static int unescape(const char *s, uint8_t *out) {
+    int n = 0;
+    while (*s && *s != '\n') {
+        if (*s != '\\' || !s[1]) {
+            out[n++] = *s++;
+            continue;
+        }
+        switch (*++s) {
+          case 'n':  out[n++] = '\n'; s++; break;
+          case 'r':  out[n++] = '\r'; s++; break;
+          case 't':  out[n++] = '\t'; s++; break;
+          case 'x':  out[n++] = strtoul(s + 1, (char **)&s, 16); break;
+          default:   out[n++] = *s++; break;
+        }
+    }
+    return n;
+}
+
+static void loadScript(const char *path) {
+    FILE *f = fopen(path, "r");
+    char *line = NULL, kind[8];
+    size_t cap = 0;
+    int lineno = 0;
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    while (getline(&line, &cap, f) > 0) {
+        Stim s = { 0 };
+        double us;
+        int pos;
+
+        lineno++;
+        if (sscanf(line, " %lf %7s %n", &us, kind, &pos) < 2) {
+            if (strspn(line, " \t\r\n") != strlen(line) && line[strspn(line, " \t")] != '#')
+                fprintf(stderr, "%s:%d: ignored\n", path, lineno);
+            continue;
+        }
+        s.at = us * (SIM_HZ / 1000000);
+        s.data = malloc(strlen(line) + 1);
+        if (!strcmp(kind, "uart")) {
+            s.kind = STIM_UART;
+            s.len = unescape(line + pos, s.data);
+        } else if (!strcmp(kind, "can")) {
+            char *p = line + pos;
+            s.kind = STIM_CAN;
+            s.id = strtoul(p, &p, 16);
+            while (s.len < 8 && sscanf(p, "%hhx%n", &s.data[s.len], &pos) == 1) {
+                s.len++;
+                p += pos;
+            }
+        } else if (!strcmp(kind, "end"))
+            s.kind = STIM_END;
+        else {
+            fprintf(stderr, "%s:%d: unknown stimulus %s\n", path, lineno, kind);
+            continue;
+        }
+        if (nstims && s.at < stims[nstims - 1].at)
+            fprintf(stderr, "%s:%d: time goes backwards\n", path, lineno);
+        stims = realloc(stims, (nstims + 1) * sizeof(Stim));
+        stims[nstims++] = s;
+    }
+    free(line);
+    fclose(f);
+}
+
+static uint64_t scriptNext(void) {
+    return nextStim < nstims ? stims[nextStim].at : NEVER;
+}
+
+static void scriptEvent(uint64_t t) {
+    Stim *s = &stims[nextStim++];
+    Frame fr = { 0 };
+    int i;
+
+    switch (s->kind) {
+      case STIM_UART:
+        rxPush(s->data, s->len, t);
+        break;
+      case STIM_CAN:
+        fr.ir = s->id > 0x7FF ? s->id << 3 | 4 : s->id << 21;
+        fr.dtr = s->len;
+        for (i = 0; i < s->len; i++)
+            *(i < 4 ? &fr.dlr : &fr.dhr) |= (uint32_t)s->data[i] << 8 * (i & 3);
+        logFrame("can rx", &fr);
+        canReceive(0, fr);
+        canReceive(1, fr);
+        break;
+      case STIM_END:
+        finish();
+    }
+}
+
+/* events and interrupts */
+
+static const struct {
+    uint64_t (*next)(void);
+    void (*event)(uint64_t t);
+} devices[] = {
+    { timNext, timEvent },
+    { tim6Next, tim6Event },
+    { tim2Next, tim2Event },
+    { usartNext, usartEvent },
+    { canNext, canEvent },
+    { scriptNext, scriptEvent },
+};
+
+#define NDEVICES        (sizeof(devices) / sizeof(devices[0]))
+
+static uint64_t nextEvent(int *which) {
+    uint64_t t = NEVER;
+    unsigned int i;
+    for (i = 0; i < NDEVICES; i++) {
+        uint64_t n = devices[i].next();
+        if (n < t) {
+            t = n;
+            *which = i;
+        }
+    }
+    return t;
+}
+
+// Bring every device up to the current time, in event order.
+static void advance(void) {
+    uint64_t t;
+    int i;
+    while ((t = nextEvent(&i)) <= now)
+        devices[i].event(t);
+}
+
+static int irqLine(int n) {
+    switch (n) {
+      case TIM5_IRQn:           return timLine();
+      case USART1_IRQn:         return usartLine();
+      case CAN1_TX_IRQn:        return canLine(0, 0);
+      case CAN1_RX0_IRQn:       return canLine(0, 1);
+      case CAN1_RX1_IRQn:       return canLine(0, 2);
+      case CAN2_TX_IRQn:        return canLine(1, 0);
+      case CAN2_RX0_IRQn:       return canLine(1, 1);
+      case CAN2_RX1_IRQn:       return canLine(1, 2);
+      case DMA1_Stream6_IRQn:   return dmaLine(6);
+      case DMA2_Stream0_IRQn:   return dmaLine(DMA2_S(0));
+      case DMA2_Stream1_IRQn:   return dmaLine(DMA2_S(1));
+      case DMA2_Stream2_IRQn:   return dmaLine(DMA2_S(2));
+      case DMA2_Stream3_IRQn:   return dmaLine(DMA2_S(3));
+      case DMA2_Stream4_IRQn:   return dmaLine(DMA2_S(4));
+      case DMA2_Stream5_IRQn:   return dmaLine(DMA2_S(5));
+      case DMA2_Stream6_IRQn:   return dmaLine(DMA2_S(6));
+      case DMA2_Stream7_IRQn:   return dmaLine(DMA2_S(7));
+    }
+    return 0;
+}
+
+static int pendingIrq(void) {           // enabled, pending, most urgent; -1 if none
+    int n, best = -1;
+    for (n = 0; n < NIRQS; n++) {
+        uint32_t bit = 1u << (n & 31);
+        if ((enabled[n >> 5] & bit) && ((swPending[n >> 5] & bit) || irqLine(n))
+            && (best < 0 || SIM(NVIC)->IP[n] < SIM(NVIC)->IP[best]))
+            best = n;
+    }
+    return best;
+}
+
+static void deliver(void) {
+    int n;
+    while (!simMasked && (n = pendingIrq()) >= 0) {
+        void (*isr)(void) = (void (*)(void))(uintptr_t)vectorTable[16 + n];
+
+        swPending[n >> 5] &= ~(1u << (n & 31));
+        SIM(NVIC)->ISPR[n >> 5] = SIM(NVIC)->ICPR[n >> 5] = swPending[n >> 5];
+        if (!isr) {
+            fprintf(stderr, "stm32sim: IRQ %d enabled without a vector, disabled\n", n);
+            enabled[n >> 5] &= ~(1u << (n & 31));
+            continue;
+        }
+        now += ENTRY_CYCLES;
+        simMasked = 1;                  // one priority level, as __IRQ_PRIORITY
+        isr();
+        simMasked = 0;
+    }
+}
+
+void simUnmask(void) {
+    simMasked = 0;
+    now += SECTION_CYCLES;
+    advance();
+    deliver();
+}
+
+/* idle */
+
+static int input = 1;                   // stdin open, when not scripted
+static struct timespec epoch;           // real time of virtual time 0
+
+static uint64_t realNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - epoch.tv_sec) * SIM_HZ + (ts.tv_nsec - epoch.tv_nsec) * (int64_t)SIM_HZ / 1000000000;
+}
+
+// Follow real time up to virtual time t, taking terminal input on the way.
+static void waitUntil(uint64_t t) {
+    for (;;) {
+        uint64_t r = realNow();
+        int ms = t == NEVER ? -1 : r >= t ? 0 : (int)((t - r) / (SIM_HZ / 1000) + 1);
+        struct pollfd p = { 0, POLLIN, 0 };
+        uint8_t buf[64];
+        ssize_t n;
+
+        if (poll(&p, input, ms) > 0) {
+            if ((n = read(0, buf, sizeof(buf))) > 0) {
+                r = realNow();
+                now = max64(now, r < t ? r : t);
+                rxPush(buf, n, now);
+                return;
+            }
+            input = 0;                  // end of input
+        }
+        if (realNow() >= t) {
+            now = max64(now, t);
+            return;
+        }
+    }
+}
+
+void simSleep(void) {
+    int i;
+
+    advance();
+    if (pendingIrq() < 0) {
+        uint64_t t = nextEvent(&i);
+        if (!scripted)
+            waitUntil(t);
+        else if (t == NEVER) {
+            fprintf(stderr, "stm32sim: idle with nothing left to happen\n");
+            finish();
+        } else
+            now = max64(now, t);
+        advance();
+    }
+    deliver();
+}
+
+/* traps */
+
+static const struct {
+    uintptr_t page;
+    void (*before)(uintptr_t addr);
+    void (*after)(uintptr_t addr, int write, uint32_t old);
+} traps[] = {
+    { VECTORS, NULL, vectorAfter },
+    { TIM2_BASE, timBefore, timAfter },                 // TIM2..TIM5
+    { TIM6_BASE, tim6Before, tim6After },               // TIM6, TIM7, TIM12..TIM14
+    { CAN1_BASE & ~(PAGE - 1), NULL, canAfter },        // CAN1, CAN2
+    { DAC_BASE & ~(PAGE - 1), NULL, dacAfter },
+    { USART1_BASE, NULL, usartAfter },
+    { DMA1_BASE, NULL, dmaAfter },                      // DMA1, DMA2
+    { DWT_BASE, dwtBefore, dwtAfter },
+    { SCS_BASE, NULL, nvicAfter },                      // SysTick, NVIC, SCB
+};
+
+#define NTRAPS          (sizeof(traps) / sizeof(traps[0]))
+#define TRAP_FLAG       0x100
+
+static struct {
+    int trap;                           // -1: not stepping
+    uintptr_t addr;
+    int write;
+    uint32_t old;                       // word at addr before the access
+} step = { -1 };
+
+static void onFault(int sig, siginfo_t *si, void *ctx) {
+    ucontext_t *uc = ctx;
+    uintptr_t addr = (uintptr_t)si->si_addr;
+    unsigned int i;
+
+    for (i = 0; i < NTRAPS && addr - traps[i].page >= PAGE; i++)
+        ;
+    if (i == NTRAPS || step.trap >= 0) {
+        signal(SIGSEGV, SIG_DFL);       // a genuine fault: crash on return
+        return;
+    }
+    now += ACCESS_CYCLES;
+    advance();
+    if (traps[i].before)
+        traps[i].before(addr);
+    step.trap = i;
+    step.addr = addr;
+    step.write = (uc->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+    step.old = WORD(addr & ~3);
+    mprotect((void *)traps[i].page, PAGE, PROT_READ | PROT_WRITE);
+    uc->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;       // back here after one instruction
+}
+
+static void onStep(int sig, siginfo_t *si, void *ctx) {
+    ucontext_t *uc = ctx;
+    int i = step.trap;
+
+    uc->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+    if (i < 0)
+        return;
+    mprotect((void *)traps[i].page, PAGE, PROT_NONE);
+    step.trap = -1;
+    traps[i].after(step.addr, step.write, step.old);
+    deliver();
+}
+
+/* reset */
+
+static struct termios saved;
+
+static void restoreTty(void) {
+    tcsetattr(0, TCSANOW, &saved);
+}
+
+// Registers as the monitor and startup.c leave them.
+static void preset(void) {
+    int c;
+
+    SIM(RCC)->CR = RCC_CR_HSION | RCC_CR_HSIRDY | RCC_CR_HSEON | RCC_CR_HSERDY | RCC_CR_PLLON | RCC_CR_PLLRDY;
+    SIM(RCC)->PLLCFGR = RCC_PLLCFGR_PLLSRC_HSE | (HSE_VALUE / 1000000) | 336 << 6 | 7 << 24;
+    SIM(RCC)->CFGR = RCC_CFGR_SW_PLL | RCC_CFGR_SWS_PLL | RCC_CFGR_PPRE1_DIV4 | RCC_CFGR_PPRE2_DIV2;
+
+    SIM(TIM5)->ARR = 0xFFFFFFFF;
+
+    SIM(USART1)->SR = USART_SR_TXE | USART_SR_TC;
+    SIM(USART1)->BRR = 0x2D9;           // 115200 baud at 84 MHz
+    SIM(USART1)->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+
+    for (c = 0; c < 2; c++) {
+        SIM(can[c].regs)->MCR = 0x00010002;
+        SIM(can[c].regs)->MSR = 0x00000C02;
+        SIM(can[c].regs)->TSR = CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2;
+    }
+    SIM(CAN1)->FMR = 0x2A1C0E00;        // CAN2SB 14, filters active
+    SIM(CAN1)->FS1R = SIM(CAN1)->FA1R = 1;
+
+    SIM(DAC)->CR = DAC_CR_EN2;
+}
+
+__attribute__((constructor))
+static void simInit(void) {
+    struct sigaction sa;
+    const char *script = getenv("TTSIM_SCRIPT"), *log = getenv("TTSIM_LOG");
+    unsigned int i;
+
+    for (i = 0; i < NREGIONS; i++)
+        map(i);
+    preset();
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;      // faults nest inside interrupt handlers
+    sa.sa_sigaction = onFault;
+    sigaction(SIGSEGV, &sa, NULL);
+    sa.sa_sigaction = onStep;
+    sigaction(SIGTRAP, &sa, NULL);
+    for (i = 0; i < NTRAPS; i++)
+        mprotect((void *)traps[i].page, PAGE, PROT_NONE);
+
+    if (log && !(simLog = fopen(log, "w"))) {
+        perror(log);
+        exit(1);
+    }
+    if (script) {
+        loadScript(script);
+        scripted = 1;
+        input = 0;
+    } else if (isatty(0) && tcgetattr(0, &saved) == 0) {
+        struct termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(0, TCSANOW, &raw);
+        atexit(restoreTty);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+}
@@ -0,0 +1,17 @@
+/*
+ * stm32sim.h
+ *
+ * Register level model of the STM32F407 peripherals RTS-Lab uses, for
+ * running the unmodified drivers on a Linux host in virtual time.
+ * See stm32sim.c and "Host (POSIX) dependencies" in TinyTimber.c.
+ */
+
+#ifndef _STM32SIM_
+#define _STM32SIM_
+
+extern volatile int simMasked;      // BASEPRI at __DISABLED_PRIORITY
+
+void simUnmask(void);               // ENABLE(1): takes pending interrupts
+void simSleep(void);                // WFI: advances virtual time to the next event
+
+#endif
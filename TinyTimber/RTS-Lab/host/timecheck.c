@@ -0,0 +1,110 @@
+//
+// Host check of the Time conversion macros and of the 64 bit Time built
+// from TIM5 and its overflow count. The kernel is compiled into this file
+// with the register level TIMER_READ() of the target (__TT_SIM), and TIM5
+// is a plain memory page that the checks set by hand. "make check" runs it
+// with the 10 us tick and with __USE_HIRES_TIMER.
+//
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "stm32sim.h"
+#include "TinyTimber.h"
+
+#define remove kernelRemove          // not the one of <stdio.h>
+#include "../TinyTimber.c"
+#undef remove
+#include <stdio.h>
+
+volatile int simMasked = 1;
+void simUnmask(void) { }
+void simSleep(void) { }
+
+static int failures = 0;
+
+#define CHECK(cond) \
+        { if (!(cond)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } }
+
+#ifdef __USE_HIRES_TIMER
+#define TICK_NS     (1000000000.0 / 84000000)
+#else
+#define TICK_NS     10000.0
+#endif
+
+static void checkMacros(void) {
+    Time t;
+    long us;
+
+    CHECK(SEC(1) == __TIMER_HZ);
+    CHECK(MSEC(1000) == SEC(1));
+    CHECK(USEC(1000000) == SEC(1));
+#ifdef __USE_HIRES_TIMER
+    CHECK(USEC(931) == 78204);                  // exact
+    CHECK(USEC(1) == 84);
+#else
+    CHECK(USEC(931) == 93);                     // truncated to the 10 us tick
+    CHECK(USEC(9) == 0);
+#endif
+    CHECK(SEC(3000) == (Time)3000 * __TIMER_HZ);    // past 32 bits at 84 MHz
+    CHECK(SEC_OF(SEC(3000) + MSEC(1)) == 3000);
+
+    // Round trip 0..5 s in 7 us steps, to the tick
+    for (us = 0; us < 5000000; us += 7) {
+        long exact = (long)(USEC(us) * TICK_NS / 1000 + 0.5);
+        t = USEC(us);
+        if (SEC_OF(t) * 1000000L + USEC_OF(t) != exact) {
+            CHECK(SEC_OF(t) * 1000000L + USEC_OF(t) == exact);
+            break;
+        }
+        if (MSEC_OF(t) != USEC_OF(t) / 1000) {
+            CHECK(MSEC_OF(t) == USEC_OF(t) / 1000);
+            break;
+        }
+    }
+}
+
+// TIM5 at lo with the update flag as given, overflows counted as hi
+static Time readAt(unsigned int hi, uint32_t lo, int pending) {
+    overflows = hi;
+    TIM5->CNT = lo;
+    TIM5->SR = pending ? TIM_SR_UIF : 0;
+    return TIMER_READ();
+}
+
+static void checkWrap(void) {
+    Time before, after;
+    int wrap;
+
+    CHECK(readAt(0, 0xFFFFFFF0, 0) == 0xFFFFFFF0);
+    CHECK(readAt(0, 5, 1) == ((Time)1 << 32 | 5));          // wrapped, not yet counted
+    CHECK(readAt(0, 0xFFFFFFF0, 1) == 0xFFFFFFF0);          // read before the wrap
+    CHECK(readAt(1, 5, 0) == ((Time)1 << 32 | 5));
+
+    // Differences and order across three wraps, counted or still pending
+    for (wrap = 0; wrap < 3; wrap++) {
+        before = readAt(wrap, 0xFFFFFF00, 0);
+        after = readAt(wrap, 0x100, 1);
+        CHECK(after - before == 0x200);
+        CHECK(after - before > 0);
+        after = readAt(wrap + 1, 0x100, 0);
+        CHECK(after - before == 0x200);
+    }
+    CHECK(readAt(0xFFFFFFFF, 0xFFFFFFFF, 0) == ((Time)0xFFFFFFFF << 32 | 0xFFFFFFFF));
+}
+
+int main(void) {
+    void *page = (void *)(TIM5_BASE & ~(uintptr_t)0xFFF);
+    if (mmap(page, 4096, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != page) {
+        printf("timecheck: cannot map TIM5\n");
+        return 2;
+    }
+    checkMacros();
+    checkWrap();
+    printf("timecheck (%d Hz tick): %s\n", __TIMER_HZ, failures ? "FAILED" : "ok");
+    return failures != 0;
+}
@@ -0,0 +1,75 @@
+#include "TinyTimber.h"
+#include "pwmTinyTimber.h"
+#include "stm32f4xx_rcc.h"
+#include "stm32f4xx_gpio.h"
+#include "stm32f4xx_dac.h"
+
+#if defined(__TT_HOST_IO)
+//
+// Host port: there is no pin. The tone is only remembered.
+//
+void pwm_init(Pwm *self, int unused) {
+	pwm_stop(self, 0);
+}
+
+void pwm_stop(Pwm *self, int unused) {
+	self->period = 0;
+}
+
+void pwm_tone(Pwm *self, PwmTone *tone) {
+	self->period = tone->period;
+	self->duty = tone->duty;
+}
+
+#else
+//
+// TIM2 channel 1 (AF1) drives PA5, the pin of DAC channel 2, in PWM mode 1:
+// the counter runs from 0 to ARR = period - 1 and the output is high while
+// it is below CCR1 = duty. ARR and CCR1 are preloaded and change at an
+// update. Stopped, the output is forced inactive.
+//
+#define	OC1_LOW		(TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1PE)
+#define	OC1_PWM1	(TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1PE)
+
+void pwm_init(Pwm *self, int unused) {
+	GPIO_InitTypeDef GPIO_InitStructure;
+
+	RCC_APB1PeriphClockCmd( RCC_APB1Periph_TIM2, ENABLE);
+	DAC_Cmd( DAC_Channel_2, DISABLE);
+
+	GPIO_PinAFConfig(GPIOA, GPIO_PinSource5, GPIO_AF_TIM2);
+
+	GPIO_StructInit( &GPIO_InitStructure );
+	GPIO_InitStructure.GPIO_Pin = GPIO_Pin_5;
+	GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+	GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+	GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+	GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+	GPIO_Init(GPIOA, &GPIO_InitStructure);
+
+	TIM2->CR1 = TIM_CR1_ARPE | TIM_CR1_URS;
+	TIM2->PSC = 0;
+	TIM2->CCMR1 = OC1_LOW;
+	TIM2->CCER = TIM_CCER_CC1E;
+	self->period = self->duty = 0;
+}
+
+void pwm_stop(Pwm *self, int unused) {
+	TIM2->CR1 &= ~TIM_CR1_CEN;
+	TIM2->CCMR1 = OC1_LOW;
+	self->period = 0;
+}
+
+void pwm_tone(Pwm *self, PwmTone *tone) {
+	TIM2->ARR = tone->period - 1;
+	TIM2->CCR1 = tone->duty;
+	if (!self->period) {
+		TIM2->CCMR1 = OC1_PWM1;
+		TIM2->EGR = TIM_EGR_UG;                                 // load ARR and CCR1, count from 0
+		TIM2->CR1 |= TIM_CR1_CEN;
+	}
+	self->period = tone->period;
+	self->duty = tone->duty;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef PWM_TINYT_H
+#define PWM_TINYT_H
+
+#include "stm32f4xx.h"
+
+#define PWM_CLOCK   84000000    // TIM2 clock, Hz
+
+// PWM_TONE square wave: period TIM2 clocks, high for the first duty of them
+typedef struct {
+	int period;             // at least 2
+	int duty;               // 0 to period
+} PwmTone;
+
+typedef struct {
+	Object super;
+	int period;             // being played, 0 when stopped
+	int duty;
+} Pwm;
+
+#define initPwm()   { initObject(), 0, 0 }
+
+void pwm_init(Pwm *obj, int unused);
+void pwm_tone(Pwm *obj, PwmTone *tone);
+void pwm_stop(Pwm *obj, int unused);
+
+// Hand PA5 from DAC channel 2 over to TIM2 channel 1, output low
+#define PWM_INIT(pwm)           SYNC(pwm, pwm_init, 0)
+
+// TIM2 generates the square wave on PA5 without the CPU. A new tone while
+// one plays takes effect at the end of the current period, glitch free.
+#define PWM_TONE(pwm, toneptr)  SYNC(pwm, pwm_tone, toneptr)
+
+// Stop TIM2 and hold the output low
+#define PWM_STOP(pwm)           SYNC(pwm, pwm_stop, 0)
+
+#endif
@@ -1,14 +1,370 @@
+#include <stdarg.h>
+#include <string.h>
+#if defined(__TT_HOST) && !defined(__TT_SIM)
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
 #include "TinyTimber.h"
 #include "sciTinyTimber.h"
 
+#define	__SCI_TX_DMA	// USART1 transmits by DMA2 Stream7 out of buf, undefined: one TXE interrupt per byte
+
+// SCI_RX_LINES: deliver what arrived between rxTail and rxHead, one chunk
+// per line (ending in \n, \r or \r\n) and one for the rest; a chunk
+// never runs past the end of rxBuf. Only descriptors the receiver is done
+// with are used, and the last free one takes the rest whole. Returns the
+// number of chunks sent.
+static int rx_deliver(Serial *self) {
+    int sent = 0;
+
+    while (self->rxTail != self->rxHead && (!self->obj || self->rxOut < SCI_NCHUNKS)) {
+        int i = self->rxTail;
+        int end = self->rxHead > i ? self->rxHead : SCI_RXSIZE;
+        int last = self->obj && self->rxOut == SCI_NCHUNKS - 1;
+        SciChunk *d = &self->chunks[self->nextChunk];
+
+        while (i < end && (last || (self->rxBuf[i] != '\n' && self->rxBuf[i] != '\r')))
+            i++;
+        if (i < end) {
+            if (self->rxBuf[i] == '\r' && i + 1 < end && self->rxBuf[i + 1] == '\n')
+                i++;
+            i++;
+        }
+        d->data = &self->rxBuf[self->rxTail];
+        d->length = i - self->rxTail;
+        self->rxTail = i % SCI_RXSIZE;
+        self->nextChunk = (self->nextChunk + 1) % SCI_NCHUNKS;
+        if (self->obj) {
+            self->rxOut++;
+            ASYNC(self->obj, self->meth, (int)d);
+            sent++;
+        }
+    }
+    return sent;
+}
+
+void sci_rx_done(Serial *self, int unused) {
+    if (self->rxOut > 0)
+        self->rxOut--;
+    rx_deliver(self);
+}
+
+// SCI_PRINTF formatting: %d %i %u %x %X %c %s and %%, with an optional
+// '-' or '0' flag, a field width and the l modifier. Characters go to
+// put() one at a time; the only buffer is the digits of one number.
+typedef struct {
+    const char *fmt;
+    va_list ap;
+} PrintfArgs;
+
+static int format(Serial *self, void (*put)(Serial *, char), const char *f, va_list ap) {
+    static const char hex[2][16] = { "0123456789abcdef", "0123456789ABCDEF" };
+    int n = 0;
+
+    for (; *f != '\0'; f++) {
+        char digits[3 * sizeof(long)], pad = ' ';
+        const char *s;
+        int len, width = 0, left = 0, lng = 0, neg = 0;
+
+        if (*f != '%') {
+            put(self, *f);
+            n++;
+            continue;
+        }
+        if (*++f == '-') {
+            left = 1;
+            f++;
+        } else if (*f == '0') {
+            pad = '0';
+            f++;
+        }
+        while (*f >= '0' && *f <= '9')
+            width = width * 10 + *f++ - '0';
+        if (*f == 'l') {
+            lng = 1;
+            f++;
+        }
+        switch (*f) {
+          case 'd':
+          case 'i':
+          case 'u':
+          case 'x':
+          case 'X': {
+            unsigned long v, base = (*f == 'x' || *f == 'X') ? 16 : 10;
+            if (*f == 'd' || *f == 'i') {
+                long x = lng ? va_arg(ap, long) : va_arg(ap, int);
+                neg = x < 0;
+                v = neg ? 0UL - (unsigned long)x : (unsigned long)x;
+            } else
+                v = lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            len = 0;
+            do
+                digits[sizeof(digits) - ++len] = hex[*f == 'X'][v % base];
+            while ((v /= base) != 0);
+            s = digits + sizeof(digits) - len;
+            break;
+          }
+          case 'c':
+            digits[0] = va_arg(ap, int);
+            s = digits;
+            len = 1;
+            break;
+          case 's':
+            s = va_arg(ap, char *);
+            if (!s)
+                s = "(null)";
+            len = strlen(s);
+            break;
+          case '\0':
+            return n;
+          default:                      // %% and anything unknown as is
+            s = f;
+            len = 1;
+        }
+        width = width > len + neg ? width - len - neg : 0;
+        n += width + len + neg;
+        if (neg && pad == '0')
+            put(self, '-');
+        while (!left && width-- > 0)
+            put(self, pad);
+        if (neg && pad != '0')
+            put(self, '-');
+        while (len-- > 0)
+            put(self, *s++);
+        while (left && width-- > 0)
+            put(self, ' ');
+    }
+    return n;
+}
+
+// SCI_FRAME encoding: payload p[0..n-1] followed by its CRC-8, COBS
+// encoded between two 0x00 delimiters. With n < 254 each 0x00 of the data
+// becomes one code byte and one more leads, so the frame is n + 4 bytes.
+static unsigned char crc8(const unsigned char *p, int n) {
+    unsigned char crc = 0;
+    while (n-- > 0) {
+        int i;
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static void cobs(Serial *self, void (*put)(Serial *, char), const unsigned char *p, int n) {
+    unsigned char crc = crc8(p, n);
+    int i = 0, j;
+
+    put(self, 0);
+    for (;;) {
+        for (j = i; j < n + 1 && (j < n ? p[j] : crc) != 0; j++)
+            ;
+        put(self, j - i + 1);
+        for (; i < j; i++)
+            put(self, i < n ? p[i] : crc);
+        if (j == n + 1)
+            break;
+        i = j + 1;                      // the 0x00 the code byte stands for
+    }
+    put(self, 0);
+}
+
+// Send the SCI_NOTIFY message once enough of buf is free.
+static void space_check(Serial *self) {
+    int space = SCI_BUFSIZE - self->count;
+    if (self->waiter.space > 0 && space >= self->waiter.space) {
+        self->waiter.space = 0;
+        ASYNC(self->waiter.obj, self->waiter.meth, space);
+        doIRQSchedule = 1;
+    }
+}
+
+#if defined(__TT_HOST_IO)
+//
+// Host port: USART1 is stdin/stdout. Input raises SIGIO, which the kernel
+// delivers as IRQ_USART1; output is written through at once.
+// <termios.h> defines CR1..CR3 and must follow the device header.
+//
+#include <termios.h>
+
+static struct termios saved;
+
+static void restore_tty(void) {
+    tcsetattr(0, TCSANOW, &saved);
+}
+
 void sci_init(Serial *self, int unused) {
     self->count = self->head = self->tail = 0;
+    self->rxHead = self->rxTail = 0;
+    self->rxOut = 0;
+
+    if (isatty(0) && tcgetattr(0, &saved) == 0) {   // deliver keys as typed
+        struct termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(0, TCSANOW, &raw);
+        atexit(restore_tty);
+    }
+    fcntl(0, F_SETOWN, getpid());
+    fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_ASYNC);
+    kill(getpid(), SIGIO);      // input that arrived before now
+}
+
+void sci_write(Serial *self, char *p) {
+    if (write(1, p, strlen(p)) < 0)
+        return;
+}
+
+void sci_writechar(Serial *self, int c) {
+    char ch = c;
+    if (write(1, &ch, 1) < 0)
+        return;
+}
+
+int sci_trywrite(Serial *self, char *p) {
+    int n = strlen(p);
+    return write(1, p, n) < 0 ? 0 : n;
+}
+
+int sci_trywritechar(Serial *self, int c) {
+    char ch = c;
+    return write(1, &ch, 1) == 1;
+}
+
+// buf stages SCI_PRINTF output on its way to stdout.
+static void flush(Serial *self) {
+    if (self->head > 0 && write(1, self->buf, self->head) < 0)
+        ;
+    self->head = 0;
+}
+
+static void putbuf(Serial *self, char c) {
+    self->buf[self->head++] = c;
+    if (self->head == SCI_BUFSIZE)
+        flush(self);
+}
+
+static int sci_vprintf(Serial *self, PrintfArgs *a) {
+    int n = format(self, putbuf, a->fmt, a->ap);
+    flush(self);
+    return n;
+}
+
+int sci_frame(Serial *self, SciFrame *f) {
+    if (f->length < 0 || f->length > SCI_FRAMESIZE)
+        return 0;
+    cobs(self, putbuf, f->data, f->length);
+    flush(self);
+    return 1;
+}
+
+int sci_interrupt(Serial *self, int unused) {
+    int n = 0;
+    unsigned char c;
+    ioctl(0, FIONREAD, &n);
+    if (self->rxMode == SCI_RX_LINES) {
+        while (n > 0) {
+            int k = SCI_RXSIZE - self->rxHead;
+            if ((k = read(0, &self->rxBuf[self->rxHead], n < k ? n : k)) <= 0)
+                break;
+            n -= k;
+            self->rxHead = (self->rxHead + k) % SCI_RXSIZE;
+            if (rx_deliver(self))
+                doIRQSchedule = 1;
+        }
+        return 0;
+    }
+    while (n-- > 0 && read(0, &c, 1) == 1) {
+        if (self->obj) {
+            ASYNC(self->obj, self->meth, c);
+            doIRQSchedule = 1;
+        }
+    }
+    return 0;
+}
+
+#else
+
+#include "stm32f4xx_rcc.h"
+
+#ifdef __SCI_TX_DMA
+//
+// DMA2 Stream7 channel 4 serves the USART1 TX request. A transfer covers
+// buf from tail up to head, or up to the end of buf if the data wraps, and
+// stays counted in count until its completion interrupt; that interrupt
+// then starts the rest. Only SCI_PORT0 can be driven this way.
+//
+#define	TX_STREAM	DMA2_Stream7
+#define	TX_FLAGS	(DMA_HIFCR_CTCIF7 | DMA_HIFCR_CHTIF7 | DMA_HIFCR_CTEIF7 | DMA_HIFCR_CDMEIF7 | DMA_HIFCR_CFEIF7)
+
+static void tx_start(Serial *self) {
+    int n = self->count;
+    if (self->tail + n > SCI_BUFSIZE)
+        n = SCI_BUFSIZE - self->tail;
+    TX_STREAM->M0AR = (uint32_t)&self->buf[self->tail];
+    TX_STREAM->NDTR = n;
+    DMA2->HIFCR = TX_FLAGS;
+    TX_STREAM->CR |= DMA_SxCR_EN;
+    self->txLen = n;
+}
+#endif
+
+//
+// SCI_RX_LINES: DMA2 Stream5 channel 4 receives into rxBuf in circular
+// mode. Whatever has arrived is delivered when the line goes idle (IDLE)
+// and when the stream reaches the middle or the end of rxBuf (HT, TC), so
+// a steady stream is never overwritten before it is delivered.
+//
+#define	RX_STREAM	DMA2_Stream5
+#define	RX_FLAGS	(DMA_HIFCR_CTCIF5 | DMA_HIFCR_CHTIF5 | DMA_HIFCR_CTEIF5 | DMA_HIFCR_CDMEIF5 | DMA_HIFCR_CFEIF5)
+
+void sci_init(Serial *self, int unused) {
+    self->count = self->head = self->tail = 0;
+    self->txLen = 0;
+    self->rxHead = self->rxTail = 0;
+    self->rxOut = 0;
 
-	USART_ITConfig( USART1, USART_IT_RXNE, ENABLE);
 	USART_ITConfig( USART1, USART_IT_TXE, DISABLE);
 	NVIC_SetPriority( USART1_IRQn, __IRQ_PRIORITY);
 	NVIC_EnableIRQ( USART1_IRQn);
   
+	if (self->rxMode == SCI_RX_LINES) {
+		RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_DMA2, ENABLE);
+		RX_STREAM->CR = 0;
+		while (RX_STREAM->CR & DMA_SxCR_EN)
+			;
+		RX_STREAM->PAR = (uint32_t)&self->port->DR;
+		RX_STREAM->M0AR = (uint32_t)self->rxBuf;
+		RX_STREAM->NDTR = SCI_RXSIZE;
+		RX_STREAM->FCR = 0;                                     // direct mode
+		DMA2->HIFCR = RX_FLAGS;
+		RX_STREAM->CR = DMA_SxCR_CHSEL_2 | DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_HTIE | DMA_SxCR_TCIE | DMA_SxCR_EN;
+		USART_DMACmd( self->port, USART_DMAReq_Rx, ENABLE);
+		USART_ITConfig( USART1, USART_IT_IDLE, ENABLE);
+		INSTALL(self, sci_interrupt, SCI_RX_IRQ0);
+		NVIC_SetPriority( DMA2_Stream5_IRQn, __IRQ_PRIORITY);
+		NVIC_EnableIRQ( DMA2_Stream5_IRQn);
+	} else
+		USART_ITConfig( USART1, USART_IT_RXNE, ENABLE);
+
+#ifdef __SCI_TX_DMA
+	RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_DMA2, ENABLE);
+	TX_STREAM->CR = 0;
+	while (TX_STREAM->CR & DMA_SxCR_EN)
+		;
+	TX_STREAM->PAR = (uint32_t)&self->port->DR;
+	TX_STREAM->FCR = 0;                                         // direct mode
+	TX_STREAM->CR = DMA_SxCR_CHSEL_2 | DMA_SxCR_MINC | DMA_SxCR_DIR_0 | DMA_SxCR_TCIE | DMA_SxCR_TEIE;
+	DMA2->HIFCR = TX_FLAGS;
+	USART_DMACmd( self->port, USART_DMAReq_Tx, ENABLE);
+	INSTALL(self, sci_interrupt, SCI_TX_IRQ0);
+	NVIC_SetPriority( DMA2_Stream7_IRQn, __IRQ_PRIORITY);
+	NVIC_EnableIRQ( DMA2_Stream7_IRQn);
+#endif
 }
 
 static void outc(Serial *self, char c){
@@ -16,30 +372,92 @@ static void outc(Serial *self, char c){
         self->buf[self->head] = c;
         self->head = (self->head + 1) % SCI_BUFSIZE;
 	    self->count++;
-    }
-//	else
-//		Should handle overflow;
+	    if (self->count > self->highWater)
+	        self->highWater = self->count;
+    } else
+        self->drops++;
 }
 
-void sci_write(Serial *self, char *p) {
-	if (self->count == 0)
+// Get the transmitter going on what has been queued.
+static void tx_kick(Serial *self) {
+#ifdef __SCI_TX_DMA
+    if (self->txLen == 0 && self->count > 0)
+        tx_start(self);
+#else
+    if (self->count > 0)
         USART_ITConfig( self->port, USART_IT_TXE, ENABLE);
+#endif
+}
 
+void sci_write(Serial *self, char *p) {
     while (*p != '\0') {
         if (*p == '\n')
             outc(self, '\r');
         outc(self, *p++);
     }
+    tx_kick(self);
 }
 
 void sci_writechar(Serial *self, int c) {
-    if (self->count == 0)
-        USART_ITConfig( self->port, USART_IT_TXE, ENABLE);
     outc(self, c);
+    tx_kick(self);
+}
+
+int sci_trywrite(Serial *self, char *p) {
+    char *start = p;
+    while (*p != '\0' && SCI_BUFSIZE - self->count >= (*p == '\n' ? 2 : 1)) {
+        if (*p == '\n')
+            outc(self, '\r');
+        outc(self, *p++);
+    }
+    tx_kick(self);
+    return p - start;
+}
+
+int sci_trywritechar(Serial *self, int c) {
+    if (self->count == SCI_BUFSIZE)
+        return 0;
+    outc(self, c);
+    tx_kick(self);
+    return 1;
+}
+
+static void putcr(Serial *self, char c) {
+    if (c == '\n')
+        outc(self, '\r');
+    outc(self, c);
+}
+
+static int sci_vprintf(Serial *self, PrintfArgs *a) {
+    int n = format(self, putcr, a->fmt, a->ap);
+    tx_kick(self);
+    return n;
+}
+
+int sci_frame(Serial *self, SciFrame *f) {
+    if (f->length < 0 || f->length > SCI_FRAMESIZE)
+        return 0;
+    if (SCI_BUFSIZE - self->count < f->length + 4) {
+        self->drops += f->length + 4;
+        return 0;
+    }
+    cobs(self, outc, f->data, f->length);
+    tx_kick(self);
+    return 1;
 }
 
 int sci_interrupt(Serial *self, int unused) {
-    if (USART_GetFlagStatus( self->port, USART_FLAG_RXNE) == SET) {     // Data received
+    if (self->rxMode == SCI_RX_LINES) {
+        int idle = USART_GetFlagStatus( self->port, USART_FLAG_IDLE) == SET;
+        if (idle)                                                       // Line idle
+            USART_ReceiveData( self->port);                             // clears IDLE
+        if (idle || (DMA2->HISR & (DMA_HISR_HTIF5 | DMA_HISR_TCIF5))) { // or rxBuf half or completely filled
+            DMA2->HIFCR = RX_FLAGS;
+            self->rxHead = (SCI_RXSIZE - RX_STREAM->NDTR) % SCI_RXSIZE;
+            if (rx_deliver(self))
+                doIRQSchedule = 1;
+        }
+    } else if (USART_GetFlagStatus( self->port, USART_FLAG_RXNE) == SET) {  // Data received
 		int c;
 		
 		c = USART_ReceiveData( self->port);
@@ -50,6 +468,17 @@ int sci_interrupt(Serial *self, int unused) {
 		}
     } 
     
+#ifdef __SCI_TX_DMA
+    if (DMA2->HISR & (DMA_HISR_TCIF7 | DMA_HISR_TEIF7)) {             // Transfer complete (or aborted)
+        DMA2->HIFCR = TX_FLAGS;
+        self->tail = (self->tail + self->txLen) % SCI_BUFSIZE;
+        self->count -= self->txLen;
+        self->txLen = 0;
+        if (self->count > 0)
+            tx_start(self);
+        space_check(self);
+    }
+#else
     if (USART_GetFlagStatus(self->port, USART_FLAG_TXE) == SET) {       // Transmit buffer empty
         if (self->count > 0) {
             USART_SendData( self->port, self->buf[self->tail]);
@@ -57,9 +486,41 @@ int sci_interrupt(Serial *self, int unused) {
             self->count--;
             if (self->count == 0)
 				USART_ITConfig( self->port, USART_IT_TXE, DISABLE);
+            space_check(self);
         } else {
             USART_ITConfig( self->port, USART_IT_TXE, DISABLE);  
         }
     }
+#endif
 	return 0;
 }
+
+#endif
+
+int sci_notify(Serial *self, SciNotify *req) {
+    self->waiter = *req;
+    space_check(self);
+    return SCI_BUFSIZE - self->count;
+}
+
+int sci_stats(Serial *self, SciStats *stats) {
+    stats->drops = self->drops;
+    stats->highWater = self->highWater;
+    stats->count = self->count;
+    return SCI_BUFSIZE - self->count;
+}
+
+void sci_stats_reset(Serial *self, int unused) {
+    self->drops = 0;
+    self->highWater = self->count;
+}
+
+int sci_printf(Serial *self, const char *fmt, ...) {
+    PrintfArgs a;
+    int n;
+    a.fmt = fmt;
+    va_start(a.ap, fmt);
+    n = SYNC(self, sci_vprintf, &a);
+    va_end(a.ap);
+    return n;
+}
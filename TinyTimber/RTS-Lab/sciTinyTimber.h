@@ -5,6 +5,42 @@
 #include "stm32f4xx_usart.h"
 
 #define SCI_BUFSIZE  1024
+#define SCI_RXSIZE   256     // receive buffer of the SCI_RX_LINES mode
+#define SCI_NCHUNKS  8
+#define SCI_FRAMESIZE 253    // largest SCI_FRAME payload
+
+enum { SCI_RX_CHAR, SCI_RX_LINES };
+
+// A received line, or what arrived of one before the line went idle or the
+// receive buffer wrapped. Passed to the receiver as its int argument in
+// SCI_RX_LINES mode. data stays valid until SCI_RXSIZE more bytes have
+// arrived, the descriptor until the receiver hands it back with
+// SCI_RX_DONE. While SCI_NCHUNKS are out, further input waits in rxBuf;
+// the last free descriptor takes all of it as one chunk.
+typedef struct {
+    char *data;
+    int length;
+} SciChunk;
+
+// SCI_NOTIFY request: meth(obj, free) is sent once at least space bytes of
+// the transmit buffer are free. A new request replaces a pending one.
+typedef struct {
+    Object *obj;
+    Method meth;
+    int space;
+} SciNotify;
+
+// SCI_FRAME payload: any bytes, length at most SCI_FRAMESIZE.
+typedef struct {
+    const void *data;
+    int length;
+} SciFrame;
+
+typedef struct {
+    unsigned int drops;     // characters lost to a full transmit buffer
+    int highWater;          // most bytes queued at once
+    int count;              // bytes queued now
+} SciStats;
 
 typedef struct {
     Object super;
@@ -14,23 +50,78 @@ typedef struct {
     int head;
     int tail;
     int count;
+    int txLen;          // bytes from tail in the DMA transfer under way
+    int rxMode;         // SCI_RX_CHAR: meth(obj, c), SCI_RX_LINES: meth(obj, SciChunk*)
+    int rxHead;         // receive buffer write position
+    int rxTail;         // first byte not yet delivered
+    int nextChunk;
+    int rxOut;          // descriptors delivered and not yet done
+    unsigned int drops;
+    int highWater;
+    SciNotify waiter;   // waiter.space 0 when nobody waits
+    SciChunk chunks[SCI_NCHUNKS];
     char buf[SCI_BUFSIZE];
+    char rxBuf[SCI_RXSIZE];
 } Serial;
 
 #define initSerial(port, obj, meth) \
-    { initObject(), port, (Object*)obj, (Method)meth, 0, 0, 0 }
+    { initObject(), port, (Object*)obj, (Method)meth, 0, 0, 0, 0, SCI_RX_CHAR }
+
+#define initSerialLines(port, obj, meth) \
+    { initObject(), port, (Object*)obj, (Method)meth, 0, 0, 0, 0, SCI_RX_LINES }
 
 #define SCI_PORT0   (USART_TypeDef *)(USART1)
 #define	SCI_IRQ0	IRQ_USART1
+#define	SCI_TX_IRQ0	IRQ_DMA2_STREAM7    // installed by sci_init() with __SCI_TX_DMA
+#define	SCI_RX_IRQ0	IRQ_DMA2_STREAM5    // installed by sci_init() in SCI_RX_LINES mode
 
 void sci_init(Serial *sci, int unused);
 void sci_write(Serial *sci, char *buf);
 void sci_writechar(Serial *sci, int ch);
+int sci_trywrite(Serial *sci, char *buf);
+int sci_trywritechar(Serial *sci, int ch);
+int sci_notify(Serial *sci, SciNotify *req);
+int sci_stats(Serial *sci, SciStats *stats);
+void sci_stats_reset(Serial *sci, int unused);
+int sci_printf(Serial *sci, const char *fmt, ...);
+int sci_frame(Serial *sci, SciFrame *frame);
+void sci_rx_done(Serial *sci, int unused);
 
 #define SCI_INIT(sci)           SYNC(sci, sci_init, 0)
 #define SCI_WRITE(sci,buf)      SYNC(sci, sci_write, buf)
 #define SCI_WRITECHAR(sci,ch)   SYNC(sci, sci_writechar, ch)
 
+// Non-blocking variants: nothing is dropped, the return value tells how
+// much was taken. TRYWRITE returns the number of characters of buf queued,
+// stopping at the first that does not fit (a '\n' needs room for "\r\n");
+// TRYWRITECHAR returns 1 or 0.
+#define SCI_TRYWRITE(sci,buf)       SYNC(sci, sci_trywrite, buf)
+#define SCI_TRYWRITECHAR(sci,ch)    SYNC(sci, sci_trywritechar, ch)
+
+// Returns the free space now; the notification may already be on its way.
+#define SCI_NOTIFY(sci,reqptr)      SYNC(sci, sci_notify, reqptr)
+
+// Copy the drop and high-water counters to *stats, returns the free space.
+#define SCI_STATS(sci,statsptr)     SYNC(sci, sci_stats, statsptr)
+#define SCI_STATS_RESET(sci)        SYNC(sci, sci_stats_reset, 0)
+
+// Format straight into the transmit buffer under one sync(): %d %i %u %x
+// %X %c %s %%, '-' and '0' flags, field width, l modifier. No heap, no
+// temporary string. Returns the number of characters formatted; those that
+// do not fit are dropped as by SCI_WRITE.
+#define SCI_PRINTF(sci, ...)        sci_printf(sci, __VA_ARGS__)
+
+// Binary frame multiplexed with the text: 0x00, the COBS encoding of the
+// payload and its CRC-8 (polynomial 0x07), 0x00. Text never contains 0x00,
+// so a reader tells the two apart; see tools/telemetry.py. The frame goes
+// out whole, without '\n' translation, or not at all: returns 1 if queued,
+// 0 if it did not fit (counted in drops) or is too long.
+#define SCI_FRAME(sci,frameptr)     SYNC(sci, sci_frame, frameptr)
+
+// SCI_RX_LINES: the receiver is done with the oldest SciChunk it was sent.
+// Input held back for lack of descriptors is delivered now.
+#define SCI_RX_DONE(sci)            SYNC(sci, sci_rx_done, 0)
+
 int sci_interrupt(Serial *self, int unused);
 
 #endif
@@ -0,0 +1,238 @@
+#include "TinyTimber.h"
+#include "dacTinyTimber.h"
+#include "synthTinyTimber.h"
+
+#if defined(__TT_HOST)
+//
+// Host port: the SIMD instructions in C
+//
+#undef __PKHBT
+#define __QADD16(x, y)      hostQadd16(x, y)
+#define __SMUAD(x, y)       hostSmuad(x, y)
+#define __SMUADX(x, y)      hostSmuad(x, (y) >> 16 | (y) << 16)
+#define __PKHBT(x, y, n)    (((uint32_t)(x) & 0xFFFF) | ((uint32_t)(y) << (n) & 0xFFFF0000))
+
+static int32_t hostSat16(int32_t x) {
+	return x > 32767 ? 32767 : x < -32768 ? -32768 : x;
+}
+
+static uint32_t hostQadd16(uint32_t x, uint32_t y) {
+	return (hostSat16((int16_t)x + (int16_t)y) & 0xFFFF)
+	     | (uint32_t)hostSat16((int16_t)(x >> 16) + (int16_t)(y >> 16)) << 16;
+}
+
+static uint32_t hostSmuad(uint32_t x, uint32_t y) {
+	return (int16_t)x * (int16_t)y + (int16_t)(x >> 16) * (int16_t)(y >> 16);
+}
+#endif
+
+#define	TABLE_BITS	8
+#define	TABLE_SIZE	(1 << TABLE_BITS)
+#define	FRAC_SHIFT	(32 - TABLE_BITS - 15)     // 15 bits below the index
+
+// Entry i holds sample i in the low half and sample i + 1 in the high half,
+// so one load fetches both ends of the interpolation.
+static uint32_t tables[N_WAVEFORMS][TABLE_SIZE];
+
+// First quarter of the sine, 32767 * sin(i * pi / 128)
+static const int16_t quarter[TABLE_SIZE / 4 + 1] = {
+	0, 804, 1608, 2410, 3212, 4011, 4808, 5602,
+	6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793,
+	12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+	18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+	23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+	27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+	30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+	32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+	32767,
+};
+
+static int value(enum Waveform wave, int i) {
+	int q = TABLE_SIZE / 4, tri;
+
+	i &= TABLE_SIZE - 1;
+	switch (wave) {
+	  case WAVE_SINE:
+		return i < 2 * q ? quarter[i < q ? i : 2 * q - i]
+		                 : -quarter[i < 3 * q ? i - 2 * q : 4 * q - i];
+	  case WAVE_TRIANGLE:
+		tri = i < q ? i : i < 3 * q ? 2 * q - i : i - 4 * q;
+		return tri * 32767 / q;
+	  case WAVE_SAW:
+		return (i - 2 * q) * (32768 / (2 * q));
+	  default:
+		return i < 2 * q ? 32767 : -32767;
+	}
+}
+
+void synth_init(void) {
+	int w, i;
+
+	for (w = 0; w < N_WAVEFORMS; w++)
+		for (i = 0; i < TABLE_SIZE; i++)
+			tables[w][i] = __PKHBT(value(w, i), value(w, i + 1), 16);
+}
+
+uint32_t synth_step(int period) {
+	uint64_t d = (uint64_t)SYNTH_RATE * period;
+
+	return period > 0 ? (((uint64_t)1000000 << 32) + d / 2) / d : 0;
+}
+
+// Interpolate between the two entries around phase: one SMUAD weighs both
+static inline int32_t sample(const uint32_t *table, uint32_t phase) {
+	uint32_t frac = phase >> FRAC_SHIFT & 0x7FFF;
+
+	return (int32_t)__SMUAD(table[phase >> (32 - TABLE_BITS)], frac << 16 | (0x7FFF - frac)) >> 15;
+}
+
+void synth_render(Osc *osc, SynthBlock block) {
+	const uint32_t *table = tables[osc->wave];
+	uint32_t phase = osc->phase, step = osc->step;
+	int i;
+
+	for (i = 0; i < SYNTH_BLOCK / 2; i++) {
+		int32_t s0 = sample(table, phase);
+		int32_t s1 = sample(table, phase + step);
+		block[i] = __PKHBT(s0, s1, 16);
+		phase += 2 * step;
+	}
+	osc->phase = phase;
+}
+
+// SMUAD and SMUADX with the gain in the low half multiply the low and the
+// high sample of a pair
+static inline uint32_t scale(uint32_t pair, int gain) {
+	int32_t lo = (int32_t)__SMUAD(pair, gain) >> 15;
+	int32_t hi = (int32_t)__SMUADX(pair, gain) >> 15;
+
+	return __PKHBT(lo, hi, 16);
+}
+
+// The gain steps per pair in 16.16 as in mixer_render. Flipping the sign
+// bits makes offset binary.
+void synth_output(uint16_t *out, const SynthBlock block, int from, int to) {
+	uint32_t *pair = (uint32_t *)out;
+	int32_t gain = from << 16, step = ((to << 16) - gain) / (SYNTH_BLOCK / 2);
+	int i;
+
+	for (i = 0; i < SYNTH_BLOCK / 2; i++) {
+		gain += step;
+		pair[i] = scale(block[i], gain >> 16) ^ 0x80008000;
+	}
+}
+
+static int rate(int ms) {
+	int samples = ms * (SYNTH_RATE / 1000);
+
+	return samples > SYNTH_BLOCK ? 32767 * SYNTH_BLOCK / samples : 32767;
+}
+
+void mixer_adsr(Mixer *m, int attack, int decay, int sustain, int release) {
+	m->adsr.attack = rate(attack);
+	m->adsr.decay = rate(decay);
+	m->adsr.sustain = sustain;
+	m->adsr.release = rate(release);
+}
+
+// Held stages rank alike when choosing a voice
+static inline int rank(const Voice *v) {
+	return v->stage < ENV_ATTACK ? v->stage : ENV_ATTACK;
+}
+
+// A voice that is sounding keeps its phase and envelope, so that a new
+// note on it continues the output without a step
+int mixer_note_on(Mixer *m, int id, int period, int level, enum Waveform wave) {
+	Voice *v = NULL;
+	int n;
+
+	for (n = 0; n < SYNTH_VOICES && !v; n++)
+		if (m->voice[n].stage != ENV_IDLE && m->voice[n].id == id)
+			v = &m->voice[n];
+	if (!v) {
+		v = &m->voice[0];
+		for (n = 1; n < SYNTH_VOICES; n++) {
+			Voice *c = &m->voice[n];
+			if (rank(c) < rank(v) || (rank(c) == rank(v) && m->notes - c->start > m->notes - v->start))
+				v = c;
+		}
+		if (rank(v) == ENV_ATTACK)
+			m->steals++;
+	}
+	if (v->stage == ENV_IDLE)
+		v->osc.phase = 0;
+	v->osc.step = synth_step(period);
+	v->osc.wave = wave;
+	v->level = level;
+	v->stage = ENV_ATTACK;
+	v->id = id;
+	v->start = m->notes++;
+	return v - m->voice;
+}
+
+int mixer_note_off(Mixer *m, int id) {
+	int n, held = 0;
+
+	for (n = 0; n < SYNTH_VOICES; n++) {
+		Voice *v = &m->voice[n];
+		if (v->stage > ENV_RELEASE && (id == MIXER_ALL || v->id == id))
+			v->stage = ENV_RELEASE;
+		held += v->stage > ENV_RELEASE;
+	}
+	return held;
+}
+
+// Advance the envelope of v by one block
+static void envelope(Voice *v, const Adsr *a) {
+	switch (v->stage) {
+	  case ENV_ATTACK:
+		v->env += a->attack;
+		if (v->env >= 32767) {
+			v->env = 32767;
+			v->stage = ENV_DECAY;
+		}
+		break;
+	  case ENV_DECAY:
+		v->env -= a->decay;
+		if (v->env <= a->sustain) {
+			v->env = a->sustain;
+			v->stage = ENV_SUSTAIN;
+		}
+		break;
+	  case ENV_RELEASE:
+		v->env -= a->release;
+		if (v->env <= 0) {
+			v->env = 0;
+			v->stage = ENV_IDLE;
+		}
+		break;
+	  default:
+		break;
+	}
+}
+
+// The gain of each pair steps from the envelope at the end of the last
+// block to the one at the end of this, in 16.16 fixed point
+int mixer_render(Mixer *m, SynthBlock mix) {
+	SynthBlock v;
+	int n, i, playing = 0;
+
+	for (i = 0; i < SYNTH_BLOCK / 2; i++)
+		mix[i] = 0;
+	for (n = 0; n < SYNTH_VOICES; n++) {
+		Voice *voice = &m->voice[n];
+		int32_t gain, step;
+		if (voice->stage == ENV_IDLE)
+			continue;
+		gain = voice->level * voice->env >> 15 << 16;
+		envelope(voice, &m->adsr);
+		step = ((voice->level * voice->env >> 15 << 16) - gain) / (SYNTH_BLOCK / 2);
+		synth_render(&voice->osc, v);
+		for (i = 0; i < SYNTH_BLOCK / 2; i++) {
+			gain += step;
+			mix[i] = __QADD16(mix[i], scale(v[i], gain >> 16));
+		}
+		playing++;
+	}
+	return playing;
+}
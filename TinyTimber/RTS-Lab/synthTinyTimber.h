@@ -0,0 +1,97 @@
+#ifndef SYNTH_TINYT_H
+#define SYNTH_TINYT_H
+
+#include "stm32f4xx.h"
+
+//
+// Wavetable oscillators in fixed point, for DAC_STREAM blocks. Samples are
+// Q15, two to a 32 bit word (the first in the low half), so that the
+// Cortex-M4 SIMD instructions handle a pair at a time. A phase accumulator
+// of 32 bits takes the oscillator through one period of the wavetable per
+// 2^32; the top 8 bits index the table and the next 15 interpolate.
+//
+#define SYNTH_RATE      32000   // samples per second
+#define SYNTH_BLOCK     64      // samples per block, 2 ms
+#define SYNTH_INTERVAL  (DAC_CLOCK / SYNTH_RATE)    // DacStream interval
+
+enum Waveform { WAVE_SINE, WAVE_TRIANGLE, WAVE_SAW, WAVE_SQUARE, N_WAVEFORMS };
+
+typedef uint32_t SynthBlock[SYNTH_BLOCK / 2];
+
+typedef struct {
+	uint32_t phase;         // of the next sample
+	uint32_t step;          // phase advance per sample
+	enum Waveform wave;
+} Osc;
+
+#define initOsc()   { 0, 0, WAVE_SINE }
+
+//
+// Mixer of SYNTH_VOICES oscillators, each at its own level, summed with
+// saturation. A note on takes the voice already playing its id, else a
+// free voice, else the releasing voice whose note started first, else the
+// held one (stolen).
+//
+// Each voice has an attack, decay, sustain, release envelope. It advances
+// once per block and the gain ramps linearly between block ends, so that
+// a note starts and ends without a step in the output. A note off only
+// starts the release; the voice is free when that reaches 0.
+//
+#define SYNTH_VOICES    4
+#define SYNTH_LEVEL     (32767 / SYNTH_VOICES)  // voice level whose sum never saturates
+#define MIXER_ALL       -1                      // mixer_note_off: every voice
+
+// Envelope stages, free and releasing voices first
+enum EnvStage { ENV_IDLE, ENV_RELEASE, ENV_ATTACK, ENV_DECAY, ENV_SUSTAIN };
+
+typedef struct {
+	int attack;             // Q15 change per block
+	int decay;
+	int sustain;            // Q15 level
+	int release;
+} Adsr;
+
+typedef struct {
+	Osc osc;
+	int level;              // Q15 of the note
+	int env;                // Q15 envelope at the end of the last block
+	enum EnvStage stage;
+	int id;                 // of the note playing
+	unsigned int start;     // note count at note on
+} Voice;
+
+typedef struct {
+	Voice voice[SYNTH_VOICES];
+	Adsr adsr;              // of every voice, set by mixer_adsr before any note
+	unsigned int notes;     // notes started
+	unsigned int steals;    // notes cut short by a new one
+} Mixer;
+
+// Build the wavetables, once before any synth_render
+void synth_init(void);
+
+// Phase step of an oscillator with the given period in microseconds
+uint32_t synth_step(int period);
+
+// Render the next block of osc at full scale
+void synth_render(Osc *osc, SynthBlock block);
+
+// Set the envelope: attack, decay and release in ms for a full scale
+// change (0 for a single block), sustain Q15
+void mixer_adsr(Mixer *m, int attack, int decay, int sustain, int release);
+
+// Start note id with the given period in microseconds, return its voice
+int mixer_note_on(Mixer *m, int id, int period, int level, enum Waveform wave);
+
+// Release note id, or all with MIXER_ALL, return the voices still held
+int mixer_note_off(Mixer *m, int id);
+
+// Render the next block of the sum of the playing voices, return their number
+int mixer_render(Mixer *m, SynthBlock mix);
+
+// Scale block by a gain (Q15, 0-32767) ramping from from to to across the
+// block into DAC samples: 12 bit left aligned, offset binary. out is a
+// block of a DacStream buffer.
+void synth_output(uint16_t *out, const SynthBlock block, int from, int to);
+
+#endif
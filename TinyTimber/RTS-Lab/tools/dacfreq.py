@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+#
+# Measure what DAC channel 2 plays in a simulator run: split the "dac2"
+# lines of a TTSIM_LOG (see host/stm32sim.c) into notes and print the
+# frequency, level and duty cycle of each. A note ends where the output
+# stays constant for longer than the gap. With -s tim2ch1 the TIM2 PWM
+# output is measured instead, its high level counting as full scale.
+#
+# Usage: dacfreq.py [-g ms] [-s dac2|tim2ch1] [-w out.wav] log
+#
+# With -w the output is also rendered to a 16 bit mono WAV file to listen to.
+
+import argparse
+import struct
+import sys
+import wave
+
+
+SCALE = {"dac2": 1, "tim2ch1": 4095}
+
+
+def parse(lines, channel="dac2"):
+    for line in lines:
+        parts = line.split()
+        if len(parts) == 3 and parts[1] == channel:
+            try:
+                yield float(parts[0]), int(parts[2]) * SCALE[channel]
+            except ValueError:
+                continue
+
+
+def notes(changes, gap_us):
+    """Yield lists of (time, value) changes, one per note."""
+    note = []
+    for t, v in changes:
+        if note and t - note[-1][0] > gap_us:
+            yield note
+            note = []
+        note.append((t, v))
+    if note:
+        yield note
+
+
+def measure(note):
+    """Return start, duration, frequency, peak and duty % of a note, or None."""
+    lo = min(v for _, v in note)
+    hi = max(v for _, v in note)
+    if hi == lo:
+        return None
+    mid = (lo + hi) / 2.0
+    rises = [t for (_, a), (t, b) in zip(note, note[1:]) if a < mid <= b]
+    if len(rises) < 2:
+        return None
+    freq = (len(rises) - 1) * 1e6 / (rises[-1] - rises[0])
+    high = sum(min(tb, rises[-1]) - max(ta, rises[0])
+               for (ta, a), (tb, _) in zip(note, note[1:])
+               if a >= mid and tb > rises[0] and ta < rises[-1])
+    return note[0][0], note[-1][0] - note[0][0], freq, hi, 100.0 * high / (rises[-1] - rises[0])
+
+
+def render(changes, path, rate=48000):
+    out = wave.open(path, "wb")
+    out.setnchannels(1)
+    out.setsampwidth(2)
+    out.setframerate(rate)
+    frames = bytearray()
+    t = 0.0
+    value = 0
+    for when, v in changes:
+        while t < when:
+            frames += struct.pack("<h", (value - 2048) * 16)
+            t += 1e6 / rate
+        value = v
+    out.writeframes(bytes(frames))
+    out.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Frequencies played by DAC channel 2 or TIM2 in a simulator log")
+    parser.add_argument("-g", "--gap", type=float, default=20.0,
+                        help="ms without change that ends a note (default 20)")
+    parser.add_argument("-s", "--source", choices=sorted(SCALE), default="dac2",
+                        help="output to measure (default dac2)")
+    parser.add_argument("-w", "--wav", help="also write the output as a WAV file")
+    parser.add_argument("log", help="TTSIM_LOG of the run")
+    opts = parser.parse_args()
+
+    with open(opts.log) as f:
+        changes = list(parse(f, opts.source))
+    if not changes:
+        sys.exit("dacfreq.py: no %s output in %s" % (opts.source, opts.log))
+    print("%10s %9s %10s %10s %6s %6s" % ("start ms", "ms", "Hz", "period us", "peak", "high %"))
+    for note in notes(changes, opts.gap * 1000):
+        m = measure(note)
+        if m:
+            start, length, freq, peak, duty = m
+            print("%10.1f %9.1f %10.2f %10.1f %6d %6.1f" % (start / 1000, length / 1000, freq, 1e6 / freq, peak, duty))
+    if opts.wav:
+        render(changes, opts.wav)
+
+
+if __name__ == "__main__":
+    main()
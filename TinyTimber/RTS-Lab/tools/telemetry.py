@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+#
+# Split the SCI byte stream of the application into its text console and
+# the binary telemetry frames sent with SCI_FRAME, and decode the frames.
+# A frame is 0x00, the COBS encoding of the record and its CRC-8
+# (polynomial 0x07), 0x00; text never contains 0x00.
+#
+# Usage: telemetry.py [-j] [log] > decoded.txt
+#
+# log is a raw capture of the serial line (default stdin), for example
+#   stty -F /dev/ttyUSB0 115200 raw && cat /dev/ttyUSB0 | telemetry.py
+#   ./tinytimber | telemetry.py
+# Text is passed through; each record becomes one line starting with '#',
+# or with -j one JSON object per line. Frames that fail the CRC are counted
+# and passed through as text, which also resynchronizes a reader that
+# started in the middle of a frame.
+
+import argparse
+import json
+import struct
+import sys
+
+# Record types and layouts in application.c (little endian, after the
+# type byte and the 32 bit microsecond time stamp)
+RECORDS = {
+    1: ("tone", "<HBB", ("period", "volume", "flags")),
+    2: ("key", "<b", ("key",)),
+    3: ("tempo", "<H", ("bpm",)),
+    4: ("load", "<HB", ("loop", "deadline")),
+    5: ("miss", "<IIIIi", ("obj", "method", "late_starts", "late_ends", "worst_us")),
+    6: ("queue", "<HHHHBHI", ("ready", "timers", "running", "free", "threads",
+                              "sci_queued", "sci_drops")),
+}
+
+HEX_FIELDS = ("obj", "method")
+
+
+def crc8(data):
+    crc = 0
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def unCOBS(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            return None
+        out += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def decode(frame):
+    """Return the record of one frame as a dict, or None if it is not valid."""
+    data = unCOBS(frame)
+    if not data or len(data) < 6 or crc8(data[:-1]) != data[-1]:
+        return None
+    data = data[:-1]
+    kind, time = struct.unpack_from("<BI", data)
+    rec = {"type": kind, "t_us": time}
+    if kind in RECORDS:
+        name, fmt, fields = RECORDS[kind]
+        if struct.calcsize(fmt) != len(data) - 5:
+            return None
+        rec["type"] = name
+        rec.update(zip(fields, struct.unpack_from(fmt, data, 5)))
+    else:
+        rec["payload"] = data[5:].hex()
+    return rec
+
+
+def split(stream):
+    """Yield ("text", bytes) and ("frame", bytes) items from a byte stream."""
+    text = bytearray()
+    frame = None                        # bytes since an opening 0x00
+    bad = 0
+    for chunk in stream:
+        for b in chunk:
+            if b != 0:
+                (text if frame is None else frame).append(b)
+            elif frame is None:         # opening delimiter
+                if text:
+                    yield "text", bytes(text)
+                    text.clear()
+                frame = bytearray()
+            elif not frame:             # 0x00 0x00: the second one opens
+                pass
+            else:
+                rec = decode(frame)
+                if rec is None:         # this 0x00 opens, what came before was text
+                    bad += 1
+                    yield "text", bytes(frame)
+                    frame = bytearray()
+                else:
+                    yield "frame", rec
+                    frame = None
+    if frame:
+        text += frame
+    if text:
+        yield "text", bytes(text)
+    if bad:
+        sys.stderr.write("telemetry.py: %d bad frames\n" % bad)
+
+
+def show(rec):
+    parts = []
+    for k, v in rec.items():
+        if k in ("type", "t_us"):
+            continue
+        parts.append("%s=%s" % (k, "0x%08x" % v if k in HEX_FIELDS else v))
+    return "# %10d us %-5s %s\n" % (rec["t_us"], rec["type"], " ".join(parts))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode telemetry frames in an SCI capture")
+    parser.add_argument("-j", "--json", action="store_true", help="records as JSON lines")
+    parser.add_argument("log", nargs="?", help="raw serial capture (default stdin)")
+    opts = parser.parse_args()
+
+    src = open(opts.log, "rb") if opts.log else sys.stdin.buffer
+    out = sys.stdout.buffer
+    reader = iter(lambda: src.read1(4096) if hasattr(src, "read1") else src.read(4096), b"")
+    for kind, item in split(reader):
+        if kind == "text":
+            out.write(item)
+        elif opts.json:
+            out.write((json.dumps(item) + "\n").encode())
+        else:
+            out.write(show(item).encode())
+        out.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+#
+# Convert a TinyTimber scheduler trace, as printed over SCI by the
+# application's drain_trace() (lines of the form "@TTTTTTTTYYHHMMMMAAAAAAAA"),
+# into Chrome trace JSON for chrome://tracing or ui.perfetto.dev.
+#
+# Usage: trace2json.py [-m nm.txt] [-f MHz] < console.log > trace.json
+#
+# nm.txt is the output of "arm-none-eabi-nm RTS-Lab.elf" and is used to
+# name methods; without it methods are shown by address. Non-trace lines
+# in the console log are ignored.
+
+import argparse
+import json
+import sys
+
+# enum TraceType in TinyTimber.h
+NONE, POST, RUN, RELEASE, ABORT, PREEMPT, DISPATCH, IRQ_ENTER, IRQ_EXIT = range(9)
+
+# enum Vector in TinyTimber.h, N_VECTORS stands for the TIM5 compare interrupt
+VECTORS = ["USART1", "CAN1", "EXTI9_5", "DMA2_Stream5", "DMA2_Stream7",
+           "CAN1_TX", "CAN2_TX", "CAN1_RX1", "DMA1_Stream6", "TIM5"]
+
+MSG_STATES = ["free", "timer", "ready", "running"]
+
+
+def load_symbols(path):
+    symbols = {}
+    with open(path) as f:
+        for line in f:
+            parts = line.split()
+            if len(parts) == 3 and parts[1] in "tTwW":
+                symbols[int(parts[0], 16) & ~1] = parts[2]
+    return symbols
+
+
+def parse(lines):
+    for line in lines:
+        line = line.strip()
+        if len(line) != 25 or line[0] != "@":
+            continue
+        try:
+            time = int(line[1:9], 16)
+            kind = int(line[9:11], 16)
+            thread = int(line[11:13], 16)
+            msg = int(line[13:17], 16)
+            arg = int(line[17:25], 16)
+        except ValueError:
+            continue
+        if thread >= 0x80:
+            thread -= 0x100
+        yield time, kind, thread, msg, arg
+
+
+def convert(events, symbols, mhz):
+    def method(addr):
+        return symbols.get(addr & ~1, "0x%08x" % addr)
+
+    def tid(thread):
+        return "idle" if thread < 0 else "thread %d" % thread
+
+    out = []
+    base = None
+    last = 0
+    wraps = 0
+    for time, kind, thread, msg, arg in events:
+        if base is None:
+            base = time
+        if time < last:                 # 32 bit cycle counter wrapped
+            wraps += 1
+        last = time
+        ts = ((wraps << 32) + time - base) / mhz
+        ev = {"ts": ts, "pid": 1, "tid": tid(thread)}
+        if kind == RUN:
+            ev.update(ph="B", name=method(arg), args={"msg": msg})
+        elif kind == RELEASE:
+            ev.update(ph="E", name=method(arg))
+        elif kind in (IRQ_ENTER, IRQ_EXIT):
+            ev.update(ph="B" if kind == IRQ_ENTER else "E", tid="irq",
+                      name=VECTORS[arg] if arg < len(VECTORS) else "IRQ %d" % arg)
+        elif kind == POST:
+            ev.update(ph="i", s="t", name="post " + method(arg), args={"msg": msg})
+        elif kind == PREEMPT:
+            ev.update(ph="i", s="t", name="preempt for " + method(arg), args={"msg": msg})
+        elif kind == DISPATCH:
+            ev.update(ph="i", s="t", name="dispatch to " + tid(arg), args={"msg": msg})
+        elif kind == ABORT:
+            state = MSG_STATES[arg] if arg < len(MSG_STATES) else str(arg)
+            ev.update(ph="i", s="t", name="abort", args={"msg": msg, "state": state})
+        else:
+            continue
+        out.append(ev)
+    return {"traceEvents": out, "displayTimeUnit": "ns"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a TinyTimber trace to Chrome trace JSON")
+    parser.add_argument("-m", "--map", help="nm output used to name methods")
+    parser.add_argument("-f", "--mhz", type=float, default=168.0,
+                        help="CPU clock in MHz (default 168)")
+    parser.add_argument("log", nargs="?", help="console log (default stdin)")
+    opts = parser.parse_args()
+
+    symbols = load_symbols(opts.map) if opts.map else {}
+    src = open(opts.log, errors="replace") if opts.log else sys.stdin
+    json.dump(convert(parse(src), symbols, opts.mhz), sys.stdout, indent=1)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
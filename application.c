@@ -40,11 +40,43 @@
  *      当CAN重新连接（接收到"reconnect"消息）时，缓存内容将一次性打印出来。
  *
  * 10. 无论运行在哪种模式下，CAN接收函数都会打印出所有接收到的消息。
+ *     硬件滤波器只接收消息号0（stop/mute，经FIFO1单独处理）、1（其他命令）以及2、3（分段传输），
+ *     其余报文在硬件中丢弃。
+ *     命令默认以二进制帧发送（操作码+序号+参数），接收方按命令表直接派发并按节点检查序号；
+ *     按 'x' 切换为文本命令（如 "K3"、"volup"）便于调试，收到的文本命令会打印出来。
+ *     不短于8字节的文本命令（如 "toggle_deadline"）经分段传输发送，接收方按发送节点号重组后再处理，
+ *     因此总线上各板的 NODE_ID 须不同。
+ *
+ * 11. 性能统计:
+ *    - 按 'w'：打印内核记录的各方法执行时间（CPU周期）与响应时间（微秒）的最小/平均/最大值，
+ *      各对象/方法错失截止时间的次数，以及CAN发送队列统计，用于配合 't' 调整负载。
+ *    - 按 'r'：开始/停止输出内核调度跟踪事件（以 '@' 开头的行），
+ *      用 tools/trace2json.py 转换后可在 chrome://tracing 或 Perfetto 中查看。
+ *
+ * 12. 二进制遥测:
+ *    - 按 'b'：开始/停止在SCI文本之间插入二进制遥测帧（音调周期、调号、节奏、负载、
+ *      截止时间错失、队列深度），用 tools/telemetry.py 从串口数据中分离并解码。
+ *
+ * 13. 音调输出（编译时由 TONE_OUTPUT 选择）:
+ *    - TONE_SYNTH（默认）：波表振荡器每2ms生成一块32kHz采样，经DMA双缓冲由DAC输出，
+ *      按 'y' 依次切换正弦、三角、锯齿、方波；音量与静音的改变在一块（2ms）内渐变。
+ *      最多 SYNTH_VOICES 个声部混合输出，按 'n' 设置本板演奏的轮唱声部数（1~4），
+ *      各声部依次间隔两小节进入；声部不足时停止最早开始的音符。
+ *      每个声部有ADSR包络（每块计算一次），音符以起音开始、以释音结束，边界无爆音。
+ *    - TONE_DAC_DMA：方波由TIM6、DMA1与DAC硬件输出，每个边沿不经过调度器。
+ *    - TONE_PWM：方波由TIM2通道1的PWM输出到PA5（取代DAC通道2），每个边沿不占用CPU，
+ *      音量以占空比近似（音量1~20对应2.5%~50%）。
+ *    - TONE_GENERATE：每半个周期执行一次的generate_tone。
+ *      在仿真器中用 tools/dacfreq.py 检查 TTSIM_LOG 中DAC输出的频率，
+ *      TONE_PWM 用 tools/dacfreq.py -s tim2ch1；按 'w' 比较各方式的CPU负载。
  */
 
 #include "TinyTimber.h"
 #include "sciTinyTimber.h"
 #include "canTinyTimber.h"
+#include "dacTinyTimber.h"
+#include "synthTinyTimber.h"
+#include "pwmTinyTimber.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -58,14 +90,52 @@
 #define max_index 14
 #define period_size (max_index - min_index + 1)
 #define DAC_Address (*(volatile uint8_t*) 0x4000741C)
+// 音调输出方式：
+//   TONE_GENERATE：周期性generate_tone每半个周期翻转一次DAC_Address
+//   TONE_DAC_DMA：TIM6触发DAC通道2、DMA1循环输出一个周期的方波，
+//                 start_note/stop_note只改写定时器重装值与波形缓冲区
+//   TONE_SYNTH：波表振荡器按块生成采样，DMA双缓冲输出，每块执行一次fill_block
+//   TONE_PWM：TIM2通道1以PWM模式1直接驱动引脚，占空比随音量变化
+#define TONE_GENERATE 0
+#define TONE_DAC_DMA  1
+#define TONE_SYNTH    2
+#define TONE_PWM      3
+#define TONE_OUTPUT   TONE_SYNTH
+#define WAVE_SAMPLES 32   // TONE_DAC_DMA：每个周期的采样数
+#define VOLUME_GAIN  (64 * SYNTH_VOICES)  // TONE_SYNTH：每级音量的Q15增益，单声部方波幅度与8位DAC方波相同
 #define GAP_DURATION 50
+// TONE_SYNTH的包络：起音、衰减、释音为满幅变化所需的ms，持续电平为满幅的比例（Q15）；
+// 释音短于GAP_DURATION，音符之间仍有间隔
+#define ADSR_ATTACK_MS   5
+#define ADSR_DECAY_MS    80
+#define ADSR_SUSTAIN     (32767 * 7 / 10)
+#define ADSR_RELEASE_MS  30
 #define MELODY_LENGTH 32
+// 轮唱：各声部依次间隔CANON_BEATS拍进入，只有TONE_SYNTH能同时发出多个音
+#if TONE_OUTPUT == TONE_SYNTH
+#define CANON_PARTS SYNTH_VOICES
+#else
+#define CANON_PARTS 1
+#endif
+#define CANON_BEATS 8
+#define ALL_PARTS   -1    // stop_note：停止所有声部
+// start_note的参数：声部与半周期（us）
+#define NOTE_ARG(part, period) ((period) << 3 | (part))
+#define NOTE_PART(arg)   ((arg) & 7)
+#define NOTE_PERIOD(arg) ((arg) >> 3)
 // 默认节奏为120 bpm，即每拍500ms（BPM用于计算拍长）
 #define DEFAULT_TEMPO 120
 
 #define CONDUCTOR_MODE 0
 #define MUSICIAN_MODE  1
 
+// CAN消息号：硬件滤波器只接收以下几类，stop/mute 走FIFO1并在总线仲裁中优先
+#define CAN_ID_URGENT  0
+#define CAN_ID_COMMAND 1
+#define CAN_ID_SEGMENT 2   // 分段传输的数据帧，流控帧为3
+// 本板节点号(0-15)，分段传输按节点号重组，总线上各板须不同
+#define NODE_ID 1
+
 //------------------- 键盘输入缓存相关 -------------------//
 #define CACHE_SIZE 100
 char inputCache[CACHE_SIZE];
@@ -98,43 +168,92 @@ typedef struct {
     int state;
     int period;
     int playing;
+    Msg toneMsg;     // 周期性generate_tone消息
+#if TONE_OUTPUT == TONE_DAC_DMA
+    uint8_t wave[WAVE_SAMPLES];  // DMA循环读取的一个周期
+#elif TONE_OUTPUT == TONE_SYNTH
+    Mixer mixer;                 // 每个声部一个音
+    enum Waveform wave;          // 新音符的波形
+    SynthBlock block;            // 混合后的一块采样
+    int gain;                    // 上一块结束时的输出增益
+    uint16_t samples[2 * SYNTH_BLOCK] __attribute__((aligned(4)));  // DMA双缓冲
+#endif
 } ToneGenerator;
 
 typedef struct {
     Object super;
     int background_loop_range;
     int deadline;
+    Msg loadMsg;     // 周期性load_task消息，0表示未启动
 } BackgroundTask;
 
 typedef struct {
     Object super;
-    int current_note;
+    int current_note[CANON_PARTS];  // 各声部的下一个音符
     int tempo;       // 存储BPM，与App.tempo保持一致
     int key;
     int melody[32];
     // note_pattern定义音符时值：a=1拍，b=2拍，c=0.5拍，循环使用
     float note_pattern[32];
+    int parts;       // 演奏的声部数
+    int started;     // 已进入的声部数
+    int entry[CANON_PARTS];         // 各声部在第一声部的哪个音符处进入，-1表示不进入
+    Msg nextMsg[CANON_PARTS];       // 待执行的next_note消息，停止播放时撤销
+    Msg stopMsg[CANON_PARTS];       // 待执行的stop_note消息，停止播放时撤销
 } MusicPlayer;
 
+typedef struct {
+    Object super;
+    Msg drainMsg;    // 周期性drain_trace消息，0表示未启动
+} TraceDumper;
+
+typedef struct {
+    Object super;
+    int on;          // 1：发送遥测帧
+    Timer clock;     // 记录时间戳的起点
+    Msg sampleMsg;   // 周期性sample_telemetry消息
+} Telemetry;
+
 // 全局变量定义
 App app = { initObject(), {0,0,0}, 0, "", 0, {0}, {0}, 0, DEFAULT_TEMPO, 0, CONDUCTOR_MODE };
 ToneGenerator toneGen = { initObject(), 15, 0, 0, 0, 0 };
 BackgroundTask bgTask = { initObject(), 1000, 1 };
-MusicPlayer musicPlayer = { initObject(), 0, DEFAULT_TEMPO, 0,
+MusicPlayer musicPlayer = { initObject(), {0}, DEFAULT_TEMPO, 0,
     // Brother John旋律音调（原有定义）
     {0,2,4,0,0,2,4,0,4,5,7,4,5,7,7,9,7,5,4,0,7,9,7,5,4,0,0,-5,0,0,-5,0},
     // 对应的时值模式：a=1拍, b=2拍, c=0.5拍
-    {1,1,1,1,1,1,1,1,1,1,2,1,1,2,0.5,0.5,0.5,0.5,1,1,0.5,0.5,0.5,0.5,1,1,1,1,2,1,1,2}
+    {1,1,1,1,1,1,1,1,1,1,2,1,1,2,0.5,0.5,0.5,0.5,1,1,0.5,0.5,0.5,0.5,1,1,1,1,2,1,1,2},
+    1
 };
+TraceDumper tracer = { initObject(), 0 };
+Telemetry telemetry = { initObject(), 0, initTimer(), 0 };
 
 // 函数前置声明
 void reader(App *self, int c);
 void receiver(App *self, int unused);
-void next_note(MusicPlayer *self, int unused);
+void urgent_receiver(App *self, int unused);
+void segment_receiver(App *self, int nodeId);
+void next_note(MusicPlayer *self, int part);
 
 // 定义SCI和CAN全局对象（必须在所有使用它们之前）
 Serial sci0 = initSerial(SCI_PORT0, &app, reader);
-Can can0 = initCan(CAN_PORT0, &app, receiver);
+Can can0 = initCanFifo1(CAN_PORT0, &app, receiver, &app, urgent_receiver);
+CanTp canTp = initCanTp(&can0, CAN_ID_SEGMENT, NODE_ID, &app, segment_receiver);
+Dac dac0 = initDac();
+Pwm pwm0 = initPwm();
+
+// 接收到的二进制命令统计，按发送节点检查序号
+typedef struct {
+    unsigned int received;
+    unsigned int duplicates;    // 与上一条序号相同，已忽略
+    unsigned int lost;          // 序号跳过的命令数，迟到的命令会被扣回
+    uint16_t seen;              // bit n：已收到节点n的命令
+    uint8_t seq[16];            // 各节点上一条命令的序号
+} CommandStats;
+
+int textCommands = 0;           // 1：以文本发送CAN命令
+uint8_t commandSeq = 0;         // 下一条二进制命令的序号
+CommandStats commandStats;
 
 
 int isCANConnected(void) {
@@ -164,6 +283,178 @@ uint32_t get_time(void) {
     return DWT->CYCCNT;
 }
 
+// Time值转换为微秒，只用于较短的时长：long在目标上为32位，约2147秒后溢出
+long time_to_usec(Time t) {
+    return (long)SEC_OF(t) * 1000000L + USEC_OF(t);
+}
+
+// 打印内核记录的各方法执行时间（CPU周期）与响应时间（微秒）
+void print_profile(void) {
+    Profile p;
+    for (int i = 0; PROFILE_READ(i, &p); i++) {
+        if (!p.method)
+            continue;
+        SCI_PRINTF(&sci0, "%08lx n=%u exec %lu/%lu/%lu cyc resp %ld/%ld/%ld us\n",
+                   (unsigned long)p.method, p.count,
+                   (unsigned long)p.execMin, (unsigned long)(p.execSum / p.count), (unsigned long)p.execMax,
+                   time_to_usec(p.respMin), time_to_usec(p.respSum / p.count), time_to_usec(p.respMax));
+    }
+}
+
+// 打印内核记录的截止时间错失次数（迟开始/迟完成）与最大延迟（微秒）
+void print_deadline_misses(void) {
+    DeadlineMiss d;
+    for (int i = 0; DEADLINE_READ(i, &d); i++) {
+        if (!d.obj)
+            continue;
+        SCI_PRINTF(&sci0, "%08lx.%08lx late start %u, late end %u, worst %ld us\n",
+                   (unsigned long)d.obj, (unsigned long)d.method,
+                   d.lateStarts, d.lateEnds, time_to_usec(d.worst));
+    }
+}
+
+// 打印CAN发送队列统计
+void print_can_stats(void) {
+    CanStats c;
+    CanTpStats t;
+    CAN_STATS(&can0, &c);
+    CAN_TP_STATS(&canTp, &t);
+    SCI_PRINTF(&sci0, "CAN tx: sent %u, dropped %u, queued %d, max queued %d\n",
+               c.sent, c.drops, c.count, c.highWater);
+    SCI_PRINTF(&sci0, "CAN rx: FIFO0 %u, FIFO1 %u, dropped %u\n",
+               c.received[0], c.received[1], c.rxDrops);
+    SCI_PRINTF(&sci0, "CAN segmented: sent %u, aborted %u, received %u, errors %u\n",
+               t.sent, t.aborts, t.received, t.errors);
+    SCI_PRINTF(&sci0, "CAN commands: received %u, duplicates %u, lost %u\n",
+               commandStats.received, commandStats.duplicates, commandStats.lost);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// 二进制遥测
+// 每条记录：类型(1) + 时间(4，微秒，按32位回绕，约71.6分钟一周) + 字段，多字节字段为小端序，
+// 由SCI_FRAME以COBS帧夹在文本之间发送，tools/telemetry.py 中的定义须与此一致。
+// 记录只在各自的方法中按事件发送，不在500us的generate_tone中发送。
+#define TELEMETRY_PERIOD 20   // 队列深度采样周期，单位ms（每帧24字节，约占波特率的10%）
+
+enum {
+    TM_TONE = 1,    // 周期(2, us)、音量(1)、标志(1：bit0播放中，bit1静音)
+    TM_KEY,         // 调号(1, 有符号)
+    TM_TEMPO,       // 节奏(2, bpm)
+    TM_LOAD,        // 后台循环次数(2)、deadline开关(1)
+    TM_MISS,        // 对象(4)、方法(4)、迟开始(4)、迟完成(4)、最大延迟(4, us)
+    TM_QUEUE        // 就绪/定时/运行/空闲消息数(各2，NMSGS可达256)、空闲线程数(1)、SCI待发字节(2)、SCI丢弃字节(4)
+};
+
+typedef struct {
+    uint8_t data[32];
+    int length;
+} Record;
+
+void rec_put(Record *r, uint32_t v, int size) {
+    while (size-- > 0) {
+        r->data[r->length++] = v;
+        v >>= 8;
+    }
+}
+
+// 记录的时间戳：在uint32_t中计算，溢出即按2^32微秒回绕
+uint32_t time_stamp(Time t) {
+    return (uint32_t)SEC_OF(t) * 1000000u + USEC_OF(t);
+}
+
+void rec_begin(Record *r, int type) {
+    r->length = 0;
+    rec_put(r, type, 1);
+    rec_put(r, time_stamp(T_SAMPLE(&telemetry.clock)), 4);
+}
+
+void rec_send(Record *r) {
+    SciFrame f = { r->data, r->length };
+    SCI_FRAME(&sci0, &f);
+}
+
+void tm_value(int type, int value, int size) {
+    Record r;
+    if (!telemetry.on)
+        return;
+    rec_begin(&r, type);
+    rec_put(&r, value, size);
+    rec_send(&r);
+}
+
+void tm_tone(ToneGenerator *t) {
+    Record r;
+    if (!telemetry.on)
+        return;
+    rec_begin(&r, TM_TONE);
+    rec_put(&r, t->period, 2);
+    rec_put(&r, t->volume, 1);
+    rec_put(&r, t->playing | t->muted << 1, 1);
+    rec_send(&r);
+}
+
+void tm_load(BackgroundTask *b) {
+    Record r;
+    if (!telemetry.on)
+        return;
+    rec_begin(&r, TM_LOAD);
+    rec_put(&r, b->background_loop_range, 2);
+    rec_put(&r, b->deadline, 1);
+    rec_send(&r);
+}
+
+// 周期性发送内核队列深度与SCI发送缓冲区状态
+void sample_telemetry(Telemetry *self, int unused) {
+    QueueDepths q;
+    SciStats s;
+    Record r;
+    QUEUE_READ(&q);
+    SCI_STATS(&sci0, &s);
+    rec_begin(&r, TM_QUEUE);
+    rec_put(&r, q.ready, 2);
+    rec_put(&r, q.timers, 2);
+    rec_put(&r, q.running, 2);
+    rec_put(&r, q.free, 2);
+    rec_put(&r, q.threads, 1);
+    rec_put(&r, s.count, 2);
+    rec_put(&r, s.drops, 4);
+    rec_send(&r);
+}
+
+// DEADLINE_HOOK：每次错失截止时间后发送对应条目
+void report_miss(Telemetry *self, int i) {
+    DeadlineMiss d;
+    Record r;
+    if (!self->on || !DEADLINE_READ(i, &d))
+        return;
+    rec_begin(&r, TM_MISS);
+    rec_put(&r, (uintptr_t)d.obj, 4);
+    rec_put(&r, (uintptr_t)d.method, 4);
+    rec_put(&r, d.lateStarts, 4);
+    rec_put(&r, d.lateEnds, 4);
+    rec_put(&r, time_to_usec(d.worst), 4);
+    rec_send(&r);
+}
+
+// 开始/停止遥测，开始时先发送当前状态
+void toggle_telemetry(Telemetry *self, int unused) {
+    if (self->on) {
+        self->on = 0;
+        ABORT(self->sampleMsg);
+        DEADLINE_HOOK(NULL, NULL);
+        SCI_WRITE(&sci0, "Telemetry stopped\n");
+    } else {
+        SCI_WRITE(&sci0, "Telemetry started\n");
+        self->on = 1;
+        tm_tone(&toneGen);
+        tm_value(TM_KEY, musicPlayer.key, 1);
+        tm_value(TM_TEMPO, musicPlayer.tempo, 2);
+        tm_load(&bgTask);
+        DEADLINE_HOOK(self, report_miss);
+        self->sampleMsg = PERIODIC(MSEC(TELEMETRY_PERIOD), 0, self, sample_telemetry, 0);
+    }
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // 初始化频率索引数组
 void freq_index(App *self) {
@@ -191,34 +482,118 @@ int get_period_index(App *self, int k) {
 }
 
 void get_period_key(App *self, int key) {
-    char keyBuffer[10];
-    snprintf(keyBuffer, sizeof(keyBuffer), "Key: %d\n", key);
-    SCI_WRITE(&sci0, keyBuffer);
+    SCI_PRINTF(&sci0, "Key: %d\n", key);
     for (int i = 0; i < 32; i++) {
         int k = self->freq_index[i] + key;
         int period_index = get_period_index(self, k);
-        char buffer[10];
         if (period_index != -1)
-            snprintf(buffer, sizeof(buffer), "%d ", self->period[period_index]);
+            SCI_PRINTF(&sci0, "%d ", self->period[period_index]);
         else
-            snprintf(buffer, sizeof(buffer), "N/A ");
-        SCI_WRITE(&sci0, buffer);
+            SCI_WRITE(&sci0, "N/A ");
     }
     SCI_WRITE(&sci0, "\n");
 }
 
 /////////////////////////////////////////////////////////////////////////////
 // ToneGenerator函数
-void start_note(ToneGenerator *self, int period) {
+void generate_tone(ToneGenerator *self, int unused);
+
+#if TONE_OUTPUT == TONE_DAC_DMA
+// 按音量重写波形缓冲区并按周期设置采样间隔；静音或未播放时停止输出
+void update_wave(ToneGenerator *self) {
+    DacWave w = { self->wave, WAVE_SAMPLES, self->period * 2 * (DAC_CLOCK / 1000000) / WAVE_SAMPLES };
+    if (!self->playing || self->muted) {
+        DAC_STOP(&dac0);
+        return;
+    }
+    for (int i = 0; i < WAVE_SAMPLES; i++)
+        self->wave[i] = i < WAVE_SAMPLES / 2 ? self->volume : 0;
+    DAC_WAVE(&dac0, &w);
+}
+#elif TONE_OUTPUT == TONE_PWM
+// 按周期设置PWM周期，占空比 = 音量/40；静音或未播放时停止输出（引脚保持低电平）
+void update_wave(ToneGenerator *self) {
+    PwmTone t = { self->period * 2 * (PWM_CLOCK / 1000000), 0 };
+    if (!self->playing || self->muted) {
+        PWM_STOP(&pwm0);
+        return;
+    }
+    t.duty = t.period * self->volume / 40;
+    PWM_TONE(&pwm0, &t);
+}
+#elif TONE_OUTPUT == TONE_SYNTH
+// 由DAC驱动在一块播放完毕后调用，混合所有声部重新生成该块；
+// 静音时照常生成（包络与相位继续），只是输出增益为0；
+// 增益在一块内从上一块的值渐变到当前音量，静音与音量改变都不产生爆音
+void fill_block(ToneGenerator *self, int samples) {
+    int gain = self->muted ? 0 : self->volume * VOLUME_GAIN;
+    mixer_render(&self->mixer, self->block);
+    synth_output((uint16_t *)samples, self->block, self->gain, gain);
+    self->gain = gain;
+}
+
+// 先以静音（中间电平）填满两块，再开始DMA双缓冲输出
+void start_synth(ToneGenerator *self, int unused) {
+    DacStream s = { self->samples, SYNTH_BLOCK, SYNTH_INTERVAL, (Object *)self, (Method)fill_block };
+    synth_init();
+    mixer_adsr(&self->mixer, ADSR_ATTACK_MS, ADSR_DECAY_MS, ADSR_SUSTAIN, ADSR_RELEASE_MS);
+    fill_block(self, (int)self->samples);
+    fill_block(self, (int)(self->samples + SYNTH_BLOCK));
+    DAC_STREAM(&dac0, &s);
+}
+
+// 按 'y' 切换波形
+void next_waveform(ToneGenerator *self, int unused) {
+    static const char *names[N_WAVEFORMS] = { "sine", "triangle", "saw", "square" };
+    self->wave = (self->wave + 1) % N_WAVEFORMS;
+    SCI_PRINTF(&sci0, "Waveform: %s\n", names[self->wave]);
+}
+#endif
+
+// 音量或静音改变后更新输出（generate_tone与fill_block每次执行时读取，无需处理）
+void tone_changed(ToneGenerator *self) {
+#if TONE_OUTPUT == TONE_DAC_DMA || TONE_OUTPUT == TONE_PWM
+    update_wave(self);
+#endif
+}
+
+// 按当前周期与deadline设置（重新）启动周期性generate_tone，由内核原地重装同一消息
+void restart_tone(ToneGenerator *self, int unused) {
+#if TONE_OUTPUT == TONE_DAC_DMA || TONE_OUTPUT == TONE_PWM
+    update_wave(self);
+#elif TONE_OUTPUT == TONE_GENERATE
+    unsigned int delay = self->playing ? self->period : 500;
+    ABORT(self->toneMsg);
+    self->toneMsg = PERIODIC(USEC(delay), bgTask.deadline ? USEC(delay) : 0, self, generate_tone, 0);
+#endif
+}
+
+// note = NOTE_ARG(声部, 半周期)；只有TONE_SYNTH为每个声部分配一个音，其他方式只有一个音
+void start_note(ToneGenerator *self, int note) {
     if (!self->muted) {
         self->playing = 1;
-        self->period = period;
+        self->period = NOTE_PERIOD(note);
+#if TONE_OUTPUT == TONE_SYNTH
+        mixer_note_on(&self->mixer, NOTE_PART(note), self->period * 2, SYNTH_LEVEL, self->wave);
+#else
+        restart_tone(self, 0);
+#endif
+        tm_tone(self);
     }
 }
 
-void stop_note(ToneGenerator *self, int unused) {
+// 停止声部part的音，ALL_PARTS停止全部；TONE_SYNTH中声部进入释音，渐弱至0后才空闲
+void stop_note(ToneGenerator *self, int part) {
+#if TONE_OUTPUT == TONE_SYNTH
+    self->playing = mixer_note_off(&self->mixer, part == ALL_PARTS ? MIXER_ALL : part) > 0;
+#else
     self->playing = 0;
+#if TONE_OUTPUT == TONE_GENERATE
     DAC_Address = 0;
+#endif
+    restart_tone(self, 0);
+#endif
+    tm_tone(self);
 }
 
 void generate_tone(ToneGenerator *self, int unused) {
@@ -231,11 +606,6 @@ void generate_tone(ToneGenerator *self, int unused) {
             DAC_Address = 0;
         self->state = !self->state;
     }
-    unsigned int delay = self->playing ? self->period : 500;
-    if (bgTask.deadline)
-        SEND(USEC(delay), USEC(delay), self, generate_tone, 0);
-    else
-        AFTER(USEC(delay), self, generate_tone, 0);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -243,56 +613,126 @@ void generate_tone(ToneGenerator *self, int unused) {
 // 根据BPM计算拍长，再结合note_pattern计算每个音符的持续时间
 void start_playback(MusicPlayer *self, int unused) {
     // 仅在Conductor模式下，由键盘启动播放时更新播放状态
-    self->current_note = 0;
+    // 第i个声部在第一声部第i*CANON_BEATS拍开始的音符处进入
+    float beats = 0;
+    int part = 1;
+    for (int i = 1; i < CANON_PARTS; i++)
+        self->entry[i] = -1;
+    for (int i = 0; i < MELODY_LENGTH && part < CANON_PARTS; i++) {
+        if (beats == part * CANON_BEATS)
+            self->entry[part++] = i;
+        beats += self->note_pattern[i];
+    }
+    self->current_note[0] = 0;
+    self->started = 1;
     ASYNC(self, next_note, 0);
 }
 
-void next_note(MusicPlayer *self, int unused) {
+void next_note(MusicPlayer *self, int part) {
     if (!app.playback_active)
         return;
+    // 减少声部数后，多出的声部在下一个音符处停止
+    if (part >= self->parts) {
+        if (self->started > part)
+            self->started = part;
+        return;
+    }
 
-    if (self->current_note >= MELODY_LENGTH)
-        self->current_note = 0;
+    if (self->current_note[part] >= MELODY_LENGTH)
+        self->current_note[part] = 0;
+    int n = self->current_note[part];
+
+    // 第一声部到达下一个声部的进入点时启动该声部，两者基线相同，不会累积偏差
+    while (part == 0 && self->started < self->parts && self->entry[self->started] == n) {
+        ABORT(self->nextMsg[self->started]);
+        self->current_note[self->started] = 0;
+        ASYNC(self, next_note, self->started);
+        self->started++;
+    }
     
-    int noteFreqIndex = self->melody[self->current_note] + self->key;
+    int noteFreqIndex = self->melody[n] + self->key;
     int period_index = (noteFreqIndex < min_index || noteFreqIndex > max_index) ? -1 : noteFreqIndex - min_index;
     
     unsigned int beat_duration = 60000 / self->tempo; // 拍长，单位ms
-    float note_factor = self->note_pattern[self->current_note]; // 当前音符时值因子
+    float note_factor = self->note_pattern[n]; // 当前音符时值因子
     unsigned int note_duration = (unsigned int)(beat_duration * note_factor);
     
     if (period_index != -1) {
         int period = app.period[period_index];
-        ASYNC(&toneGen, start_note, period);
+        ASYNC(&toneGen, start_note, NOTE_ARG(part, period));
         if (note_duration > GAP_DURATION)
-            AFTER(MSEC(note_duration - GAP_DURATION), &toneGen, stop_note, 0);
+            self->stopMsg[part] = AFTER(MSEC(note_duration - GAP_DURATION), &toneGen, stop_note, part);
         else
-            AFTER(MSEC(note_duration), &toneGen, stop_note, 0);
+            self->stopMsg[part] = AFTER(MSEC(note_duration), &toneGen, stop_note, part);
     }
     else {
         SCI_WRITE(&sci0, "Invalid Note\n");
     }
     
-    self->current_note++;
-    AFTER(MSEC(note_duration), self, next_note, 0);
+    self->current_note[part]++;
+    self->nextMsg[part] = AFTER(MSEC(note_duration), self, next_note, part);
+}
+
+// 停止播放：直接撤销尚未执行的next_note/stop_note消息（ABORT为常数时间，过期句柄会被忽略）
+void stop_playback(MusicPlayer *self, int unused) {
+    for (int i = 0; i < CANON_PARTS; i++) {
+        ABORT(self->nextMsg[i]);
+        ABORT(self->stopMsg[i]);
+    }
+}
+
+// 按 'n' 依次设置演奏1~CANON_PARTS个声部，新增的声部在第一声部下次到达其进入点时进入
+void next_parts(MusicPlayer *self, int unused) {
+    self->parts = self->parts % CANON_PARTS + 1;
+    SCI_PRINTF(&sci0, "Canon parts: %d\n", self->parts);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// 调度跟踪输出函数
+// 每10ms从内核跟踪缓冲区取出至多3个事件（约占115200波特率的70%），
+// 每个事件一行："@" + 时间(8) + 类型(2) + 线程(2) + 消息(4) + 参数(8) 的十六进制，
+// 由 TinyTimber/RTS-Lab/tools/trace2json.py 转换为Chrome/Perfetto跟踪文件
+#define TRACE_BATCH 3
+
+void drain_trace(TraceDumper *self, int unused) {
+    TraceEvent ev[TRACE_BATCH];
+    int n = TRACE_READ(ev, TRACE_BATCH);
+    for (int i = 0; i < n; i++) {
+        SCI_PRINTF(&sci0, "@%08lx%02x%02x%04x%08lx\n",
+                   (unsigned long)ev[i].time, ev[i].type, (uint8_t)ev[i].thread,
+                   ev[i].msg, (unsigned long)ev[i].arg);
+    }
+}
+
+// 开始/停止输出跟踪事件
+void toggle_trace(TraceDumper *self, int unused) {
+    if (self->drainMsg) {
+        ABORT(self->drainMsg);
+        self->drainMsg = 0;
+        SCI_WRITE(&sci0, "Trace stopped\n");
+    } else {
+        SCI_WRITE(&sci0, "Trace started\n");
+        self->drainMsg = PERIODIC(MSEC(10), 0, self, drain_trace, 0);
+    }
 }
 
 /////////////////////////////////////////////////////////////////////////////
 // 后台任务函数
 void load_task(BackgroundTask *self, int unused) {
     for (volatile int i = 0; i < self->background_loop_range; i++) { }
-    if (self->deadline)
-        SEND(USEC(1300), USEC(1300), self, load_task, 0);
-    else
-        AFTER(USEC(1300), self, load_task, 0);
+}
+
+// 以1300us周期（重新）启动后台任务
+void start_load(BackgroundTask *self, int unused) {
+    ABORT(self->loadMsg);
+    self->loadMsg = PERIODIC(USEC(1300), self->deadline ? USEC(1300) : 0, self, load_task, 0);
 }
 
 void increase_load(BackgroundTask *self, int unused) {
     if (self->background_loop_range + 500 <= 20000) {
         self->background_loop_range += 500;
-        char msg[50];
-        snprintf(msg, sizeof(msg), "Increased load: %d\n", self->background_loop_range);
-        SCI_WRITE(&sci0, msg);
+        SCI_PRINTF(&sci0, "Increased load: %d\n", self->background_loop_range);
+        tm_load(self);
     } else {
         SCI_WRITE(&sci0, "Max load Already!\n");
     }
@@ -301,9 +741,8 @@ void increase_load(BackgroundTask *self, int unused) {
 void decrease_load(BackgroundTask *self, int unused) {
     if (self->background_loop_range - 500 >= 1000) {
         self->background_loop_range -= 500;
-        char msg[50];
-        snprintf(msg, sizeof(msg), "Decreased load: %d\n", self->background_loop_range);
-        SCI_WRITE(&sci0, msg);
+        SCI_PRINTF(&sci0, "Decreased load: %d\n", self->background_loop_range);
+        tm_load(self);
     } else {
         SCI_WRITE(&sci0, "Min load Already!\n");
     }
@@ -311,6 +750,11 @@ void decrease_load(BackgroundTask *self, int unused) {
 
 void toggle_deadline(BackgroundTask *self, int unused) {
     self->deadline = !self->deadline;
+    // 周期性消息的deadline在启动时确定，切换后需重新启动
+    if (self->loadMsg)
+        start_load(self, 0);
+    ASYNC(&toneGen, restart_tone, 0);
+    tm_load(self);
     if (self->deadline)
         SCI_WRITE(&sci0, "Deadline Enabled\n");
     else
@@ -323,6 +767,8 @@ void increase_volume(ToneGenerator *self, int unused) {
     if (self->volume < 20) {
         self->volume += 1;
         SCI_WRITE(&sci0, "Increased Volume\n");
+        tone_changed(self);
+        tm_tone(self);
     } else {
         SCI_WRITE(&sci0, "Max Volume Already!\n");
     }
@@ -332,6 +778,8 @@ void decrease_volume(ToneGenerator *self, int unused) {
     if (self->volume > 1) {
         self->volume -= 1;
         SCI_WRITE(&sci0, "Decreased Volume\n");
+        tone_changed(self);
+        tm_tone(self);
     } else {
         SCI_WRITE(&sci0, "Min Volume Already!\n");
     }
@@ -339,112 +787,310 @@ void decrease_volume(ToneGenerator *self, int unused) {
 
 void toggle_mute(ToneGenerator *self, int unused) {
     self->muted = !self->muted;
+    tone_changed(self);
+    tm_tone(self);
     if (self->muted)
         SCI_WRITE(&sci0, "Muted!\n");
     else
         SCI_WRITE(&sci0, "Unmuted!\n");
 }
 
+void set_mute(ToneGenerator *self, int on) {
+    self->muted = on;
+    tone_changed(self);
+    tm_tone(self);
+}
+
 /////////////////////////////////////////////////////////////////////////////
-// CAN相关函数
-void send_CAN_command(char *cmd) {
-    CANMsg msg;
-    msg.msgId = 1;
-    msg.nodeId = 1;
-    msg.length = strlen(cmd);
-    memset(msg.buff, 0, sizeof(msg.buff));
-    snprintf((char *)msg.buff, sizeof(msg.buff), "%s", cmd);
-    SCI_WRITE(&sci0, "Sending CAN command: \"");
-    SCI_WRITE(&sci0, cmd);
-    SCI_WRITE(&sci0, "\"\n");
-    CAN_SEND(&can0, &msg);
+// CAN命令的处理方法，由命令表直接派发
+void cmd_key(App *self, int key) {
+    self->current_key = key;
+    musicPlayer.key = key;
+    SCI_PRINTF(&sci0, "CAN: key updated to %d\n", key);
+    tm_value(TM_KEY, key, 1);
 }
 
-void process_CAN_message(App *self, char *buffer) {
-    // 检查断线与重连消息
-    if (strcmp(buffer, "disconnect") == 0) {
-        canConnected = 0;
-        SCI_WRITE(&sci0, "CAN disconnected.\n");
-        return;
+void cmd_tempo(App *self, int bpm) {
+    self->tempo = bpm;
+    musicPlayer.tempo = bpm;
+    SCI_PRINTF(&sci0, "CAN: tempo updated to %d bpm\n", bpm);
+    tm_value(TM_TEMPO, bpm, 2);
+}
+
+void cmd_play(App *self, int unused) {
+    if (self->mode == CONDUCTOR_MODE) {
+        // 指挥家模式下由本地控制播放
+    } else if (!self->playback_active) {
+        toneGen.playing = 1;
+        self->playback_active = 1;
+        SCI_WRITE(&sci0, "CAN: play command received\n");
+        ASYNC(&musicPlayer, start_playback, 0);
+    } else {
+        SCI_WRITE(&sci0, "Already playing. Duplicate play command ignored.\n");
     }
-    if (strcmp(buffer, "reconnect") == 0) {
-        canConnected = 1;
+}
+
+void cmd_stop(App *self, int unused) {
+    if (self->mode == CONDUCTOR_MODE) {
+        // 指挥家模式下由本地控制停止播放
+    } else {
+        toneGen.playing = 0;
+        self->playback_active = 0;
+        SYNC(&musicPlayer, stop_playback, 0);
+        SYNC(&toneGen, stop_note, ALL_PARTS);
+        SCI_WRITE(&sci0, "CAN: stop command received\n");
+    }
+}
+
+// 模拟断线与重连
+void cmd_connect(App *self, int on) {
+    canConnected = on;
+    if (on) {
         SCI_WRITE(&sci0, "CAN reconnected.\n");
         flushInputCache();
-        return;
-    }
-    if (buffer[0] == 'K') {
-        int new_key = atoi(buffer + 1);
-        self->current_key = new_key;
-        musicPlayer.key = new_key;
-        char msg[50];
-        snprintf(msg, sizeof(msg), "CAN: key updated to %d\n", new_key);
-        SCI_WRITE(&sci0, msg);
-        //get_period_key(self, new_key);
-    }
-    else if (buffer[0] == 'T') {
-        int new_tempo = atoi(buffer + 1);
-        self->tempo = new_tempo;
-        musicPlayer.tempo = new_tempo;
-        char msg[50];
-        snprintf(msg, sizeof(msg), "CAN: tempo updated to %d bpm\n", new_tempo);
-        SCI_WRITE(&sci0, msg);
-    }
-    else if (strcmp(buffer, "play") == 0) {
-        if (self->mode == CONDUCTOR_MODE) {
-            // 指挥家模式下由本地控制播放
-        } else {
-            if (!self->playback_active) {
-                toneGen.playing = 1;
-                self->playback_active = 1;
-                SCI_WRITE(&sci0, "CAN: play command received\n");
-                ASYNC(&musicPlayer, start_playback, 0);
-            } else {
-                SCI_WRITE(&sci0, "Already playing. Duplicate play command ignored.\n");
-            }
-        }
+    } else {
+        SCI_WRITE(&sci0, "CAN disconnected.\n");
     }
-    else if (strcmp(buffer, "stop") == 0) {
-        if (self->mode == CONDUCTOR_MODE) {
-            // 指挥家模式下由本地控制停止播放
-        } else {
-            toneGen.playing = 0;
-            self->playback_active = 0;
-            DAC_Address = 0;
-            SCI_WRITE(&sci0, "CAN: stop command received\n");
-        }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// CAN命令协议
+// 二进制帧：操作码(1, >=0x80) + 序号(1) + 参数(size字节，小端序)，
+// 首字节小于0x80的帧按文本命令处理（调试用，'x' 切换发送文本命令）。
+// 两种形式都经commands表直接派发到目标对象的方法。
+enum {
+    OP_KEY = 0x80,
+    OP_TEMPO,
+    OP_PLAY,
+    OP_STOP,
+    OP_MUTE,
+    OP_UNMUTE,
+    OP_VOLUP,
+    OP_VOLDOWN,
+    OP_INC_LOAD,
+    OP_DEC_LOAD,
+    OP_TOGGLE_DEADLINE,
+    OP_DISCONNECT,
+    OP_RECONNECT,
+    OP_END
+};
+
+typedef struct {
+    const char *text;   // 文本形式，带参数的命令为printf格式
+    int size;           // 参数字节数，负数表示有符号，0表示传入arg
+    int urgent;         // 1：以CAN_ID_URGENT发送（经FIFO1接收）
+    Object *obj;
+    Method meth;
+    int arg;
+} Command;
+
+#define CMD(text, size, urgent, obj, meth, arg) { text, size, urgent, (Object*)(obj), (Method)(meth), arg }
+
+const Command commands[OP_END - OP_KEY] = {
+    [OP_KEY - OP_KEY]             = CMD("K%d", -1, 0, &app, cmd_key, 0),
+    [OP_TEMPO - OP_KEY]           = CMD("T%d", 1, 0, &app, cmd_tempo, 0),
+    [OP_PLAY - OP_KEY]            = CMD("play", 0, 0, &app, cmd_play, 0),
+    [OP_STOP - OP_KEY]            = CMD("stop", 0, 1, &app, cmd_stop, 0),
+    [OP_MUTE - OP_KEY]            = CMD("mute", 0, 1, &toneGen, set_mute, 1),
+    [OP_UNMUTE - OP_KEY]          = CMD("unmute", 0, 0, &toneGen, set_mute, 0),
+    [OP_VOLUP - OP_KEY]           = CMD("volup", 0, 0, &toneGen, increase_volume, 0),
+    [OP_VOLDOWN - OP_KEY]         = CMD("voldown", 0, 0, &toneGen, decrease_volume, 0),
+    [OP_INC_LOAD - OP_KEY]        = CMD("inc_load", 0, 0, &bgTask, increase_load, 0),
+    [OP_DEC_LOAD - OP_KEY]        = CMD("dec_load", 0, 0, &bgTask, decrease_load, 0),
+    [OP_TOGGLE_DEADLINE - OP_KEY] = CMD("toggle_deadline", 0, 0, &bgTask, toggle_deadline, 0),
+    [OP_DISCONNECT - OP_KEY]      = CMD("disconnect", 0, 0, &app, cmd_connect, 0),
+    [OP_RECONNECT - OP_KEY]       = CMD("reconnect", 0, 0, &app, cmd_connect, 1),
+};
+
+void dispatch_command(const Command *c, int arg) {
+    ASYNC(c->obj, c->meth, c->size ? arg : c->arg);
+}
+
+// 单帧装不下文本命令及其结尾'\0'时改用分段传输
+void send_CAN_text(const Command *c, int arg) {
+    CANMsg msg;
+    CanTpMsg tp;
+    char text[CAN_TP_SIZE];
+    int length = snprintf(text, sizeof(text), c->text, arg);
+    SCI_PRINTF(&sci0, "Sending CAN command: \"%s\"\n", text);
+    if (length >= sizeof(msg.buff)) {
+        memcpy(tp.data, text, length);
+        tp.length = length;
+        if (CAN_TP_SEND(&canTp, &tp))
+            SCI_WRITE(&sci0, "CAN segmented transfer busy, command dropped\n");
+        return;
     }
-    else if (strcmp(buffer, "mute") == 0) {
-        toneGen.muted = 1;
+    msg.msgId = c->urgent ? CAN_ID_URGENT : CAN_ID_COMMAND;
+    msg.nodeId = NODE_ID;
+    msg.length = length;
+    memset(msg.buff, 0, sizeof(msg.buff));
+    memcpy(msg.buff, text, length);
+    if (CAN_SEND(&can0, &msg))
+        SCI_WRITE(&sci0, "CAN tx queue full, command dropped\n");
+}
+
+void send_CAN_command(int op, int arg) {
+    const Command *c = &commands[op - OP_KEY];
+    CANMsg msg;
+    int size = c->size < 0 ? -c->size : c->size;
+    if (textCommands) {
+        send_CAN_text(c, arg);
+        return;
     }
-    else if (strcmp(buffer, "unmute") == 0) {
-        toneGen.muted = 0;
+    msg.msgId = c->urgent ? CAN_ID_URGENT : CAN_ID_COMMAND;
+    msg.nodeId = NODE_ID;
+    msg.length = 2 + size;
+    msg.buff[0] = op;
+    msg.buff[1] = commandSeq++;
+    for (int i = 0; i < size; i++)
+        msg.buff[2 + i] = arg >> (8 * i);
+    if (CAN_SEND(&can0, &msg))
+        SCI_WRITE(&sci0, "CAN tx queue full, command dropped\n");
+}
+
+// 序号与上一条相同的为重复命令，返回0；序号回退的为迟到命令，照常执行
+int check_sequence(CommandStats *s, int nodeId, uint8_t seq) {
+    int8_t gap = seq - s->seq[nodeId] - 1;
+    s->received++;
+    if (!(s->seen & 1 << nodeId)) {
+        s->seen |= 1 << nodeId;
+    } else if (gap == -1) {
+        s->duplicates++;
+        return 0;
+    } else if (gap < -1) {
+        if (s->lost > 0)
+            s->lost--;
+        return 1;
+    } else {
+        s->lost += gap;
     }
-    else if (strcmp(buffer, "volup") == 0) {
-        ASYNC(&toneGen, increase_volume, 0);
+    s->seq[nodeId] = seq;
+    return 1;
+}
+
+void process_CAN_binary(App *self, uint8_t *data, int length, int nodeId) {
+    const Command *c;
+    int size, arg = 0;
+    if (data[0] >= OP_END || length < 2)
+        return;
+    c = &commands[data[0] - OP_KEY];
+    size = c->size < 0 ? -c->size : c->size;
+    if (length < 2 + size || !check_sequence(&commandStats, nodeId, data[1]))
+        return;
+    for (int i = size - 1; i >= 0; i--)
+        arg = arg << 8 | data[2 + i];
+    if (c->size < 0 && size < sizeof(int))          // 符号扩展
+        arg = (arg ^ 1 << (8 * size - 1)) - (1 << (8 * size - 1));
+    dispatch_command(c, arg);
+}
+
+// 文本回退：按commands表中的文本形式匹配
+void process_CAN_message(App *self, char *buffer) {
+    for (int op = OP_KEY; op < OP_END; op++) {
+        const Command *c = &commands[op - OP_KEY];
+        const char *f = strchr(c->text, '%');
+        if (f && strncmp(buffer, c->text, f - c->text) == 0) {
+            dispatch_command(c, atoi(buffer + (f - c->text)));
+            return;
+        }
+        if (!f && strcmp(buffer, c->text) == 0) {
+            dispatch_command(c, 0);
+            return;
+        }
     }
-    else if (strcmp(buffer, "voldown") == 0) {
-        ASYNC(&toneGen, decrease_volume, 0);
+}
+
+void process_CAN_payload(App *self, uint8_t *data, int length, int nodeId) {
+    char text[CAN_TP_SIZE + 1];
+    if (length == 0)
+        return;
+    if (data[0] >= OP_KEY) {
+        process_CAN_binary(self, data, length, nodeId);
+        return;
     }
+    memcpy(text, data, length);
+    text[length] = '\0';
+    // 无论在哪种模式下，都打印接收到的文本命令
+    SCI_PRINTF(&sci0, "CAN msg received from node %d: %s\n", nodeId, text);
+    process_CAN_message(self, text);
+}
+
+void print_CAN_message(App *self, CANMsg *msg) {
+    process_CAN_payload(self, msg->buff, msg->length, msg->nodeId);
 }
 
 void receiver(App *self, int unused) {
     CANMsg msg;
     CAN_RECEIVE(&can0, &msg);
-    if (msg.length < sizeof(msg.buff))
-        msg.buff[msg.length] = '\0';
-    else
-        msg.buff[sizeof(msg.buff) - 1] = '\0';
-    // 无论在哪种模式下，都打印接收到的CAN消息
-    SCI_WRITE(&sci0, "CAN msg received: ");
-    SCI_WRITE(&sci0, msg.buff);
-    SCI_WRITE(&sci0, "\n");
-    process_CAN_message(self, (char *)msg.buff);
+    // 分段传输的数据帧与流控帧交给canTp，重组完成后由segment_receiver处理
+    if (CAN_TP_FRAME(&canTp, &msg) == 0)
+        return;
+    print_CAN_message(self, &msg);
+}
+
+// FIFO1中的紧急命令（stop/mute）由单独的中断与方法处理
+void urgent_receiver(App *self, int unused) {
+    CANMsg msg;
+    CAN_RECEIVE1(&can0, &msg);
+    print_CAN_message(self, &msg);
+}
+
+// 节点nodeId发来的分段命令已重组完毕
+void segment_receiver(App *self, int nodeId) {
+    CanTpMsg tp;
+    tp.nodeId = nodeId;
+    if (CAN_TP_RECEIVE(&canTp, &tp))
+        return;
+    process_CAN_payload(self, tp.data, tp.length, nodeId);
 }
 
 /////////////////////////////////////////////////////////////////////////////
 // 键盘输入处理函数
 void reader(App *self, int c) {
+    // 按 'w' 打印各方法的执行/响应时间统计（min/avg/max）
+    if (c == 'w') {
+        SCI_WRITE(&sci0, "Method profile (min/avg/max):\n");
+        print_profile();
+        SCI_WRITE(&sci0, "Deadline misses:\n");
+        print_deadline_misses();
+        print_can_stats();
+#if TONE_OUTPUT == TONE_SYNTH
+        SCI_PRINTF(&sci0, "Synth: notes %u, voices stolen %u\n",
+                   toneGen.mixer.notes, toneGen.mixer.steals);
+#endif
+        return;
+    }
+    // 按 'r' 开始/停止通过SCI输出调度跟踪事件（需在TinyTimber.h中启用__USE_TRACE）
+    if (c == 'r') {
+        ASYNC(&tracer, toggle_trace, 0);
+        return;
+    }
+    // 按 'b' 开始/停止发送二进制遥测帧
+    if (c == 'b') {
+        ASYNC(&telemetry, toggle_telemetry, 0);
+        return;
+    }
+#if TONE_OUTPUT == TONE_SYNTH
+    // 按 'y' 切换本板输出的波形
+    if (c == 'y') {
+        ASYNC(&toneGen, next_waveform, 0);
+        return;
+    }
+    // 按 'n' 设置本板演奏的轮唱声部数
+    if (c == 'n') {
+        ASYNC(&musicPlayer, next_parts, 0);
+        return;
+    }
+#endif
+    // 按 'x' 切换以文本/二进制发送CAN命令
+    if (c == 'x') {
+        textCommands = !textCommands;
+        if (textCommands)
+            SCI_WRITE(&sci0, "CAN commands sent as text\n");
+        else
+            SCI_WRITE(&sci0, "CAN commands sent as binary\n");
+        return;
+    }
     // 按 'z' 切换模式
     if (c == 'z') {
         if (self->mode == CONDUCTOR_MODE) {
@@ -468,18 +1114,16 @@ void reader(App *self, int c) {
                 if (num >= -5 && num <= 5) {
                     self->current_key = num;
                     musicPlayer.key = num;
+                    tm_value(TM_KEY, num, 1);
                     //get_period_key(self, num);
-                    char can_cmd[8];
-                  snprintf(can_cmd, sizeof(can_cmd), "K%d", num);
-                    send_CAN_command(can_cmd);
+                    send_CAN_command(OP_KEY, num);
                     flushInputCache();
                 }
                 else if (num >= 60 && num <= 240) {
                     self->tempo = num;
                     musicPlayer.tempo = num;
-                    char can_cmd[8];
-                    snprintf(can_cmd, sizeof(can_cmd), "T%d", num);
-                    send_CAN_command(can_cmd);
+                    tm_value(TM_TEMPO, num, 2);
+                    send_CAN_command(OP_TEMPO, num);
                     SCI_WRITE(&sci0, "Tempo updated\n");
                 }
                 else {
@@ -491,20 +1135,20 @@ void reader(App *self, int c) {
             case 'u':
                 ASYNC(&toneGen, increase_volume, 0);
                 SCI_WRITE(&sci0, "Volume Up\n");
-                send_CAN_command("volup");
+                send_CAN_command(OP_VOLUP, 0);
                 break;
             case 'd':
                 ASYNC(&toneGen, decrease_volume, 0);
                 SCI_WRITE(&sci0, "Volume Down\n");
-                send_CAN_command("voldown");
+                send_CAN_command(OP_VOLDOWN, 0);
                 break;
             case 'm':
                 SYNC(&toneGen, toggle_mute, 0);
                 SCI_WRITE(&sci0, "Mute toggled\n");
                 if (toneGen.muted)
-                    send_CAN_command("mute");
+                    send_CAN_command(OP_MUTE, 0);
                 else
-                    send_CAN_command("unmute");
+                    send_CAN_command(OP_UNMUTE, 0);
                 break;
             case 'p':
                 SCI_WRITE(&sci0, "Starting melody playback...\n");
@@ -512,7 +1156,7 @@ void reader(App *self, int c) {
         self->playback_active = 1;
         toneGen.playing = 1;
         ASYNC(&musicPlayer, start_playback, 0);
-        send_CAN_command("play");
+        send_CAN_command(OP_PLAY, 0);
     } else {
         SCI_WRITE(&sci0, "Already playing. Duplicate play command ignored.\n");
     }
@@ -521,8 +1165,9 @@ void reader(App *self, int c) {
                 SCI_WRITE(&sci0, "Stopping melody playback...\n");
                 toneGen.playing = 0;
                 self->playback_active = 0;
-                DAC_Address = 0;
-                send_CAN_command("stop");
+                SYNC(&musicPlayer, stop_playback, 0);
+                SYNC(&toneGen, stop_note, ALL_PARTS);
+                send_CAN_command(OP_STOP, 0);
                 break;
             case '+':
                 ASYNC(&bgTask, increase_load, 0);
@@ -549,14 +1194,10 @@ void reader(App *self, int c) {
                 int num = atoi(self->buffer);
                 self->buf_index = 0;
                 if (num >= -5 && num <= 5) {
-                    char can_cmd[8];
-                    snprintf(can_cmd, sizeof(can_cmd), "K%d", num);
-                    send_CAN_command(can_cmd);
+                    send_CAN_command(OP_KEY, num);
                 }
                 else if (num >= 60 && num <= 240) {
-                    char can_cmd[8];
-                    snprintf(can_cmd, sizeof(can_cmd), "T%d", num);
-                    send_CAN_command(can_cmd);
+                    send_CAN_command(OP_TEMPO, num);
                 }
                 else {
                     SCI_WRITE(&sci0, "Invalid input in Musician Mode.\n");
@@ -565,44 +1206,44 @@ void reader(App *self, int c) {
             }
             case 'u':
                 SCI_WRITE(&sci0, "Musician Mode: Volume Up\n");
-                send_CAN_command("volup");
+                send_CAN_command(OP_VOLUP, 0);
                 break;
             case 'd':
                 SCI_WRITE(&sci0, "Musician Mode: Volume Down\n");
-                send_CAN_command("voldown");
+                send_CAN_command(OP_VOLDOWN, 0);
                 break;
             case 'm':
                 SCI_WRITE(&sci0, "Musician Mode: Mute toggled\n");
                 if (toneGen.muted)
-                    send_CAN_command("unmute");
+                    send_CAN_command(OP_UNMUTE, 0);
                 else
-                    send_CAN_command("mute");
+                    send_CAN_command(OP_MUTE, 0);
                 break;
 
             case 'p':
                SCI_WRITE(&sci0, "Musician Mode: Play command\n");
     // 添加检查：如果已经在播放，则不再发送新的play命令
     if (!app.playback_active) {
-        send_CAN_command("play");
+        send_CAN_command(OP_PLAY, 0);
     } else {
         SCI_WRITE(&sci0, "Already playing. Duplicate play command ignored.\n");
     }
     break;
             case 'q':
                 SCI_WRITE(&sci0, "Musician Mode: Stop command\n");
-                send_CAN_command("stop");
+                send_CAN_command(OP_STOP, 0);
                 break;
             case '+':
                 SCI_WRITE(&sci0, "Musician Mode: Increase load command\n");
-                send_CAN_command("inc_load");
+                send_CAN_command(OP_INC_LOAD, 0);
                 break;
             case '_':
                 SCI_WRITE(&sci0, "Musician Mode: Decrease load command\n");
-                send_CAN_command("dec_load");
+                send_CAN_command(OP_DEC_LOAD, 0);
                 break;
             case 't':
                 SCI_WRITE(&sci0, "Musician Mode: Toggle deadline command\n");
-                send_CAN_command("toggle_deadline");
+                send_CAN_command(OP_TOGGLE_DEADLINE, 0);
                 break;
             default:
                 if (self->buf_index < sizeof(self->buffer) - 1)
@@ -619,7 +1260,13 @@ void reader(App *self, int c) {
 // 应用程序启动函数
 void startApp(App *self, int arg) {
     CANMsg msg;
+    CanFilter urgent = { CAN_ID_URGENT, 0x7F, 0, 0, 1 };     // 任意节点
+    CanFilter command = { CAN_ID_COMMAND, 0x7F, 0, 0, 0 };
+    CanFilter segment = { CAN_ID_SEGMENT, 0x7E, 0, 0, 0 };   // 数据帧与流控帧
     CAN_INIT(&can0);
+    CAN_FILTER(&can0, &urgent);     // 替换startup.c中接收全部报文的滤波器
+    CAN_FILTER(&can0, &command);
+    CAN_FILTER(&can0, &segment);
     SCI_INIT(&sci0);
     SCI_WRITE(&sci0, "Hello, hello...\n");
     
@@ -630,14 +1277,21 @@ void startApp(App *self, int arg) {
     self->tempo = DEFAULT_TEMPO;
     
     init_dwt();
+    T_RESET(&telemetry.clock);
+    DAC_INIT(&dac0);
+#if TONE_OUTPUT == TONE_SYNTH
+    SYNC(&toneGen, start_synth, 0);
+#elif TONE_OUTPUT == TONE_PWM
+    PWM_INIT(&pwm0);
+#endif
     
-    ASYNC(&toneGen, generate_tone, 0);
-    // 如需要可启动后台任务： ASYNC(&bgTask, load_task, 0);
+    ASYNC(&toneGen, restart_tone, 0);
+    // 如需要可启动后台任务： ASYNC(&bgTask, start_load, 0);
     
     // 启动时不自动启动旋律播放，需按 'p' 键启动
     
-    msg.msgId = 1;
-    msg.nodeId = 1;
+    msg.msgId = CAN_ID_COMMAND;
+    msg.nodeId = NODE_ID;
     msg.length = 6;
     msg.buff[0] = 'H';
     msg.buff[1] = 'e';